@@ -0,0 +1,383 @@
+/*
+ * Copyright (c) 2026 Tim van der Molen <tim@kariliq.nl>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Benchmark nbu-export on a synthetic backup. For each phase, the best time
+ * out of a number of runs is reported.
+ */
+
+#include <sys/stat.h>
+
+#include <err.h>
+#include <ftw.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gen.h"
+#include "nbu.h"
+#include "utf.h"
+
+#ifndef nitems
+#define nitems(a) (sizeof (a) / sizeof (a)[0])
+#endif
+
+struct phase {
+	const char	*name;
+	int		 sections;
+	struct gen_section *result;
+};
+
+static char	*workdir;
+static int	 njobs = 1;
+static int	 nruns = 3;
+
+__dead void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-c vcards] [-e memos] [-f folders] "
+	    "[-j jobs] [-M mms]\n"
+	    "       [-m messages] [-n runs] [-o backup] [-s seed] "
+	    "[-z mms-size]\n",
+	    getprogname());
+	exit(1);
+}
+
+static size_t
+parse_count(const char *s, const char *what)
+{
+	const char *errstr;
+	size_t n;
+
+	n = strtonum(s, 0, INT_MAX, &errstr);
+	if (errstr != NULL)
+		errx(1, "%s: %s is %s", s, what, errstr);
+
+	return n;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		err(1, "clock_gettime");
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+remove_file(const char *path, __unused const struct stat *st,
+    __unused int flag, __unused struct FTW *ftw)
+{
+	if (remove(path) == -1)
+		warn("remove: %s", path);
+
+	return 0;
+}
+
+static void
+remove_dir(const char *path)
+{
+	nftw(path, remove_file, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+static void
+report(const char *name, double t, size_t size, size_t nitems)
+{
+	printf("%-12s %10.3f ms %10.1f MB/s %12.0f items/s\n", name, t * 1e3,
+	    size / t / 1e6, nitems / t);
+}
+
+/* Open the backup and parse all sections by creating an index */
+static void
+bench_open(const char *backup, const struct gen_result *result)
+{
+	struct nbu_ctx *ctx;
+	char *index;
+	double best, t;
+	int i;
+
+	if (asprintf(&index, "%s/index", workdir) == -1)
+		errx(1, "asprintf() failed");
+
+	best = 0;
+
+	for (i = 0; i < nruns; i++) {
+		unlink(index);
+		t = now();
+		if (nbu_open(&ctx, backup, index) == -1)
+			errx(1, "%s: cannot open backup", backup);
+		t = now() - t;
+		nbu_close(ctx);
+
+		if (i == 0 || t < best)
+			best = t;
+	}
+
+	unlink(index);
+	free(index);
+	report("open+index", best, result->size,
+	    result->calendar.nitems + result->contacts.nitems +
+	    result->memos.nitems + result->messages.nitems +
+	    result->mms.nitems);
+}
+
+/* Convert messages from UTF-16 to UTF-8 without any I/O */
+static void
+bench_transcode(const struct gen_params *params)
+{
+	struct gen_buf buf;
+	size_t *end, i, len, nmessages, start;
+	uint8_t *utf8;
+	uint32_t rng;
+	double best, t;
+	int run;
+
+	memset(&buf, 0, sizeof buf);
+	rng = (params->seed != 0) ? params->seed : 1;
+	nmessages = params->nfolders * params->nmessages;
+
+	if (nmessages == 0)
+		return;
+
+	if ((end = calloc(nmessages, sizeof *end)) == NULL)
+		err(1, NULL);
+
+	for (i = 0; i < nmessages; i++) {
+		gen_message(&buf, &rng, i);
+		end[i] = buf.len;
+	}
+
+	/* Each UTF-16 code unit becomes at most 3 UTF-8 bytes */
+	if ((utf8 = malloc(buf.len / 2 * 3 + 1)) == NULL)
+		err(1, NULL);
+
+	best = 0;
+
+	for (run = 0; run < nruns; run++) {
+		t = now();
+		for (i = 0, start = 0; i < nmessages; start = end[i++]) {
+			len = (end[i] - start) / 2;
+			utf16le_convert_to_utf8(utf8, buf.data + start, &len);
+		}
+		t = now() - t;
+
+		if (run == 0 || t < best)
+			best = t;
+	}
+
+	report("transcode", best, buf.len, nmessages);
+	free(utf8);
+	free(end);
+	gen_buf_free(&buf);
+}
+
+static int
+visit_item(const struct nbu_item *item, void *arg)
+{
+	size_t *len;
+
+	len = arg;
+	*len += item->len;
+	return 0;
+}
+
+/* Pass all items to a function, converting them to UTF-8 */
+static void
+bench_visit(const char *backup, const struct gen_result *result)
+{
+	struct nbu_ctx *ctx;
+	size_t len;
+	double best, t;
+	int i;
+
+	best = 0;
+
+	for (i = 0; i < nruns; i++) {
+		if (nbu_open(&ctx, backup, NULL) == -1)
+			errx(1, "%s: cannot open backup", backup);
+
+		len = 0;
+		t = now();
+		if (nbu_visit(ctx, NBU_VISIT_UTF8, visit_item, &len) == -1)
+			errx(1, "%s: cannot visit backup", backup);
+		t = now() - t;
+		nbu_close(ctx);
+
+		if (i == 0 || t < best)
+			best = t;
+	}
+
+	report("visit", best, result->size,
+	    result->calendar.nitems + result->contacts.nitems +
+	    result->memos.nitems + result->messages.nitems +
+	    result->mms.nitems);
+}
+
+/* Export one section to a fresh directory */
+static void
+bench_export(const char *backup, const struct phase *phase)
+{
+	struct nbu_ctx *ctx;
+	char *dir;
+	double best, t;
+	int i;
+
+	if (asprintf(&dir, "%s/%s", workdir, phase->name) == -1)
+		errx(1, "asprintf() failed");
+
+	best = 0;
+
+	for (i = 0; i < nruns; i++) {
+		remove_dir(dir);
+
+		if (nbu_open(&ctx, backup, NULL) == -1)
+			errx(1, "%s: cannot open backup", backup);
+
+		nbu_set_jobs(ctx, njobs);
+		nbu_select_sections(ctx, phase->sections);
+
+		t = now();
+		if (nbu_export(ctx, dir) == -1)
+			errx(1, "%s: cannot export backup", backup);
+		t = now() - t;
+		nbu_close(ctx);
+
+		if (i == 0 || t < best)
+			best = t;
+	}
+
+	remove_dir(dir);
+	free(dir);
+	report(phase->name, best, phase->result->size, phase->result->nitems);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct gen_params params;
+	struct gen_result result;
+	const char *backup, *errstr;
+	char *path;
+	size_t i;
+	int ch;
+
+	struct phase phases[] = {
+		{ "calendar", NBU_EXPORT_CALENDAR, &result.calendar },
+		{ "contacts", NBU_EXPORT_CONTACTS, &result.contacts },
+		{ "memos", NBU_EXPORT_MEMOS, &result.memos },
+		{ "messages", NBU_EXPORT_MESSAGES, &result.messages },
+		{ "mms", NBU_EXPORT_MMS, &result.mms },
+	};
+
+	params.seed = 1;
+	params.nfolders = 4;
+	params.nmessages = 5000;
+	params.nmms = 100;
+	params.mms_size = 65536;
+	params.nmemos = 100;
+	params.nvcards = 1000;
+	backup = NULL;
+
+	while ((ch = getopt(argc, argv, "c:e:f:j:M:m:n:o:s:z:")) != -1)
+		switch (ch) {
+		case 'c':
+			params.nvcards = parse_count(optarg, "number of vCards");
+			break;
+		case 'e':
+			params.nmemos = parse_count(optarg, "number of memos");
+			break;
+		case 'f':
+			params.nfolders = parse_count(optarg,
+			    "number of folders");
+			break;
+		case 'j':
+			njobs = strtonum(optarg, 1, 64, &errstr);
+			if (errstr != NULL)
+				errx(1, "%s: number of jobs is %s", optarg,
+				    errstr);
+			break;
+		case 'M':
+			params.nmms = parse_count(optarg, "number of MMS");
+			break;
+		case 'm':
+			params.nmessages = parse_count(optarg,
+			    "number of messages");
+			break;
+		case 'n':
+			nruns = strtonum(optarg, 1, INT_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "%s: number of runs is %s", optarg,
+				    errstr);
+			break;
+		case 'o':
+			backup = optarg;
+			break;
+		case 's':
+			params.seed = parse_count(optarg, "seed");
+			break;
+		case 'z':
+			params.mms_size = parse_count(optarg, "MMS size");
+			break;
+		default:
+			usage();
+		}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 0)
+		usage();
+
+	/* With -o, only write the backup */
+	if (backup != NULL)
+		return gen_backup(backup, &params, &result) == -1;
+
+	if ((workdir = strdup("/tmp/nbu-bench.XXXXXXXXXX")) == NULL)
+		err(1, NULL);
+
+	if (mkdtemp(workdir) == NULL)
+		err(1, "mkdtemp");
+
+	if (asprintf(&path, "%s/backup.nbu", workdir) == -1)
+		errx(1, "asprintf() failed");
+
+	if (gen_backup(path, &params, &result) == -1) {
+		remove_dir(workdir);
+		return 1;
+	}
+
+	printf("backup: %.1f MB, %d run%s, %d job%s\n", result.size / 1e6,
+	    nruns, (nruns == 1) ? "" : "s", njobs, (njobs == 1) ? "" : "s");
+
+	bench_open(path, &result);
+	bench_transcode(&params);
+	bench_visit(path, &result);
+
+	for (i = 0; i < nitems(phases); i++)
+		bench_export(path, &phases[i]);
+
+	remove_dir(workdir);
+	free(path);
+	free(workdir);
+	return 0;
+}
@@ -0,0 +1,536 @@
+/*
+ * Copyright (c) 2026 Tim van der Molen <tim@kariliq.nl>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Generate synthetic NBU backups. The layout follows what the section readers
+ * in nbu.c expect. The section directory is written after the sections, so
+ * that the position of each section is known when the directory is written.
+ */
+
+#include <err.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gen.h"
+
+#define GEN_GUID_LEN 16
+
+static const uint8_t gen_calendar_guid[GEN_GUID_LEN] = {
+	0x16, 0xcd, 0xf8, 0xe8, 0x23, 0x5e, 0x5a, 0x4e,
+	0xb7, 0x35, 0xdd, 0xdf, 0xf1, 0x48, 0x12, 0x22
+};
+
+static const uint8_t gen_contacts_guid[GEN_GUID_LEN] = {
+	0xef, 0xd4, 0x2e, 0xd0, 0xa3, 0x51, 0x38, 0x47,
+	0x9d, 0xd7, 0x30, 0x5c, 0x7a, 0xf0, 0x68, 0xd3
+};
+
+static const uint8_t gen_memos_guid[GEN_GUID_LEN] = {
+	0x5c, 0x62, 0x97, 0x3b, 0xdc, 0xa7, 0x54, 0x41,
+	0xa1, 0xc3, 0x05, 0x9d, 0xe3, 0x24, 0x68, 0x08
+};
+
+static const uint8_t gen_messages_guid[GEN_GUID_LEN] = {
+	0x61, 0x7a, 0xef, 0xd1, 0xaa, 0xbe, 0xa1, 0x49,
+	0x9d, 0x9d, 0x15, 0x5a, 0xbb, 0x4c, 0xeb, 0x8e
+};
+
+static const uint8_t gen_mms_guid[GEN_GUID_LEN] = {
+	0x47, 0x1d, 0xd4, 0x65, 0xef, 0xe3, 0x32, 0x40,
+	0x8c, 0x77, 0x64, 0xca, 0xa3, 0x83, 0xaa, 0x33
+};
+
+static const char *gen_folder_names[] = {
+	"predefinbox",
+	"predefsent",
+	"predefdrafts",
+	"predefoutbox",
+};
+
+/* Mostly ASCII, with some 2-, 3- and 4-byte UTF-8 sequences */
+static const char *gen_words[] = {
+	"hello", "see", "you", "at", "the", "station", "tomorrow", "ok",
+	"0123456789", "w\303\266rld", "\303\261and\303\272",
+	"\320\237\321\200\320\270\320\262\320\265\321\202",
+	"\346\227\245\346\234\254\350\252\236", "\360\237\230\200",
+};
+
+/* The section directory, filled in while writing the sections */
+struct gen_dir_entry {
+	const uint8_t	*guid;
+	uint64_t	 pos;
+	uint64_t	 len;
+	uint32_t	 nitems;
+	uint32_t	 nfolders;
+	uint64_t	*folder_pos;
+};
+
+static uint32_t
+gen_random(uint32_t *state)
+{
+	/* xorshift32 */
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return *state;
+}
+
+static void
+gen_reserve(struct gen_buf *buf, size_t len)
+{
+	uint8_t *data;
+	size_t size;
+
+	if (len <= buf->size - buf->len)
+		return;
+
+	size = (buf->size == 0) ? 65536 : buf->size;
+	while (len > size - buf->len) {
+		if (size > SIZE_MAX / 2)
+			errx(1, "Backup too large");
+		size *= 2;
+	}
+
+	if ((data = realloc(buf->data, size)) == NULL)
+		err(1, NULL);
+
+	buf->data = data;
+	buf->size = size;
+}
+
+static void
+gen_put(struct gen_buf *buf, const void *data, size_t len)
+{
+	gen_reserve(buf, len);
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+}
+
+static void
+gen_put_zero(struct gen_buf *buf, size_t len)
+{
+	gen_reserve(buf, len);
+	memset(buf->data + buf->len, 0, len);
+	buf->len += len;
+}
+
+static void
+gen_put_uint8(struct gen_buf *buf, uint8_t val)
+{
+	gen_put(buf, &val, 1);
+}
+
+static void
+gen_put_uint16(struct gen_buf *buf, uint16_t val)
+{
+	uint8_t b[2];
+
+	b[0] = val;
+	b[1] = val >> 8;
+	gen_put(buf, b, sizeof b);
+}
+
+static void
+gen_put_uint32(struct gen_buf *buf, uint32_t val)
+{
+	gen_put_uint16(buf, val);
+	gen_put_uint16(buf, val >> 16);
+}
+
+static void
+gen_put_uint64(struct gen_buf *buf, uint64_t val)
+{
+	gen_put_uint32(buf, val);
+	gen_put_uint32(buf, val >> 32);
+}
+
+static void
+gen_patch_uint32(struct gen_buf *buf, size_t pos, uint32_t val)
+{
+	buf->data[pos] = val;
+	buf->data[pos + 1] = val >> 8;
+	buf->data[pos + 2] = val >> 16;
+	buf->data[pos + 3] = val >> 24;
+}
+
+/* Append a UTF-8 string as UTF-16LE and return the number of code units */
+static size_t
+gen_put_utf16(struct gen_buf *buf, const char *s)
+{
+	const uint8_t *p;
+	uint32_t c;
+	size_t n;
+
+	n = 0;
+
+	for (p = (const uint8_t *)s; *p != '\0'; n++) {
+		if (*p < 0x80)
+			c = *p++;
+		else if (*p < 0xe0) {
+			c = (p[0] & 0x1f) << 6 | (p[1] & 0x3f);
+			p += 2;
+		} else if (*p < 0xf0) {
+			c = (p[0] & 0x0f) << 12 | (p[1] & 0x3f) << 6 |
+			    (p[2] & 0x3f);
+			p += 3;
+		} else {
+			c = (p[0] & 0x07) << 18 | (p[1] & 0x3f) << 12 |
+			    (p[2] & 0x3f) << 6 | (p[3] & 0x3f);
+			p += 4;
+		}
+
+		if (c < 0x10000)
+			gen_put_uint16(buf, c);
+		else {
+			c -= 0x10000;
+			gen_put_uint16(buf, 0xd800 | c >> 10);
+			gen_put_uint16(buf, 0xdc00 | (c & 0x3ff));
+			n++;
+		}
+	}
+
+	return n;
+}
+
+/* Append a string in the NBU format: a length followed by UTF-16LE */
+static void
+gen_put_string(struct gen_buf *buf, const char *s)
+{
+	size_t len, pos;
+
+	pos = buf->len;
+	gen_put_uint16(buf, 0);
+	len = gen_put_utf16(buf, s);
+	buf->data[pos] = len;
+	buf->data[pos + 1] = len >> 8;
+}
+
+static size_t
+gen_put_text(struct gen_buf *buf, uint32_t *rng, size_t maxwords)
+{
+	size_t i, n, nwords;
+
+	n = 0;
+	nwords = 1 + gen_random(rng) % maxwords;
+
+	for (i = 0; i < nwords; i++) {
+		if (i > 0)
+			n += gen_put_utf16(buf, " ");
+		n += gen_put_utf16(buf,
+		    gen_words[gen_random(rng) % (sizeof gen_words /
+		    sizeof gen_words[0])]);
+	}
+
+	return n;
+}
+
+void
+gen_buf_free(struct gen_buf *buf)
+{
+	free(buf->data);
+	buf->data = NULL;
+	buf->len = buf->size = 0;
+}
+
+/* Append a message in vMessage format, encoded as UTF-16LE */
+void
+gen_message(struct gen_buf *buf, uint32_t *rng, size_t i)
+{
+	char s[64];
+
+	gen_put_utf16(buf,
+	    "BEGIN:VMSG\r\n"
+	    "VERSION:1.1\r\n"
+	    "X-IRMC-STATUS:READ\r\n"
+	    "X-IRMC-BOX:INBOX\r\n"
+	    "BEGIN:VCARD\r\n"
+	    "VERSION:2.1\r\n");
+	snprintf(s, sizeof s, "TEL:+316%08zu\r\n", i % 100000000);
+	gen_put_utf16(buf, s);
+	gen_put_utf16(buf,
+	    "END:VCARD\r\n"
+	    "BEGIN:VENV\r\n"
+	    "BEGIN:VBODY\r\n"
+	    "Date:03.02.2010 10:11:12\r\n");
+	gen_put_text(buf, rng, 40);
+	gen_put_utf16(buf,
+	    "\r\n"
+	    "END:VBODY\r\n"
+	    "END:VENV\r\n"
+	    "END:VMSG\r\n");
+}
+
+static void
+gen_vcard(struct gen_buf *buf, size_t i, int calendar)
+{
+	char s[256];
+
+	if (calendar)
+		snprintf(s, sizeof s,
+		    "BEGIN:VCALENDAR\r\n"
+		    "VERSION:1.0\r\n"
+		    "BEGIN:VEVENT\r\n"
+		    "SUMMARY:Event %zu\r\n"
+		    "DTSTART:20100203T%02zu0000\r\n"
+		    "END:VEVENT\r\n"
+		    "END:VCALENDAR\r\n",
+		    i, i % 24);
+	else
+		snprintf(s, sizeof s,
+		    "BEGIN:VCARD\r\n"
+		    "VERSION:2.1\r\n"
+		    "N:Doe;John %zu\r\n"
+		    "FN:John Doe %zu\r\n"
+		    "TEL;CELL:+316%08zu\r\n"
+		    "END:VCARD\r\n",
+		    i, i, i % 100000000);
+
+	gen_put(buf, s, strlen(s));
+}
+
+static void
+gen_vcard_section(struct gen_buf *buf, struct gen_dir_entry *entry,
+    size_t nitems, int calendar)
+{
+	size_t i, len_pos;
+
+	entry->pos = buf->len;
+	entry->nitems = nitems;
+
+	gen_put_zero(buf, 44);
+	gen_put_uint32(buf, nitems);
+
+	for (i = 0; i < nitems; i++) {
+		gen_put_uint32(buf, 0x10);
+		gen_put_uint32(buf, 0);
+		len_pos = buf->len;
+		gen_put_uint32(buf, 0);
+		gen_vcard(buf, i, calendar);
+		gen_patch_uint32(buf, len_pos, buf->len - len_pos - 4);
+	}
+
+	entry->len = buf->len - entry->pos;
+}
+
+static void
+gen_memos_section(struct gen_buf *buf, struct gen_dir_entry *entry,
+    uint32_t *rng, size_t nmemos)
+{
+	size_t i, len, len_pos;
+
+	entry->pos = buf->len;
+	entry->nitems = nmemos;
+
+	gen_put_zero(buf, 48);
+
+	for (i = 0; i < nmemos; i++) {
+		gen_put_zero(buf, 4);
+		len_pos = buf->len;
+		gen_put_uint16(buf, 0);
+		len = gen_put_text(buf, rng, 100);
+		buf->data[len_pos] = len;
+		buf->data[len_pos + 1] = len >> 8;
+	}
+
+	entry->len = buf->len - entry->pos;
+}
+
+static const char *
+gen_folder_name(size_t i, char *s, size_t size)
+{
+	if (i < sizeof gen_folder_names / sizeof gen_folder_names[0])
+		return gen_folder_names[i];
+
+	snprintf(s, size, "folder-%zu", i);
+	return s;
+}
+
+static void
+gen_folder_section(struct gen_buf *buf, struct gen_dir_entry *entry,
+    const struct gen_params *params, uint32_t *rng, int mms)
+{
+	char name[32];
+	size_t i, j, k, len, len_pos, nitems;
+	uint8_t n;
+
+	entry->pos = buf->len;
+	entry->nitems = 0;
+	entry->nfolders = params->nfolders;
+
+	if (params->nfolders > 0 && (entry->folder_pos =
+	    calloc(params->nfolders, sizeof *entry->folder_pos)) == NULL)
+		err(1, NULL);
+
+	nitems = mms ? params->nmms : params->nmessages;
+
+	for (i = 0; i < params->nfolders; i++) {
+		entry->folder_pos[i] = buf->len;
+		gen_put_zero(buf, 4);
+		gen_put_string(buf, gen_folder_name(i, name, sizeof name));
+		gen_put_uint32(buf, nitems);
+
+		for (j = 0; j < nitems; j++) {
+			gen_put_zero(buf, 8);
+
+			if (mms) {
+				n = gen_random(rng) % 4;
+				gen_put_uint8(buf, n);
+				for (k = 0; k < n; k++) {
+					gen_put_zero(buf, 8);
+					snprintf(name, sizeof name,
+					    "+316%08" PRIu32,
+					    gen_random(rng) % 100000000);
+					gen_put_string(buf, name);
+				}
+
+				gen_put_zero(buf, 20);
+				len = params->mms_size / 2 +
+				    gen_random(rng) % (params->mms_size / 2 +
+				    1);
+				gen_put_uint32(buf, len);
+				gen_reserve(buf, len);
+				for (k = 0; k < len; k++)
+					buf->data[buf->len++] =
+					    gen_random(rng);
+			} else {
+				len_pos = buf->len;
+				gen_put_uint32(buf, 0);
+				gen_message(buf, rng, entry->nitems);
+				gen_patch_uint32(buf, len_pos,
+				    buf->len - len_pos - 4);
+			}
+
+			entry->nitems++;
+		}
+	}
+
+	entry->len = buf->len - entry->pos;
+}
+
+static void
+gen_header(struct gen_buf *buf, struct gen_dir_entry *entries,
+    size_t nentries)
+{
+	size_t i, j;
+
+	/* Position of the header, minus 20 */
+	gen_patch_uint32(buf, 20, buf->len - 20);
+
+	/* File time */
+	gen_put_uint32(buf, 0x01cb1234);
+	gen_put_uint32(buf, 0x89abcdef);
+
+	/* Phone IMEI, model, name, firmware and language */
+	gen_put_string(buf, "351234567890123");
+	gen_put_string(buf, "RM-123");
+	gen_put_string(buf, "Nokia");
+	gen_put_string(buf, "V 20.0");
+	gen_put_string(buf, "en");
+
+	gen_put_zero(buf, 20);
+	gen_put_uint32(buf, nentries);
+
+	for (i = 0; i < nentries; i++) {
+		gen_put(buf, entries[i].guid, GEN_GUID_LEN);
+		gen_put_uint64(buf, entries[i].pos);
+		gen_put_uint64(buf, entries[i].len);
+		gen_put_uint32(buf, entries[i].nitems);
+		gen_put_uint32(buf, entries[i].nfolders);
+
+		for (j = 0; j < entries[i].nfolders; j++) {
+			gen_put_uint32(buf, j);
+			gen_put_uint64(buf, entries[i].folder_pos[j]);
+		}
+	}
+}
+
+static void
+gen_result_section(struct gen_section *section,
+    const struct gen_dir_entry *entry)
+{
+	section->nitems = entry->nitems;
+	section->size = entry->len;
+}
+
+int
+gen_backup(const char *path, const struct gen_params *params,
+    struct gen_result *result)
+{
+	struct gen_buf buf;
+	struct gen_dir_entry entries[5];
+	FILE *fp;
+	size_t i;
+	uint32_t rng;
+	int ret;
+
+	memset(&buf, 0, sizeof buf);
+	memset(entries, 0, sizeof entries);
+	rng = (params->seed != 0) ? params->seed : 1;
+
+	entries[0].guid = gen_calendar_guid;
+	entries[1].guid = gen_contacts_guid;
+	entries[2].guid = gen_memos_guid;
+	entries[3].guid = gen_messages_guid;
+	entries[4].guid = gen_mms_guid;
+
+	/* Magic, followed by the position of the header */
+	gen_put(&buf, "NBF", 4);
+	gen_put_zero(&buf, 24);
+
+	gen_vcard_section(&buf, &entries[0], params->nvcards, 1);
+	gen_vcard_section(&buf, &entries[1], params->nvcards, 0);
+	gen_memos_section(&buf, &entries[2], &rng, params->nmemos);
+	gen_folder_section(&buf, &entries[3], params, &rng, 0);
+	gen_folder_section(&buf, &entries[4], params, &rng, 1);
+	gen_header(&buf, entries, 5);
+
+	result->size = buf.len;
+	gen_result_section(&result->calendar, &entries[0]);
+	gen_result_section(&result->contacts, &entries[1]);
+	gen_result_section(&result->memos, &entries[2]);
+	gen_result_section(&result->messages, &entries[3]);
+	gen_result_section(&result->mms, &entries[4]);
+
+	for (i = 0; i < 5; i++)
+		free(entries[i].folder_pos);
+
+	ret = -1;
+
+	if ((fp = fopen(path, "w")) == NULL) {
+		warn("fopen: %s", path);
+		goto out;
+	}
+
+	if (fwrite(buf.data, 1, buf.len, fp) != buf.len) {
+		warn("fwrite: %s", path);
+		fclose(fp);
+		goto out;
+	}
+
+	if (fclose(fp) == EOF) {
+		warn("fclose: %s", path);
+		goto out;
+	}
+
+	ret = 0;
+
+out:
+	gen_buf_free(&buf);
+	return ret;
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2026 Tim van der Molen <tim@kariliq.nl>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef GEN_H
+#define GEN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct gen_params {
+	uint32_t	 seed;
+	size_t		 nfolders;
+	size_t		 nmessages;	/* Per folder */
+	size_t		 nmms;		/* Per folder */
+	size_t		 mms_size;	/* Maximum size of an MMS */
+	size_t		 nmemos;
+	size_t		 nvcards;	/* Contacts and calendar items each */
+};
+
+struct gen_section {
+	size_t		 nitems;
+	size_t		 size;		/* Section size in bytes */
+};
+
+struct gen_result {
+	size_t		 size;		/* Backup size in bytes */
+	struct gen_section calendar;
+	struct gen_section contacts;
+	struct gen_section memos;
+	struct gen_section messages;
+	struct gen_section mms;
+};
+
+struct gen_buf {
+	uint8_t		*data;
+	size_t		 len;
+	size_t		 size;
+};
+
+void	gen_buf_free(struct gen_buf *);
+void	gen_message(struct gen_buf *, uint32_t *, size_t);
+int	gen_backup(const char *, const struct gen_params *,
+	    struct gen_result *);
+
+#endif
@@ -18,59 +18,738 @@
 
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 #include <unistd.h>
 
 #include "nbu.h"
+#include "pool.h"
+
+#define NBU_JOBS_MAX 64
+
+/* Backups unveiled one by one; OpenBSD allows about 128 unveiled paths */
+#define NBU_UNVEIL_MAX 64
+
+#ifndef nitems
+#define nitems(a) (sizeof (a) / sizeof (a)[0])
+#endif
+
+static const struct {
+	const char	*name;
+	int		 section;
+} section_names[] = {
+	{ "bookmarks",	NBU_EXPORT_BOOKMARKS },
+	{ "calendar",	NBU_EXPORT_CALENDAR },
+	{ "contacts",	NBU_EXPORT_CONTACTS },
+	{ "groups",	NBU_EXPORT_GROUPS },
+	{ "memos",	NBU_EXPORT_MEMOS },
+	{ "messages",	NBU_EXPORT_MESSAGES },
+	{ "mms",	NBU_EXPORT_MMS },
+};
+
+enum stats_format {
+	STATS_NONE,
+	STATS_TEXT,
+	STATS_JSON
+};
+
+struct batch_job {
+	const char	*backup;
+	char		*dir;
+	int		 failed;
+};
+
+static char	**folders;
+static size_t	  nfolders;
+static size_t	  first_item = 1;
+static size_t	  last_item = SIZE_MAX;
+static int	  sections = NBU_EXPORT_ALL;
+static enum stats_format stats_format = STATS_NONE;
+static int	  incremental;
+static int	  table_format = NBU_TABLE_NONE;
+static int	  message_columns;
+static int	  mms_parts;
+static int	  compress;
+static const char *store;
+static const char *query;
+static char	 *search_index;
 
 __dead void
 usage(void)
 {
-	fprintf(stderr, "usage: %s backup [directory]\n", getprogname());
+	fprintf(stderr, "usage: %s [-Cdmuz] [-c format] [-f folder] [-i index] "
+	    "[-j jobs]\n"
+	    "       [-L store] [-r range] [-S format] [-s sections] backup "
+	    "[directory]\n"
+	    "       %s [-Cdm] [-c format] [-f folder] [-i index] [-r range]\n"
+	    "       [-S format] [-s sections] -t archive backup\n"
+	    "       %s -b [-Cdmuz] [-c format] [-f folder] [-j jobs] "
+	    "[-L store]\n"
+	    "       [-r range] [-S format] [-s sections] directory "
+	    "[backup ...]\n"
+	    "       %s [-d] [-f folder] [-i index] [-r range] [-S format]\n"
+	    "       [-s sections] -q query backup\n"
+	    "       %s -n [-d] [-S format] backup ...\n",
+	    getprogname(), getprogname(), getprogname(), getprogname(),
+	    getprogname());
 	exit(1);
 }
 
+static int
+parse_sections(char *list)
+{
+	char *name;
+	size_t i;
+	int mask;
+
+	mask = 0;
+
+	while ((name = strsep(&list, ",")) != NULL) {
+		for (i = 0; i < nitems(section_names); i++)
+			if (strcmp(name, section_names[i].name) == 0)
+				break;
+
+		if (i == nitems(section_names))
+			errx(1, "%s: unknown section", name);
+
+		mask |= section_names[i].section;
+	}
+
+	return mask;
+}
+
+/* Parse an item range of the form "first", "first-" or "first-last" */
+static void
+parse_range(char *range, size_t *first, size_t *last)
+{
+	char *end;
+	const char *errstr;
+
+	if ((end = strchr(range, '-')) != NULL)
+		*end++ = '\0';
+
+	*first = strtonum(range, 1, LLONG_MAX, &errstr);
+	if (errstr != NULL)
+		errx(1, "%s: first item is %s", range, errstr);
+
+	if (end == NULL)
+		*last = *first;
+	else if (*end == '\0')
+		*last = SIZE_MAX;
+	else {
+		*last = strtonum(end, *first, LLONG_MAX, &errstr);
+		if (errstr != NULL)
+			errx(1, "%s: last item is %s", end, errstr);
+	}
+}
+
+static enum stats_format
+parse_stats_format(const char *s)
+{
+	if (strcmp(s, "text") == 0)
+		return STATS_TEXT;
+	if (strcmp(s, "json") == 0)
+		return STATS_JSON;
+
+	errx(1, "%s: unknown statistics format", s);
+}
+
+static int
+parse_table_format(const char *s)
+{
+	if (strcmp(s, "csv") == 0)
+		return NBU_TABLE_CSV;
+	if (strcmp(s, "ndjson") == 0)
+		return NBU_TABLE_NDJSON;
+
+	errx(1, "%s: unknown table format", s);
+}
+
+static void
+print_json_string(const char *s)
+{
+	putchar('"');
+
+	for (; *s != '\0'; s++)
+		if (*s == '"' || *s == '\\')
+			printf("\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			printf("\\u%04x", (unsigned char)*s);
+		else
+			putchar(*s);
+
+	putchar('"');
+}
+
+static void
+print_stats(const char *backup, const struct nbu_stats *st)
+{
+	const struct {
+		const char	*name;
+		uint64_t	 value;
+		int		 time;
+	} fields[] = {
+		{ "bytes_read",		st->bytes_read,		0 },
+		{ "bytes_written",	st->bytes_written,	0 },
+		{ "syscalls",		st->syscalls,		0 },
+		{ "seeks",		st->seeks,		0 },
+		{ "files",		st->files,		0 },
+		{ "files_skipped",	st->files_skipped,	0 },
+		{ "files_linked",	st->files_linked,	0 },
+		{ "bytes_linked",	st->bytes_linked,	0 },
+		{ "bookmarks",		st->nbookmarks,		0 },
+		{ "calendar",		st->ncalendar,		0 },
+		{ "contacts",		st->ncontacts,		0 },
+		{ "groups",		st->ngroups,		0 },
+		{ "memos",		st->nmemos,		0 },
+		{ "messages",		st->nmessages,		0 },
+		{ "mms",		st->nmms,		0 },
+		{ "open_time_ms",	st->open_time,		1 },
+		{ "read_time_ms",	st->read_time,		1 },
+		{ "export_time_ms",	st->export_time,	1 },
+		{ "transcode_time_ms",	st->transcode_time,	1 },
+		{ "compress_time_ms",	st->compress_time,	1 },
+		{ "write_time_ms",	st->write_time,		1 },
+	};
+	size_t i;
+
+	/* Keep the output of concurrent batch jobs apart */
+	flockfile(stdout);
+
+	if (stats_format == STATS_JSON) {
+		printf("{\"backup\":");
+		print_json_string(backup);
+		for (i = 0; i < nitems(fields); i++) {
+			printf(",\"%s\":", fields[i].name);
+			if (fields[i].time)
+				printf("%.3f", fields[i].value / 1e6);
+			else
+				printf("%" PRIu64, fields[i].value);
+		}
+		printf("}\n");
+	} else {
+		printf("%s:\n", backup);
+		for (i = 0; i < nitems(fields); i++) {
+			printf("\t%-18s ", fields[i].name);
+			if (fields[i].time)
+				printf("%.3f\n", fields[i].value / 1e6);
+			else
+				printf("%" PRIu64 "\n", fields[i].value);
+		}
+	}
+
+	fflush(stdout);
+	funlockfile(stdout);
+}
+
+static int
+print_match(const struct nbu_item *item, __unused void *arg)
+{
+	if (item->section == NBU_EXPORT_MEMOS)
+		printf("memos/memo-%zu.txt\n", item->index);
+	else
+		printf("messages/%s.vmg:%zu\n", item->folder, item->index);
+	return 0;
+}
+
+/*
+ * Export to a directory, or to a tar archive if tarfd is not -1. With a query,
+ * print the messages and memos that match it instead.
+ */
+static int
+export_backup(const char *backup, const char *dir, const char *index,
+    int njobs, int tarfd)
+{
+	struct nbu_ctx *ctx;
+	struct nbu_stats stats;
+	size_t i;
+	int ret;
+
+	ret = -1;
+
+	if (strcmp(backup, "-") == 0) {
+		if (nbu_open_fd(&ctx, STDIN_FILENO, index) == -1)
+			goto out;
+	} else if (nbu_open(&ctx, backup, index) == -1)
+		goto out;
+
+	nbu_set_jobs(ctx, njobs);
+	nbu_set_timing(ctx, stats_format != STATS_NONE);
+	nbu_set_incremental(ctx, incremental);
+	nbu_set_table_format(ctx, table_format);
+	nbu_set_message_columns(ctx, message_columns);
+	nbu_set_mms_parts(ctx, mms_parts);
+	nbu_set_compression(ctx, compress);
+	nbu_select_sections(ctx, sections);
+	nbu_select_items(ctx, first_item, last_item);
+
+	if (store != NULL && nbu_set_store(ctx, store) == -1)
+		goto out;
+
+	for (i = 0; i < nfolders; i++)
+		if (nbu_select_folder(ctx, folders[i]) == -1)
+			goto out;
+
+	if (query != NULL) {
+		if (nbu_search(ctx, query, search_index, print_match, NULL) ==
+		    0)
+			ret = 0;
+	} else if (tarfd != -1) {
+		if (nbu_export_tar(ctx, tarfd) == 0)
+			ret = 0;
+	} else {
+		if (nbu_export(ctx, dir) == 0)
+			ret = 0;
+	}
+
+	if (stats_format != STATS_NONE) {
+		nbu_get_stats(ctx, &stats);
+		print_stats(backup, &stats);
+	}
+
+out:
+	nbu_close(ctx);
+	return ret;
+}
+
+static int
+print_section(const struct nbu_section_report *r, void *arg)
+{
+	printf("%s: %s: %s, %zu", (const char *)arg, r->name,
+	    r->damaged ? "damaged" : "ok", r->nitems);
+	if (r->damaged)
+		printf(" of %" PRIu32, r->nitems_stated);
+	printf(" item%s", (r->nitems == 1 && !r->damaged) ? "" : "s");
+	if (r->nfolders > 0)
+		printf(" in %zu folder%s", r->nfolders,
+		    (r->nfolders == 1) ? "" : "s");
+	putchar('\n');
+	return 0;
+}
+
+/* Check each backup and print the state of its sections */
+static int
+check_backups(char **backups, int nbackups)
+{
+	struct nbu_ctx *ctx;
+	struct nbu_stats stats;
+	int i, ndamaged, ret;
+
+	ndamaged = 0;
+
+	for (i = 0; i < nbackups; i++) {
+		if (strcmp(backups[i], "-") == 0)
+			ret = nbu_open_fd(&ctx, STDIN_FILENO, NULL);
+		else
+			ret = nbu_open(&ctx, backups[i], NULL);
+
+		if (ret == 0) {
+			nbu_set_timing(ctx, stats_format != STATS_NONE);
+			ret = nbu_check(ctx, print_section, backups[i]);
+			if (stats_format != STATS_NONE) {
+				nbu_get_stats(ctx, &stats);
+				print_stats(backups[i], &stats);
+			}
+		}
+
+		if (ret != 0) {
+			printf("%s: damaged\n", backups[i]);
+			ndamaged++;
+		}
+
+		nbu_close(ctx);
+	}
+
+	fflush(stdout);
+
+	if (ndamaged > 0) {
+		if (nbackups > 1)
+			warnx("%d of %d backups damaged", ndamaged, nbackups);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+run_batch_job(void *arg)
+{
+	struct batch_job *job;
+
+	job = arg;
+
+	if (export_backup(job->backup, job->dir, NULL, 1, -1) == -1) {
+		warnx("%s: export failed", job->backup);
+		job->failed = 1;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Read a list of backups from stdin, one per line */
+static char **
+read_manifest(int *nbackupsp)
+{
+	char **backups, **newbackups, *line;
+	size_t size;
+	ssize_t len;
+	int n;
+
+	backups = NULL;
+	line = NULL;
+	size = 0;
+	n = 0;
+
+	while ((len = getline(&line, &size, stdin)) != -1) {
+		if (len > 0 && line[len - 1] == '\n')
+			line[--len] = '\0';
+
+		if (len == 0)
+			continue;
+
+		newbackups = reallocarray(backups, n + 1, sizeof *backups);
+		if (newbackups == NULL)
+			err(1, NULL);
+
+		backups = newbackups;
+
+		if ((backups[n++] = strdup(line)) == NULL)
+			err(1, NULL);
+	}
+
+	if (ferror(stdin))
+		err(1, "getline");
+
+	free(line);
+	*nbackupsp = n;
+	return backups;
+}
+
+/* Check if one of the first n jobs exports to the specified directory */
+static int
+batch_dir_used(const struct batch_job *jobs, int n, const char *dir)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (strcmp(jobs[i].dir, dir) == 0)
+			return 1;
+
+	return 0;
+}
+
+/*
+ * Export each backup to a subdirectory named after the backup. If backups in
+ * different directories have the same name, a number is appended to the
+ * subdirectory of all but the first. The backups are distributed over a pool
+ * of workers, so at most njobs backups are open at the same time.
+ */
+static int
+export_batch(char **backups, int nbackups, const char *dir, int njobs)
+{
+	struct batch_job *jobs;
+	struct pool *pool;
+	const char *base;
+	char *name, *suffix;
+	int i, n, nfailed, ret;
+
+	if ((jobs = calloc(nbackups, sizeof *jobs)) == NULL)
+		err(1, NULL);
+
+	for (i = 0; i < nbackups; i++) {
+		if (strcmp(backups[i], "-") == 0)
+			errx(1, "Cannot read backups from stdin in batch mode");
+
+		if ((base = strrchr(backups[i], '/')) != NULL)
+			base++;
+		else
+			base = backups[i];
+
+		if (asprintf(&name, "%s/%s", dir, base) == -1)
+			errx(1, "asprintf() failed");
+
+		/* Strip the .nbu suffix, unless nothing would be left */
+		suffix = strrchr(name, '.');
+		if (suffix != NULL && suffix != name + strlen(dir) + 1 &&
+		    strcasecmp(suffix, ".nbu") == 0)
+			*suffix = '\0';
+
+		jobs[i].dir = name;
+		for (n = 2; batch_dir_used(jobs, i, jobs[i].dir); n++) {
+			if (jobs[i].dir != name)
+				free(jobs[i].dir);
+			if (asprintf(&jobs[i].dir, "%s-%d", name, n) == -1)
+				errx(1, "asprintf() failed");
+		}
+		if (jobs[i].dir != name)
+			free(name);
+
+		jobs[i].backup = backups[i];
+	}
+
+	if ((pool = pool_new(njobs)) == NULL)
+		return -1;
+
+	for (i = 0; i < nbackups; i++)
+		pool_add(pool, run_batch_job, &jobs[i]);
+
+	ret = pool_wait(pool);
+	pool_free(pool);
+
+	nfailed = 0;
+	for (i = 0; i < nbackups; i++) {
+		if (jobs[i].failed)
+			nfailed++;
+		free(jobs[i].dir);
+	}
+
+	if (nfailed > 0)
+		warnx("%d of %d backups failed", nfailed, nbackups);
+
+	free(jobs);
+	return ret;
+}
+
+/*
+ * Unveil the directory of an index file. The index is replaced by a temporary
+ * file with a random name in that directory.
+ */
+static void
+unveil_index(const char *path)
+{
+	char *dir, *s;
+
+	if ((dir = strdup(path)) == NULL)
+		err(1, NULL);
+
+	if ((s = strrchr(dir, '/')) == NULL) {
+		free(dir);
+		if ((dir = strdup(".")) == NULL)
+			err(1, NULL);
+	} else if (s == dir)
+		s[1] = '\0';
+	else
+		*s = '\0';
+
+	if (unveil(dir, "rwc") == -1)
+		err(1, "unveil: %s", dir);
+
+	free(dir);
+}
+
 int
 main(int argc, char **argv)
 {
-	struct nbu_ctx *ctx;
-	const char *backup, *dir;
-
-	switch (argc) {
-	case 2:
-		backup = argv[1];
-		dir = ".";
-		break;
-	case 3:
-		backup = argv[1];
-		dir = argv[2];
+	char **backups;
+	const char *archive, *dir, *errstr, *index, *tmpdir;
+	int batch, ch, check, i, nbackups, njobs, tarfd, usestdin;
+
+	if ((folders = calloc(argc, sizeof *folders)) == NULL)
+		err(1, NULL);
+
+	batch = 0;
+	check = 0;
+	archive = NULL;
+	index = NULL;
+	njobs = 1;
+	tarfd = -1;
+
+	while ((ch = getopt(argc, argv, "Cbc:df:i:j:L:mnq:r:S:s:t:uz")) != -1)
+		switch (ch) {
+		case 'C':
+			message_columns = 1;
+			break;
+		case 'b':
+			batch = 1;
+			break;
+		case 'c':
+			table_format = parse_table_format(optarg);
+			break;
+		case 'd':
+			nbu_set_debug(1);
+			break;
+		case 'f':
+			folders[nfolders++] = optarg;
+			break;
+		case 'i':
+			index = optarg;
+			break;
+		case 'j':
+			njobs = strtonum(optarg, 1, NBU_JOBS_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "%s: number of jobs is %s", optarg,
+				    errstr);
+			break;
+		case 'L':
+			store = optarg;
+			break;
+		case 'm':
+			mms_parts = 1;
+			break;
+		case 'n':
+			check = 1;
+			break;
+		case 'q':
+			query = optarg;
+			break;
+		case 'r':
+			parse_range(optarg, &first_item, &last_item);
+			break;
+		case 'S':
+			stats_format = parse_stats_format(optarg);
+			break;
+		case 's':
+			sections = parse_sections(optarg);
+			break;
+		case 't':
+			archive = optarg;
+			break;
+		case 'u':
+			incremental = 1;
+			break;
+		case 'z':
+			compress = 1;
+			break;
+		default:
+			usage();
+		}
+
+	argc -= optind;
+	argv += optind;
+
+	if (check) {
+		if (argc < 1 || batch || index != NULL || archive != NULL ||
+		    query != NULL || incremental || store != NULL ||
+		    table_format != NBU_TABLE_NONE || message_columns ||
+		    mms_parts || nfolders > 0 || first_item != 1 ||
+		    last_item != SIZE_MAX || sections != NBU_EXPORT_ALL ||
+		    njobs != 1 || compress)
+			usage();
+
+		dir = NULL;
+		backups = argv;
+		nbackups = argc;
+	} else if (batch) {
+		if (argc < 1 || index != NULL || archive != NULL ||
+		    query != NULL)
+			usage();
+
+		dir = argv[0];
 		if (mkdir(dir, 0777) == -1 && errno != EEXIST)
 			err(1, "mkdir: %s", dir);
-		break;
-	default:
-		usage();
+
+		if (argc > 1) {
+			backups = argv + 1;
+			nbackups = argc - 1;
+		} else
+			backups = read_manifest(&nbackups);
+	} else if (query != NULL) {
+		if (argc != 1 || archive != NULL || incremental ||
+		    store != NULL || table_format != NBU_TABLE_NONE ||
+		    message_columns || mms_parts || compress)
+			usage();
+
+		/* The search index is kept next to the index */
+		if (index != NULL && asprintf(&search_index, "%s.search",
+		    index) == -1)
+			errx(1, "asprintf() failed");
+
+		dir = NULL;
+		backups = argv;
+		nbackups = 1;
+	} else if (archive != NULL) {
+		if (argc != 1 || incremental || store != NULL || compress)
+			usage();
+
+		if (strcmp(archive, "-") == 0) {
+			if (stats_format != STATS_NONE)
+				errx(1, "Cannot write statistics and archive "
+				    "to stdout");
+			tarfd = STDOUT_FILENO;
+		} else if ((tarfd = open(archive, O_WRONLY | O_CREAT | O_TRUNC,
+		    0666)) == -1)
+			err(1, "open: %s", archive);
+
+		dir = NULL;
+		backups = argv;
+		nbackups = 1;
+	} else {
+		switch (argc) {
+		case 1:
+			dir = ".";
+			break;
+		case 2:
+			dir = argv[1];
+			if (mkdir(dir, 0777) == -1 && errno != EEXIST)
+				err(1, "mkdir: %s", dir);
+			break;
+		default:
+			usage();
+		}
+
+		backups = argv;
+		nbackups = 1;
 	}
 
-	if (unveil(backup, "r") == -1)
-		err(1, "unveil: %s", backup);
+	usestdin = 0;
+	for (i = 0; i < nbackups; i++)
+		if (strcmp(backups[i], "-") == 0)
+			usestdin = 1;
 
-	if (unveil(dir, "rwc") == -1)
+	/* Unveil each backup, or make all files readable if there are many */
+	if (nbackups > NBU_UNVEIL_MAX) {
+		if (unveil("/", "r") == -1)
+			err(1, "unveil: /");
+	} else
+		for (i = 0; i < nbackups; i++)
+			if (strcmp(backups[i], "-") != 0 &&
+			    unveil(backups[i], "r") == -1)
+				err(1, "unveil: %s", backups[i]);
+
+	/* A backup read from stdin may have to be copied to a temporary file */
+	if (!batch && usestdin) {
+		if ((tmpdir = getenv("TMPDIR")) == NULL || *tmpdir == '\0')
+			tmpdir = "/tmp";
+		if (unveil(tmpdir, "rwc") == -1)
+			err(1, "unveil: %s", tmpdir);
+	}
+
+	if (dir != NULL && unveil(dir, "rwc") == -1)
 		err(1, "unveil: %s", dir);
 
+	if (store != NULL) {
+		if (mkdir(store, 0777) == -1 && errno != EEXIST)
+			err(1, "mkdir: %s", store);
+		if (unveil(store, "rwc") == -1)
+			err(1, "unveil: %s", store);
+	}
+
+	if (index != NULL)
+		unveil_index(index);
+
+	if (search_index != NULL)
+		unveil_index(search_index);
+
 	if (pledge("stdio rpath wpath cpath", NULL) == -1)
 		err(1, "pledge");
 
-	if (nbu_open(&ctx, backup) == -1) {
-		nbu_close(ctx);
-		return 1;
+	if (check) {
+		if (check_backups(backups, nbackups) == -1)
+			return 1;
+	} else if (batch) {
+		if (export_batch(backups, nbackups, dir, njobs) == -1)
+			return 1;
+	} else {
+		if (export_backup(backups[0], dir, index, njobs, tarfd) == -1)
+			return 1;
 	}
 
-	if (nbu_export(ctx, dir) == -1) {
-		nbu_close(ctx);
-		return 1;
-	}
-
-	nbu_close(ctx);
 	return 0;
 }
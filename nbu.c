@@ -14,10 +14,9 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-#define NBU_DEBUG
-
-#include <sys/queue.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
 #include <ctype.h>
 #include <endian.h>
@@ -25,54 +24,155 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 #include <unistd.h>
+#include <zlib.h>
 
-#ifdef NBU_DEBUG
-#include <stdarg.h>
-#endif
-
+#include "nbu.h"
+#include "pool.h"
 #include "utf.h"
 
 #define NBU_CALENDAR_FILE	"calendar.ics"
 #define NBU_CONTACTS_FILE	"contacts.vcf"
+#define NBU_CALENDAR_TABLE	"calendar"
+#define NBU_CONTACTS_TABLE	"contacts"
+#define NBU_GROUPS_TABLE	"groups"
+#define NBU_BOOKMARKS_DIR	"bookmarks"
 #define NBU_MEMOS_DIR		"memos"
 #define NBU_MESSAGES_DIR	"messages"
 #define NBU_MMS_DIR		"mms"
 
 #define NBU_GUID_LEN 16
+#define NBU_GUID_STRING_LEN (NBU_GUID_LEN * 2 + 1)
+
+#define NBU_UTF16_CHUNK_LEN 4096
+
+#define NBU_WRITER_BUF_SIZE	(256 * 1024)
+
+#define NBU_GZIP_SUFFIX		".gz"
+#define NBU_GZIP_BUF_SIZE	(256 * 1024)
+
+/* zlib takes at most UINT_MAX bytes of input at a time */
+#define NBU_GZIP_INPUT_MAX	(1024 * 1024 * 1024)
+
+#define NBU_TAR_BLOCK_SIZE	512
+/* Largest number that fits in the size and mtime fields */
+#define NBU_TAR_NUMBER_MAX	077777777777ULL
+
+/* Gaps up to this size between the data of jobs are read ahead as well */
+#define NBU_ADVICE_GAP		(1024 * 1024)
+
+/* Message folders larger than twice this are converted in parallel */
+#define NBU_SEGMENT_SIZE	(1024 * 1024)
+
+#if defined(IOV_MAX) && IOV_MAX < 1024
+#define NBU_WRITER_IOVCNT	IOV_MAX
+#else
+#define NBU_WRITER_IOVCNT	1024
+#endif
+
+#define NBU_INDEX_MAGIC		"NBUINDEX"
+#define NBU_INDEX_MAGIC_LEN	8
+#define NBU_INDEX_VERSION	3
+#define NBU_INDEX_HASH_LEN	65536
+#define NBU_INDEX_KEY_LEN	4
+#define NBU_INDEX_TMP_SUFFIX	".XXXXXXXXXX"
+
+#define NBU_HASH_INIT		0xcbf29ce484222325ULL
+
+#define NBU_SEARCH_MAGIC	"NBUGRAMS"
+#define NBU_SEARCH_VERSION	1
+#define NBU_SEARCH_BUCKETS	(1 << 18)
+
+#define NBU_MANIFEST_FILE	".nbu-manifest"
+#define NBU_MANIFEST_TMP_FILE	".nbu-manifest.tmp"
+#define NBU_MANIFEST_MAGIC	"NBUMANIF"
+#define NBU_MANIFEST_VERSION	1
 
 #ifndef nitems
 #define nitems(a) (sizeof (a) / sizeof (a)[0])
 #endif
 
-#ifdef NBU_DEBUG
-#define NBU_DPRINTF(...) nbu_dprintf(__func__, __VA_ARGS__)
-#else
-#define NBU_DPRINTF(...)
-#endif
+#define NBU_DPRINTF(...)						\
+	do {								\
+		if (nbu_debug)						\
+			nbu_dprintf(__func__, __VA_ARGS__);		\
+	} while (0)
 
-struct nbu_item {
-	long		 pos;
-	uint32_t	 len;
-	STAILQ_ENTRY(nbu_item) entries;
-};
+/*
+ * Items and folders are stored in arrays in struct nbu_ctx. Lists refer to a
+ * range of consecutive elements in those arrays.
+ */
 
-STAILQ_HEAD(nbu_item_list, nbu_item);
+struct nbu_item_list {
+	size_t		 first;
+	size_t		 nitems;
+};
 
 struct nbu_folder {
 	uint16_t	*name;
-	struct nbu_item_list *items;
-	STAILQ_ENTRY(nbu_folder) entries;
+	struct nbu_item_list items;
+	uint32_t	 nmembers;	/* Contacts in a group */
+};
+
+struct nbu_folder_list {
+	size_t		 first;
+	size_t		 nfolders;
+};
+
+enum nbu_section_type {
+	NBU_SECTION_ADVANCED_SETTINGS,
+	NBU_SECTION_BOOKMARKS,
+	NBU_SECTION_CALENDAR,
+	NBU_SECTION_CONTACTS,
+	NBU_SECTION_GROUPS,
+	NBU_SECTION_MEMOS,
+	NBU_SECTION_MESSAGES,
+	NBU_SECTION_MMS
 };
 
-STAILQ_HEAD(nbu_folder_list, nbu_folder);
+/* An entry in the section directory of a backup */
+struct nbu_section_entry {
+	const struct nbu_section *section;
+	uint64_t	 pos;
+	uint64_t	 len;
+	long		 folders_pos;	/* Position of the folder records */
+	uint32_t	 nitems;	/* As stated in the section header */
+	uint32_t	 nfolders;
+	size_t		 items_found;
+	size_t		 folders_found;
+	int		 state;
+#define NBU_SECTION_UNREAD	0
+#define NBU_SECTION_READ	1
+#define NBU_SECTION_FAILED	2	/* Read up to the damage */
+#define NBU_SECTION_SKIPPED	3	/* Not read before the index was shared */
+};
 
+/*
+ * The mapping and everything parsed from it form the index. Once all sections
+ * have been read, the index does not change and can be shared with clones.
+ */
 struct nbu_ctx {
-	FILE		*fp;
+	/* Context whose index is shared, or NULL */
+	struct nbu_ctx	*parent;
+
+	uint8_t		*map;
+	size_t		 size;
+	size_t		 pos;
+	struct timespec	 mtime;
+	uint64_t	 spool_hash;	/* Of a spooled backup, or 0 */
+
+	struct nbu_section_entry *sections;
+	size_t		 nsections;
+	size_t		 nsections_lost; /* Behind a damaged directory entry */
 
 	uint64_t	 backup_time;
 	uint16_t	*phone_imei;
@@ -81,27 +181,285 @@ struct nbu_ctx {
 	uint16_t	*phone_firmware;
 	uint16_t	*phone_language;
 
-	struct nbu_folder_list *bookmarks;
-	struct nbu_folder_list *messages;
-	struct nbu_folder_list *mmses;
-	struct nbu_item_list *calendar;
-	struct nbu_item_list *contacts;
-	struct nbu_item_list *memos;
+	/* Item positions and lengths */
+	long		*item_pos;
+	uint32_t	*item_len;
+	uint32_t	*item_strings;	/* Length of the strings before an MMS */
+	size_t		 nitems;
+	size_t		 items_size;
+
+	struct nbu_folder *folders;
+	size_t		 nfolders;
+	size_t		 folders_size;
+
+	struct nbu_folder_list bookmarks;
+	struct nbu_folder_list groups;
+	struct nbu_folder_list messages;
+	struct nbu_folder_list mmses;
+	struct nbu_item_list calendar;
+	struct nbu_item_list contacts;
+	struct nbu_item_list memos;
+
+	/* Export selection */
+	int		 select_sections;
+	char		**select_folders;
+	size_t		 nselect_folders;
+	size_t		 select_first;
+	size_t		 select_last;
+
+	int		 njobs;
+	struct pool	*pool;
+
+	/* Writer for the tar stream, or NULL if exporting to a directory */
+	struct nbu_writer *tar;
+
+	/* Directory of the MMS store, or -1 */
+	int		 store_dfd;
+
+	/* Format of the contacts and calendar tables, if any */
+	int		 table_format;
+
+	/* Also export messages as columnar tables */
+	int		 message_columns;
+
+	/* Split MMS into their parts */
+	int		 mms_parts;
+
+	/* Compress exported files with gzip */
+	int		 compress;
+
+	/* Search index, loaded or built by nbu_search() */
+	struct nbu_search_index *search;
+
+	/* Manifest of a previous export, sorted by path */
+	int		 incremental;
+	struct nbu_manifest_entry *manifest;
+	size_t		 nmanifest;
+
+	/* Jobs are planned first and started by nbu_run_plan() */
+	struct nbu_job	**plan;
+	size_t		 nplanned;
+	size_t		 plan_size;
+
+	/*
+	 * The main thread updates stats. Jobs update job_stats, which is
+	 * protected by stats_mutex.
+	 */
+	struct nbu_stats stats;
+	struct nbu_stats job_stats;
+	pthread_mutex_t	 stats_mutex;
+	int		 timing;
+};
+
+enum nbu_item_type {
+	NBU_ITEM_RAW,
+	NBU_ITEM_UTF16,
+	NBU_ITEM_CONTACTS,	/* vCards, exported as a table */
+	NBU_ITEM_CALENDAR,	/* vCalendars, exported as a table */
+	NBU_ITEM_MESSAGES,	/* vMessages, exported as a columnar table */
+	NBU_ITEM_MMS_PARTS	/* An MMS, exported as a file for each part */
+};
+
+/*
+ * An exported file, as recorded in the manifest of an incremental export. The
+ * hash covers the data of the items in the backup, so that a file only has to
+ * be written again if its items have changed. If only items were added, they
+ * are appended to the file.
+ */
+struct nbu_manifest_entry {
+	char		*path;
+	uint64_t	 nitems;
+	uint64_t	 hash;
+	uint64_t	 size;
+	int		 valid;
+};
+
+/*
+ * The items of a large message folder are split into segments that are
+ * converted in parallel. The segments are written in order: each waits until
+ * the previous one has been written.
+ */
+struct nbu_segment_group {
+	pthread_mutex_t	 mtx;
+	pthread_cond_t	 cond;
+	size_t		 next;		/* Next segment to write */
+	size_t		 nsegments;
+	int		 fd;
+	int		 failed;
+	char		*path;
+};
+
+/* A job exports a list of items to one output file */
+struct nbu_job {
+	struct nbu_ctx	*ctx;
+	struct nbu_item_list items;
+	enum nbu_item_type type;
+	int		 dedup;
+	int		 dfd;
+	char		*path;
+
+	/* Range of the backup that contains the data of the items */
+	size_t		 start;
+	size_t		 end;
+
+	/* The new manifest entry, if the export is incremental */
+	struct nbu_manifest_entry entry;
+
+	/* The folder the job is a segment of, or NULL */
+	struct nbu_segment_group *group;
+	size_t		 segment;
+};
+
+/*
+ * A writer collects data for an output file and writes it with as few
+ * writev() calls as possible. Data from the mapping is not copied; converted
+ * data is stored in the buffer.
+ */
+struct nbu_writer {
+	int		 fd;
+	struct nbu_ctx	*ctx;
+	struct nbu_stats *st;
+	uint8_t		*buf;
+	size_t		 buflen;
+	size_t		 bufsize;
+	struct iovec	 iov[NBU_WRITER_IOVCNT];
+	int		 iovcnt;
+	size_t		 pending;
+
+	/* Compressor of the output file, or NULL */
+	struct nbu_gzip	*gz;
+};
+
+/*
+ * A gzip member that is compressed as it is written. The output goes to a
+ * file, or, if out is not NULL, to a buffer.
+ */
+struct nbu_gzip {
+	z_stream	 zs;
+	struct nbu_ctx	*ctx;
+	struct nbu_stats *st;
+	int		 fd;
+	struct nbu_index *out;
+	uint8_t		*buf;
+};
+
+/* A buffer holding a serialised index */
+struct nbu_index {
+	uint8_t		*data;
+	size_t		 len;
+	size_t		 size;
+	size_t		 pos;
+	int		 error;
+};
+
+/*
+ * A trigram index of the text of messages and memos. Each trigram is hashed
+ * to a bucket, and each bucket lists the documents containing one of its
+ * trigrams. The documents are the memos followed by the messages of each
+ * folder, so that their numbers do not depend on the order in which sections
+ * are read. The serialised index is used as is: a table of bucket offsets is
+ * followed by the lists, which hold delta-encoded numbers as varints.
+ */
+struct nbu_search_index {
+	struct nbu_index idx;
+	size_t		 ndocs;
+	size_t		 offsets;	/* Position of the bucket offsets */
+	size_t		 postings;	/* Position of the lists */
+};
+
+/*
+ * The layout of a fixed-size record in the backup. A record is read with a
+ * single bounds check, after which the fields are decoded from the mapping.
+ * Each field is a little-endian integer of 1, 2, 4 or 8 bytes; the fields end
+ * at the first one with a zero size. Bytes that are not part of a field are
+ * skipped.
+ */
+#define NBU_LAYOUT_NFIELDS 4
+
+struct nbu_layout {
+	size_t		 size;
+	struct {
+		size_t	 offset;
+		size_t	 size;
+	} fields[NBU_LAYOUT_NFIELDS];
+};
+
+/*
+ * An entry in the section directory: a GUID, the position and length of the
+ * section, and the section header. The header holds the number of items and
+ * the number of folders. If the section has folders, the entry is followed by
+ * a folder record for each folder.
+ */
+static const struct nbu_layout nbu_directory_layout = {
+	40, { { 16, 8 }, { 24, 8 }, { 32, 4 }, { 36, 4 } }
+};
+
+/* A folder record: a folder id and the position of the folder */
+static const struct nbu_layout nbu_folder_layout = {
+	12, { { 4, 8 } }
+};
+
+/* The number of items in a folder, which follows the name of the folder */
+static const struct nbu_layout nbu_count_layout = {
+	4, { { 0, 4 } }
+};
+
+/* The header of a message: 8 unknown bytes and the length of the message */
+static const struct nbu_layout nbu_message_layout = {
+	12, { { 8, 4 } }
+};
+
+/* The header of an MMS: 8 unknown bytes and the number of strings after it */
+static const struct nbu_layout nbu_mms_layout = {
+	9, { { 8, 1 } }
+};
+
+/* The header of the MMS data: 20 unknown bytes and the length of the data */
+static const struct nbu_layout nbu_mms_data_layout = {
+	24, { { 20, 4 } }
+};
+
+/* The header of a memo: 4 unknown bytes and the length in UTF-16 code units */
+static const struct nbu_layout nbu_memo_layout = {
+	6, { { 4, 2 } }
 };
 
+/*
+ * A section type. Sections with folders are read one folder at a time; the
+ * items of other sections start at a fixed offset from the start of the
+ * section.
+ */
 struct nbu_section {
 	uint8_t		 guid[NBU_GUID_LEN];
-	int		 (*read)(struct nbu_ctx *, uint64_t);
+	const char	*name;
+	enum nbu_section_type type;
+	int		 folders;
+	long		 items_offset;
+	int		 (*read)(struct nbu_ctx *,
+			    const struct nbu_section_entry *);
 };
 
-static int nbu_read_advanced_settings_section(struct nbu_ctx *, uint64_t);
-static int nbu_read_bookmarks_section(struct nbu_ctx *, uint64_t);
-static int nbu_read_calendar_section(struct nbu_ctx *, uint64_t);
-static int nbu_read_groups_section(struct nbu_ctx *, uint64_t);
-static int nbu_read_contacts_section(struct nbu_ctx *, uint64_t);
-static int nbu_read_memos_section(struct nbu_ctx *, uint64_t);
-static int nbu_read_messages_section(struct nbu_ctx *, uint64_t);
-static int nbu_read_mms_section(struct nbu_ctx *, uint64_t);
+static int nbu_read_advanced_settings_section(struct nbu_ctx *,
+    const struct nbu_section_entry *);
+static int nbu_read_bookmarks_section(struct nbu_ctx *,
+    const struct nbu_section_entry *);
+static int nbu_read_calendar_section(struct nbu_ctx *,
+    const struct nbu_section_entry *);
+static int nbu_read_groups_section(struct nbu_ctx *,
+    const struct nbu_section_entry *);
+static int nbu_read_contacts_section(struct nbu_ctx *,
+    const struct nbu_section_entry *);
+static int nbu_read_memos_section(struct nbu_ctx *,
+    const struct nbu_section_entry *);
+static int nbu_read_messages_section(struct nbu_ctx *,
+    const struct nbu_section_entry *);
+static int nbu_read_mms_section(struct nbu_ctx *,
+    const struct nbu_section_entry *);
+static int nbu_export_item_list(struct nbu_ctx *, struct nbu_stats *,
+    const struct nbu_item_list *, enum nbu_item_type, int, const char *, int);
+static void nbu_index_put(struct nbu_index *, const void *, size_t);
+static void nbu_index_put_uint32(struct nbu_index *, uint32_t);
+static void nbu_index_put_uint64(struct nbu_index *, uint64_t);
 
 static const struct nbu_section nbu_sections[] = {
 	{
@@ -109,6 +467,10 @@ static const struct nbu_section nbu_sections[] = {
 			0x16, 0xcd, 0xf8, 0xe8, 0x23, 0x5e, 0x5a, 0x4e,
 			0xb7, 0x35, 0xdd, 0xdf, 0xf1, 0x48, 0x12, 0x22
 		},
+		"calendar",
+		NBU_SECTION_CALENDAR,
+		0,
+		44,
 		nbu_read_calendar_section
 	},
 	{
@@ -116,6 +478,10 @@ static const struct nbu_section nbu_sections[] = {
 			0x1f, 0x0e, 0x58, 0x65, 0xa1, 0x9f, 0x3c, 0x49,
 			0x9e, 0x23, 0x0e, 0x25, 0xeb, 0x24, 0x0f, 0xe1
 		},
+		"groups",
+		NBU_SECTION_GROUPS,
+		1,
+		0,
 		nbu_read_groups_section
 	},
 	{
@@ -123,6 +489,10 @@ static const struct nbu_section nbu_sections[] = {
 			0x2d, 0xf5, 0x68, 0x6b, 0x1f, 0x4b, 0x22, 0x4a,
 			0x92, 0x83, 0x1b, 0x06, 0xc3, 0xc3, 0x9a, 0x35
 		},
+		"advanced settings",
+		NBU_SECTION_ADVANCED_SETTINGS,
+		1,
+		0,
 		nbu_read_advanced_settings_section
 	},
 	{
@@ -130,6 +500,10 @@ static const struct nbu_section nbu_sections[] = {
 			0x47, 0x1d, 0xd4, 0x65, 0xef, 0xe3, 0x32, 0x40,
 			0x8c, 0x77, 0x64, 0xca, 0xa3, 0x83, 0xaa, 0x33
 		},
+		"mms",
+		NBU_SECTION_MMS,
+		1,
+		0,
 		nbu_read_mms_section
 	},
 	{
@@ -137,6 +511,10 @@ static const struct nbu_section nbu_sections[] = {
 			0x5c, 0x62, 0x97, 0x3b, 0xdc, 0xa7, 0x54, 0x41,
 			0xa1, 0xc3, 0x05, 0x9d, 0xe3, 0x24, 0x68, 0x08
 		},
+		"memos",
+		NBU_SECTION_MEMOS,
+		0,
+		48,
 		nbu_read_memos_section
 	},
 	{
@@ -144,6 +522,10 @@ static const struct nbu_section nbu_sections[] = {
 			0x61, 0x7a, 0xef, 0xd1, 0xaa, 0xbe, 0xa1, 0x49,
 			0x9d, 0x9d, 0x15, 0x5a, 0xbb, 0x4c, 0xeb, 0x8e
 		},
+		"messages",
+		NBU_SECTION_MESSAGES,
+		1,
+		0,
 		nbu_read_messages_section
 	},
 	{
@@ -151,6 +533,10 @@ static const struct nbu_section nbu_sections[] = {
 			0x7f, 0x77, 0x90, 0x56, 0x31, 0xf9, 0x57, 0x49,
 			0x8d, 0x96, 0xee, 0x44, 0x5d, 0xbe, 0xbc, 0x5a
 		},
+		"bookmarks",
+		NBU_SECTION_BOOKMARKS,
+		1,
+		0,
 		nbu_read_bookmarks_section
 	},
 	{
@@ -158,11 +544,17 @@ static const struct nbu_section nbu_sections[] = {
 			0xef, 0xd4, 0x2e, 0xd0, 0xa3, 0x51, 0x38, 0x47,
 			0x9d, 0xd7, 0x30, 0x5c, 0x7a, 0xf0, 0x68, 0xd3
 		},
+		"contacts",
+		NBU_SECTION_CONTACTS,
+		0,
+		44,
 		nbu_read_contacts_section
 	},
 };
 
-#ifdef NBU_DEBUG
+/* Set by nbu_set_debug(); applies to all contexts */
+static int nbu_debug;
+
 __attribute__((format(printf, 2, 3))) static void
 nbu_dprintf(const char *func, const char *fmt, ...)
 {
@@ -175,28 +567,323 @@ nbu_dprintf(const char *func, const char *fmt, ...)
 		vfprintf(stderr, fmt, ap);
 	va_end(ap);
 }
-#endif
+
+static uint64_t
+nbu_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+nbu_add_stats(struct nbu_stats *sum, const struct nbu_stats *st)
+{
+	sum->bytes_read += st->bytes_read;
+	sum->bytes_written += st->bytes_written;
+	sum->syscalls += st->syscalls;
+	sum->seeks += st->seeks;
+	sum->files += st->files;
+	sum->files_skipped += st->files_skipped;
+	sum->files_linked += st->files_linked;
+	sum->bytes_linked += st->bytes_linked;
+	sum->open_time += st->open_time;
+	sum->read_time += st->read_time;
+	sum->export_time += st->export_time;
+	sum->transcode_time += st->transcode_time;
+	sum->compress_time += st->compress_time;
+	sum->write_time += st->write_time;
+}
+
+/* FNV-1a; continue the hash h with more data */
+static uint64_t
+nbu_hash_more(uint64_t h, const uint8_t *data, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= data[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static uint64_t
+nbu_hash(const uint8_t *data, size_t len)
+{
+	return nbu_hash_more(NBU_HASH_INIT, data, len);
+}
 
 static int
-nbu_read(struct nbu_ctx *ctx, void *ptr, size_t size)
+nbu_write(struct nbu_stats *st, int fd, const void *buf, size_t len)
 {
-	if (fread(ptr, size, 1, ctx->fp) != 1) {
-		if (ferror(ctx->fp))
-			warn("fread");
-		else
-			warnx("Unexpected end of file");
+	size_t off;
+	ssize_t n;
+
+	for (off = 0; off < len; off += n) {
+		st->syscalls++;
+		n = write(fd, (const char *)buf + off, len - off);
+		if (n == -1) {
+			warn("write");
+			return -1;
+		}
+		st->bytes_written += n;
+	}
+
+	return 0;
+}
+
+static int
+nbu_gzip_init(struct nbu_gzip *gz, struct nbu_ctx *ctx, struct nbu_stats *st,
+    int fd, struct nbu_index *out)
+{
+	memset(&gz->zs, 0, sizeof gz->zs);
+	gz->ctx = ctx;
+	gz->st = st;
+	gz->fd = fd;
+	gz->out = out;
+
+	if ((gz->buf = malloc(NBU_GZIP_BUF_SIZE)) == NULL) {
+		warn(NULL);
+		return -1;
+	}
+
+	/* Adding 16 to the window size selects the gzip format */
+	if (deflateInit2(&gz->zs, Z_BEST_SPEED, Z_DEFLATED,
+	    MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		warnx("Cannot initialise compression");
+		free(gz->buf);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+nbu_gzip_free(struct nbu_gzip *gz)
+{
+	deflateEnd(&gz->zs);
+	free(gz->buf);
+}
+
+/* Compress data. If finish is set, the data ends the member. */
+static int
+nbu_gzip_write(struct nbu_gzip *gz, const uint8_t *data, size_t len,
+    int finish)
+{
+	size_t n;
+	uint64_t t;
+	int flush;
+
+	do {
+		n = (len < NBU_GZIP_INPUT_MAX) ? len : NBU_GZIP_INPUT_MAX;
+		gz->zs.next_in = (Bytef *)data;
+		gz->zs.avail_in = n;
+		data += n;
+		len -= n;
+		flush = (finish && len == 0) ? Z_FINISH : Z_NO_FLUSH;
+
+		/* Write the output one buffer at a time */
+		do {
+			gz->zs.next_out = gz->buf;
+			gz->zs.avail_out = NBU_GZIP_BUF_SIZE;
+
+			t = gz->ctx->timing ? nbu_now() : 0;
+			if (deflate(&gz->zs, flush) == Z_STREAM_ERROR) {
+				warnx("Compression failed");
+				return -1;
+			}
+			if (gz->ctx->timing)
+				gz->st->compress_time += nbu_now() - t;
+
+			n = NBU_GZIP_BUF_SIZE - gz->zs.avail_out;
+
+			if (gz->out != NULL) {
+				nbu_index_put(gz->out, gz->buf, n);
+				if (gz->out->error)
+					return -1;
+				continue;
+			}
+
+			t = gz->ctx->timing ? nbu_now() : 0;
+			if (nbu_write(gz->st, gz->fd, gz->buf, n) == -1)
+				return -1;
+			if (gz->ctx->timing)
+				gz->st->write_time += nbu_now() - t;
+		} while (gz->zs.avail_out == 0);
+	} while (len > 0);
+
+	return 0;
+}
+
+/*
+ * Write a buffer to an exported file, compressing it if exported files are
+ * compressed.
+ */
+static int
+nbu_write_file(struct nbu_ctx *ctx, struct nbu_stats *st, int fd,
+    const uint8_t *buf, size_t len)
+{
+	struct nbu_gzip gz;
+	uint64_t t;
+	int ret;
+
+	if (ctx->compress) {
+		if (nbu_gzip_init(&gz, ctx, st, fd, NULL) == -1)
+			return -1;
+		ret = nbu_gzip_write(&gz, buf, len, 1);
+		nbu_gzip_free(&gz);
+		return ret;
+	}
+
+	t = ctx->timing ? nbu_now() : 0;
+	ret = nbu_write(st, fd, buf, len);
+	if (ctx->timing)
+		st->write_time += nbu_now() - t;
+	return ret;
+}
+
+/* Return the suffix of exported files */
+static const char *
+nbu_file_suffix(struct nbu_ctx *ctx)
+{
+	return (ctx->compress && ctx->tar == NULL) ? NBU_GZIP_SUFFIX : "";
+}
+
+/*
+ * Copy a stream that cannot be mapped, such as a pipe, to an unlinked
+ * temporary file. Return a descriptor for the file. The contents are hashed
+ * along the way, since the modification time of the file cannot tie an index
+ * to them. The copy is not part of the export, so it is not counted in the
+ * statistics.
+ */
+static int
+nbu_spool(struct nbu_ctx *ctx, int fd, const char *name)
+{
+	char *path;
+	const char *tmpdir;
+	size_t off;
+	ssize_t n, w;
+	int tmpfd;
+	uint8_t buf[65536];
+
+	if ((tmpdir = getenv("TMPDIR")) == NULL || *tmpdir == '\0')
+		tmpdir = "/tmp";
+
+	if (asprintf(&path, "%s/nbu-export.XXXXXXXXXX", tmpdir) == -1) {
+		warnx("asprintf() failed");
+		return -1;
+	}
+
+	if ((tmpfd = mkstemp(path)) == -1) {
+		warn("mkstemp: %s", path);
+		free(path);
+		return -1;
+	}
+
+	unlink(path);
+
+	ctx->spool_hash = NBU_HASH_INIT;
+
+	for (;;) {
+		if ((n = read(fd, buf, sizeof buf)) == -1) {
+			if (errno == EINTR)
+				continue;
+			warn("read: %s", name);
+			goto error;
+		}
+		if (n == 0)
+			break;
+
+		ctx->spool_hash = nbu_hash_more(ctx->spool_hash, buf, n);
+
+		for (off = 0; off < (size_t)n; off += w)
+			if ((w = write(tmpfd, buf + off, n - off)) == -1) {
+				warn("write: %s", path);
+				goto error;
+			}
+	}
+
+	free(path);
+	return tmpfd;
+
+error:
+	free(path);
+	close(tmpfd);
+	return -1;
+}
+
+static int
+nbu_map(struct nbu_ctx *ctx, int fd, const char *name)
+{
+	struct stat st;
+	int spoolfd;
+
+	spoolfd = -1;
+	ctx->stats.syscalls++;
+
+	if (fstat(fd, &st) == -1) {
+		warn("fstat: %s", name);
 		return -1;
 	}
 
+	if (!S_ISREG(st.st_mode)) {
+		if ((spoolfd = nbu_spool(ctx, fd, name)) == -1)
+			return -1;
+
+		fd = spoolfd;
+		ctx->stats.syscalls++;
+
+		if (fstat(fd, &st) == -1) {
+			warn("fstat: %s", name);
+			goto error;
+		}
+	}
+
+	if ((uintmax_t)st.st_size > SIZE_MAX) {
+		warnx("%s: File too large", name);
+		goto error;
+	}
+
+	ctx->size = st.st_size;
+	ctx->mtime = st.st_mtim;
+
+	/* mmap() does not accept a zero length */
+	if (ctx->size > 0) {
+		ctx->stats.syscalls++;
+		ctx->map = mmap(NULL, ctx->size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (ctx->map == MAP_FAILED) {
+			warn("mmap: %s", name);
+			ctx->map = NULL;
+			goto error;
+		}
+	}
+
+	if (spoolfd != -1) {
+		ctx->stats.syscalls++;
+		close(spoolfd);
+	}
+
 	return 0;
+
+error:
+	if (spoolfd != -1)
+		close(spoolfd);
+	return -1;
 }
 
 static int
-nbu_read_uint8(struct nbu_ctx *ctx, uint8_t *u)
+nbu_read(struct nbu_ctx *ctx, void *ptr, size_t size)
 {
-	if (nbu_read(ctx, u, sizeof *u) == -1)
+	if (ctx->pos > ctx->size || size > ctx->size - ctx->pos) {
+		warnx("Unexpected end of file");
 		return -1;
+	}
 
+	memcpy(ptr, ctx->map + ctx->pos, size);
+	ctx->pos += size;
+	ctx->stats.bytes_read += size;
 	return 0;
 }
 
@@ -238,9 +925,11 @@ static uint16_t *
 nbu_read_utf16_n(struct nbu_ctx *ctx, size_t len)
 {
 	uint16_t *utf16;
+#if BYTE_ORDER == BIG_ENDIAN
 	size_t i;
+#endif
 
-	if (len == SIZE_MAX) {
+	if (len >= SIZE_MAX / sizeof *utf16) {
 		warnx("UTF-16 string too long");
 		return NULL;
 	}
@@ -250,14 +939,17 @@ nbu_read_utf16_n(struct nbu_ctx *ctx, size_t len)
 		return NULL;
 	}
 
-	for (i = 0; i < len; i++) {
-		if (nbu_read_uint16(ctx, &utf16[i]) == -1) {
-			free(utf16);
-			return NULL;
-		}
+	if (nbu_read(ctx, utf16, len * sizeof *utf16) == -1) {
+		free(utf16);
+		return NULL;
 	}
 
-	utf16[i] = 0;
+#if BYTE_ORDER == BIG_ENDIAN
+	for (i = 0; i < len; i++)
+		utf16[i] = le16toh(utf16[i]);
+#endif
+
+	utf16[len] = 0;
 	return utf16;
 }
 
@@ -295,41 +987,136 @@ nbu_read_file_time(struct nbu_ctx *ctx, uint64_t *u)
 	return 0;
 }
 
+/* Return a pointer to the data of an item in the mapping */
+static const uint8_t *
+nbu_get_item_data(struct nbu_ctx *ctx, size_t item)
+{
+	long pos;
+	uint32_t len;
+
+	pos = ctx->item_pos[item];
+	len = ctx->item_len[item];
+
+	if (pos < 0 || (unsigned long)pos > ctx->size ||
+	    len > ctx->size - pos) {
+		warnx("Unexpected end of file");
+		return NULL;
+	}
+
+	return ctx->map + pos;
+}
+
+/*
+ * Like fseek(), seeking beyond the end of the file is allowed; nbu_read()
+ * fails if it is asked to read there.
+ */
 static int
 nbu_seek(struct nbu_ctx *ctx, long offset, int whence)
 {
-	if (fseek(ctx->fp, offset, whence) == -1) {
-		warn("fseek");
+	size_t base;
+
+	switch (whence) {
+	case SEEK_SET:
+		base = 0;
+		break;
+	case SEEK_CUR:
+		base = ctx->pos;
+		break;
+	case SEEK_END:
+		base = ctx->size;
+		break;
+	default:
+		warnx("Invalid seek mode");
 		return -1;
 	}
+
+	ctx->stats.seeks++;
+
+	if (offset < 0) {
+		if ((unsigned long)-(offset + 1) >= base) {
+			warnx("Invalid file offset");
+			return -1;
+		}
+		ctx->pos = base - (unsigned long)-(offset + 1) - 1;
+	} else {
+		if ((unsigned long)offset > SIZE_MAX - base) {
+			warnx("Invalid file offset");
+			return -1;
+		}
+		ctx->pos = base + offset;
+	}
+
 	return 0;
 }
 
 static int
 nbu_tell(struct nbu_ctx *ctx, long *pos)
 {
-	if ((*pos = ftell(ctx->fp)) == -1) {
-		warn("ftell");
+	if (ctx->pos > LONG_MAX) {
+		warnx("File offset too large");
 		return -1;
 	}
+	*pos = ctx->pos;
 	return 0;
 }
 
+/* Skip a little-endian UTF-16 string */
 static int
-nbu_write(int fd, const void *buf, size_t len)
+nbu_skip_utf16(struct nbu_ctx *ctx)
 {
-	size_t off;
-	ssize_t n;
+	uint16_t len;
 
-	for (off = 0; off < len; off += n) {
-		n = write(fd, (const char *)buf + off, len - off);
-		if (n == -1) {
-			warn("write");
-			return -1;
+	if (nbu_read_uint16(ctx, &len) == -1)
+		return -1;
+
+	return nbu_seek(ctx, (long)len * 2, SEEK_CUR);
+}
+
+/*
+ * Read a record and decode its fields into v. Return a pointer to the record
+ * in the mapping.
+ */
+static const uint8_t *
+nbu_read_record(struct nbu_ctx *ctx, const struct nbu_layout *layout,
+    uint64_t v[NBU_LAYOUT_NFIELDS])
+{
+	const uint8_t *p;
+	size_t i;
+	uint64_t u64;
+	uint32_t u32;
+	uint16_t u16;
+
+	if (ctx->pos > ctx->size || layout->size > ctx->size - ctx->pos) {
+		warnx("Unexpected end of file");
+		return NULL;
+	}
+
+	p = ctx->map + ctx->pos;
+
+	for (i = 0; i < NBU_LAYOUT_NFIELDS && layout->fields[i].size != 0;
+	    i++) {
+		switch (layout->fields[i].size) {
+		case 1:
+			v[i] = p[layout->fields[i].offset];
+			break;
+		case 2:
+			memcpy(&u16, p + layout->fields[i].offset, 2);
+			v[i] = le16toh(u16);
+			break;
+		case 4:
+			memcpy(&u32, p + layout->fields[i].offset, 4);
+			v[i] = le32toh(u32);
+			break;
+		default:
+			memcpy(&u64, p + layout->fields[i].offset, 8);
+			v[i] = le64toh(u64);
+			break;
 		}
 	}
 
-	return 0;
+	ctx->pos += layout->size;
+	ctx->stats.bytes_read += layout->size;
+	return p;
 }
 
 static uint8_t *
@@ -353,13 +1140,12 @@ nbu_convert_utf16_to_utf8(const uint16_t *utf16)
 	return utf8;
 }
 
-#ifdef NBU_DEBUG
 static const char *
-nbu_guid_to_string(const uint8_t guid[NBU_GUID_LEN])
+nbu_guid_to_string(char buf[NBU_GUID_STRING_LEN],
+    const uint8_t guid[NBU_GUID_LEN])
 {
 	char *p;
 	int i;
-	static char buf[NBU_GUID_LEN * 2 + 1];
 
 	p = buf;
 	for (i = 0; i < NBU_GUID_LEN; i++) {
@@ -399,7 +1185,6 @@ nbu_print_phone_info(struct nbu_ctx *ctx)
 	nbu_print_utf16("phone firmware", ctx->phone_firmware);
 	nbu_print_utf16("phone language", ctx->phone_language);
 }
-#endif
 
 static void
 nbu_sanitise_filename(char *name)
@@ -421,1178 +1206,6125 @@ nbu_sanitise_filename(char *name)
 			*c = '_';
 }
 
-struct nbu_item_list *
-nbu_new_item_list(void)
+/*
+ * Append an item to a list, after checking that its data lies within the
+ * backup. The list must be the most recently added one.
+ */
+static int
+nbu_add_item(struct nbu_ctx *ctx, struct nbu_item_list *list, long pos,
+    uint32_t len)
 {
-	struct nbu_item_list *list;
+	long *newpos;
+	uint32_t *newlen;
+	size_t newsize;
 
-	if ((list = malloc(sizeof *list)) == NULL) {
-		warn(NULL);
-		return NULL;
+	if (pos < 0 || (unsigned long)pos > ctx->size ||
+	    len > ctx->size - pos) {
+		warnx("Item extends beyond end of file");
+		return -1;
 	}
 
-	STAILQ_INIT(list);
-	return list;
-}
+	if (ctx->nitems == ctx->items_size) {
+		newsize = (ctx->items_size == 0) ? 64 : ctx->items_size * 2;
 
-static void
-nbu_free_item_list(struct nbu_item_list *list)
-{
-	struct nbu_item *item;
+		newpos = reallocarray(ctx->item_pos, newsize, sizeof *newpos);
+		if (newpos == NULL) {
+			warn(NULL);
+			return -1;
+		}
+		ctx->item_pos = newpos;
 
-	if (list != NULL) {
-		while ((item = STAILQ_FIRST(list)) != NULL) {
-			STAILQ_REMOVE_HEAD(list, entries);
-			free(item);
+		newlen = reallocarray(ctx->item_len, newsize, sizeof *newlen);
+		if (newlen == NULL) {
+			warn(NULL);
+			return -1;
 		}
-		free(list);
-	}
-}
+		ctx->item_len = newlen;
 
-static int
-nbu_add_item(struct nbu_item_list *list, long pos, uint32_t len)
-{
-	struct nbu_item *item;
+		newlen = reallocarray(ctx->item_strings, newsize,
+		    sizeof *newlen);
+		if (newlen == NULL) {
+			warn(NULL);
+			return -1;
+		}
+		ctx->item_strings = newlen;
 
-	if ((item = malloc(sizeof *item)) == NULL) {
-		warn(NULL);
-		return -1;
+		ctx->items_size = newsize;
 	}
 
-	item->pos = pos;
-	item->len = len;
-	STAILQ_INSERT_TAIL(list, item, entries);
+	if (list->nitems == 0)
+		list->first = ctx->nitems;
+
+	ctx->item_pos[ctx->nitems] = pos;
+	ctx->item_len[ctx->nitems] = len;
+	ctx->item_strings[ctx->nitems] = 0;
+	ctx->nitems++;
+	list->nitems++;
 	return 0;
 }
 
+/*
+ * Append a new folder to a list. The list must be the most recently added one.
+ * The returned pointer is valid until the next folder is added.
+ */
 static struct nbu_folder *
-nbu_new_folder(void)
+nbu_add_folder(struct nbu_ctx *ctx, struct nbu_folder_list *list)
 {
-	struct nbu_folder *folder;
+	struct nbu_folder *folder, *newfolders;
+	size_t newsize;
 
-	if ((folder = malloc(sizeof *folder)) == NULL) {
-		warn(NULL);
-		return NULL;
-	}
+	if (ctx->nfolders == ctx->folders_size) {
+		newsize = (ctx->folders_size == 0) ? 16 :
+		    ctx->folders_size * 2;
 
-	if ((folder->items = nbu_new_item_list()) == NULL) {
-		free(folder);
-		return NULL;
+		newfolders = reallocarray(ctx->folders, newsize,
+		    sizeof *newfolders);
+		if (newfolders == NULL) {
+			warn(NULL);
+			return NULL;
+		}
+
+		ctx->folders = newfolders;
+		ctx->folders_size = newsize;
 	}
 
+	if (list->nfolders == 0)
+		list->first = ctx->nfolders;
+
+	folder = &ctx->folders[ctx->nfolders++];
+	list->nfolders++;
+
 	folder->name = NULL;
+	folder->items.first = 0;
+	folder->items.nitems = 0;
+	folder->nmembers = 0;
 	return folder;
 }
 
-static void
-nbu_free_folder(struct nbu_folder *folder)
-{
-	if (folder != NULL) {
-		free(folder->name);
-		nbu_free_item_list(folder->items);
-		free(folder);
-	}
-}
-
-static struct nbu_folder_list *
-nbu_new_folder_list(void)
+static int
+nbu_writer_init(struct nbu_writer *w, struct nbu_ctx *ctx,
+    struct nbu_stats *st, int fd, size_t bufsize)
 {
-	struct nbu_folder_list *list;
-
-	if ((list = malloc(sizeof *list)) == NULL) {
+	w->fd = fd;
+	w->ctx = ctx;
+	w->st = st;
+	w->buflen = 0;
+	w->bufsize = bufsize;
+	w->iovcnt = 0;
+	w->pending = 0;
+	w->gz = NULL;
+
+	if (bufsize == 0)
+		w->buf = NULL;
+	else if ((w->buf = malloc(bufsize)) == NULL) {
 		warn(NULL);
-		return NULL;
+		return -1;
 	}
 
-	STAILQ_INIT(list);
-	return list;
+	return 0;
 }
 
 static void
-nbu_free_folder_list(struct nbu_folder_list *list)
+nbu_writer_free(struct nbu_writer *w)
 {
-	struct nbu_folder *folder;
+	free(w->buf);
+}
+
+static int
+nbu_writer_flush(struct nbu_writer *w)
+{
+	struct iovec *iov;
+	ssize_t n;
+	uint64_t t;
+	int i, iovcnt;
 
-	if (list != NULL) {
-		while ((folder = STAILQ_FIRST(list)) != NULL) {
-			STAILQ_REMOVE_HEAD(list, entries);
-			nbu_free_folder(folder);
+	iov = w->iov;
+	iovcnt = w->iovcnt;
+
+	if (w->gz != NULL) {
+		for (i = 0; i < iovcnt; i++)
+			if (nbu_gzip_write(w->gz, iov[i].iov_base,
+			    iov[i].iov_len, 0) == -1)
+				return -1;
+		iovcnt = 0;
+	}
+
+	t = w->ctx->timing ? nbu_now() : 0;
+
+	while (iovcnt > 0) {
+		w->st->syscalls++;
+		if ((n = writev(w->fd, iov, iovcnt)) == -1) {
+			warn("writev");
+			return -1;
+		}
+		w->st->bytes_written += n;
+
+		/* Skip what was written; continue after a short write */
+		for (; iovcnt > 0 && (size_t)n >= iov->iov_len; iov++, iovcnt--)
+			n -= iov->iov_len;
+		if (iovcnt > 0) {
+			iov->iov_base = (uint8_t *)iov->iov_base + n;
+			iov->iov_len -= n;
 		}
-		free(list);
 	}
+
+	if (w->ctx->timing)
+		w->st->write_time += nbu_now() - t;
+
+	w->buflen = 0;
+	w->iovcnt = 0;
+	w->pending = 0;
+	return 0;
 }
 
+/* Queue data that stays valid until the writer is flushed */
 static int
-nbu_export_item_to_fd(struct nbu_ctx *ctx, struct nbu_item *item, int fd)
+nbu_writer_add(struct nbu_writer *w, const void *data, size_t len)
 {
-	char *buf;
-	int ret;
+	struct iovec *last;
 
-	ret = -1;
+	if (len == 0)
+		return 0;
 
-	if ((buf = malloc(item->len)) == NULL)
-		goto out;
+	last = (w->iovcnt > 0) ? &w->iov[w->iovcnt - 1] : NULL;
 
-	if (nbu_seek(ctx, item->pos, SEEK_SET) == -1)
-		goto out;
+	/* Extend the last vector if the data is adjacent */
+	if (last != NULL && (const uint8_t *)last->iov_base + last->iov_len ==
+	    data)
+		last->iov_len += len;
+	else {
+		if (w->iovcnt == NBU_WRITER_IOVCNT &&
+		    nbu_writer_flush(w) == -1)
+			return -1;
+		w->iov[w->iovcnt].iov_base = (void *)data;
+		w->iov[w->iovcnt].iov_len = len;
+		w->iovcnt++;
+	}
 
-	if (nbu_read(ctx, buf, item->len) == -1)
-		goto out;
+	w->pending += len;
 
-	if (nbu_write(fd, buf, item->len) == -1)
-		goto out;
+	if (w->pending >= NBU_WRITER_BUF_SIZE)
+		return nbu_writer_flush(w);
 
-	ret = 0;
+	return 0;
+}
 
-out:
-	free(buf);
-	return ret;
+/*
+ * Return space for len bytes in the buffer. Also make sure a vector is free,
+ * so that nbu_writer_commit() does not flush the buffer before queueing it.
+ */
+static uint8_t *
+nbu_writer_reserve(struct nbu_writer *w, size_t len)
+{
+	if ((len > w->bufsize - w->buflen || w->iovcnt == NBU_WRITER_IOVCNT) &&
+	    nbu_writer_flush(w) == -1)
+		return NULL;
+
+	return w->buf + w->buflen;
 }
 
+/* Queue len bytes written to the space returned by nbu_writer_reserve() */
 static int
-nbu_export_item(struct nbu_ctx *ctx, struct nbu_item *item, int dfd,
-    const char *path)
+nbu_writer_commit(struct nbu_writer *w, size_t len)
 {
-	int fd;
+	uint8_t *data;
 
-	fd = openat(dfd, path, O_WRONLY | O_CREAT | O_EXCL, 0666);
-	if (fd == -1) {
-		warn("openat: %s", path);
-		return -1;
-	}
+	data = w->buf + w->buflen;
+	w->buflen += len;
+	return nbu_writer_add(w, data, len);
+}
 
-	if (nbu_export_item_to_fd(ctx, item, fd) == -1) {
-		close(fd);
+static int
+nbu_export_item(struct nbu_writer *w, size_t item)
+{
+	const uint8_t *data;
+
+	if ((data = nbu_get_item_data(w->ctx, item)) == NULL)
 		return -1;
-	}
 
-	close(fd);
-	return 0;
+	w->st->bytes_read += w->ctx->item_len[item];
+	return nbu_writer_add(w, data, w->ctx->item_len[item]);
 }
 
+/*
+ * Convert the item in chunks of at most NBU_UTF16_CHUNK_LEN code units, so
+ * that the buffer of the writer can be small.
+ */
 static int
-nbu_export_utf16_item_to_fd(struct nbu_ctx *ctx, struct nbu_item *item, int fd)
+nbu_export_utf16_item(struct nbu_writer *w, size_t item)
 {
-	uint16_t *utf16;
-	uint8_t *utf8;
-	size_t len;
+	struct nbu_ctx *ctx;
+	const uint8_t *data;
+	uint8_t *buf;
+	size_t buflen, len, n, nconv;
+	uint64_t t;
+
+	ctx = w->ctx;
 
 	/* Sanity check */
-	if (item->len % 2 != 0) {
+	if (ctx->item_len[item] % 2 != 0) {
 		warnx("Invalid item size");
 		return -1;
 	}
 
+	if ((data = nbu_get_item_data(ctx, item)) == NULL)
+		return -1;
+
+	w->st->bytes_read += ctx->item_len[item];
+
 	/* Convert length from bytes to UTF-16 code units */
-	len = item->len / 2;
+	len = ctx->item_len[item] / 2;
 
-	if (nbu_seek(ctx, item->pos, SEEK_SET) == -1)
-		return -1;
+	while (len > 0) {
+		n = (len < NBU_UTF16_CHUNK_LEN) ? len : NBU_UTF16_CHUNK_LEN;
 
-	if ((utf16 = nbu_read_utf16_n(ctx, len)) == NULL)
-		return -1;
+		/*
+		 * Do not split a surrogate pair. Leave a high surrogate (d800
+		 * to dbff) at the end of the chunk for the next chunk.
+		 */
+		if (n < len && (data[2 * n - 1] & 0xfc) == 0xd8)
+			n--;
 
-	if ((utf8 = nbu_convert_utf16_to_utf8(utf16)) == NULL) {
-		free(utf16);
-		return -1;
-	}
+		/* A code unit is converted to at most 3 UTF-8 bytes */
+		if ((buf = nbu_writer_reserve(w, 3 * n)) == NULL)
+			return -1;
 
-	free(utf16);
-	len = strlen((char *)utf8);
+		nconv = n;
+		t = ctx->timing ? nbu_now() : 0;
+		buflen = utf16le_convert_to_utf8(buf, data, &nconv);
+		if (ctx->timing)
+			w->st->transcode_time += nbu_now() - t;
 
-	if (nbu_write(fd, utf8, len) == -1) {
-		free(utf8);
-		return -1;
+		if (nbu_writer_commit(w, buflen) == -1)
+			return -1;
+
+		/* Stop at a NUL code unit */
+		if (nconv < n)
+			break;
+
+		data += 2 * n;
+		len -= n;
 	}
 
-	free(utf8);
 	return 0;
 }
 
 static int
-nbu_export_utf16_item(struct nbu_ctx *ctx, struct nbu_item *item, int dfd,
-    const char *path)
+nbu_write_items(struct nbu_writer *w, const struct nbu_item_list *list,
+    enum nbu_item_type type)
 {
-	int fd;
-
-	fd = openat(dfd, path, O_WRONLY | O_CREAT | O_EXCL, 0666);
-	if (fd == -1) {
-		warn("openat: %s", path);
-		return -1;
-	}
+	size_t i;
 
-	if (nbu_export_utf16_item_to_fd(ctx, item, fd) == -1) {
-		close(fd);
-		return -1;
+	for (i = list->first; i < list->first + list->nitems; i++) {
+		if (type == NBU_ITEM_UTF16) {
+			if (nbu_export_utf16_item(w, i) == -1)
+				return -1;
+		} else {
+			if (nbu_export_item(w, i) == -1)
+				return -1;
+		}
 	}
 
-	close(fd);
 	return 0;
 }
 
+/*
+ * Convert a list of UTF-16 items to a new buffer. Unlike
+ * nbu_export_utf16_item(), convert each item at once.
+ */
 static int
-nbu_export_item_list(struct nbu_ctx *ctx, struct nbu_item_list *list, int dfd,
-    const char *path)
+nbu_convert_items(struct nbu_ctx *ctx, struct nbu_stats *st,
+    const struct nbu_item_list *list, uint8_t **bufp, size_t *lenp)
 {
-	struct nbu_item *item;
-	int fd;
-
-	if (list == NULL || STAILQ_EMPTY(list))
-		return 0;
+	const uint8_t *data;
+	uint8_t *buf;
+	size_t i, len, n, size;
+	uint64_t t;
+
+	size = 0;
+	for (i = list->first; i < list->first + list->nitems; i++) {
+		if (ctx->item_len[i] % 2 != 0) {
+			warnx("Invalid item size");
+			return -1;
+		}
+		size += ctx->item_len[i] / 2;
+	}
 
-	fd = openat(dfd, path, O_WRONLY | O_CREAT | O_EXCL, 0666);
-	if (fd == -1) {
-		warn("openat: %s", path);
+	/* A code unit is converted to at most 3 UTF-8 bytes */
+	if ((buf = reallocarray(NULL, (size > 0) ? size : 1, 3)) == NULL) {
+		warn(NULL);
 		return -1;
 	}
 
-	STAILQ_FOREACH(item, list, entries) {
-		if (nbu_export_item_to_fd(ctx, item, fd) == -1) {
-			close(fd);
+	len = 0;
+	for (i = list->first; i < list->first + list->nitems; i++) {
+		if ((data = nbu_get_item_data(ctx, i)) == NULL) {
+			free(buf);
 			return -1;
 		}
+
+		st->bytes_read += ctx->item_len[i];
+		n = ctx->item_len[i] / 2;
+		t = ctx->timing ? nbu_now() : 0;
+		len += utf16le_convert_to_utf8(buf + len, data, &n);
+		if (ctx->timing)
+			st->transcode_time += nbu_now() - t;
 	}
 
-	close(fd);
+	*bufp = buf;
+	*lenp = len;
 	return 0;
 }
 
+static const uint8_t nbu_tar_zero[NBU_TAR_BLOCK_SIZE];
+
+/* Store the path in the name and prefix fields of a ustar header */
 static int
-nbu_export_message_folder(struct nbu_ctx *ctx, struct nbu_folder *folder,
-    int dfd, const char *path)
+nbu_tar_set_path(uint8_t *hdr, const char *path)
 {
-	struct nbu_item *item;
-	char *base, *name;
-	int fd;
+	const char *p;
+	size_t len, plen;
 
-	if ((base = (char *)nbu_convert_utf16_to_utf8(folder->name)) == NULL)
-		return -1;
+	len = strlen(path);
 
-	nbu_sanitise_filename(base);
+	if (len <= 100) {
+		memcpy(hdr, path, len);
+		return 0;
+	}
 
-	if (asprintf(&name, "%s/%s.vmg", path, base) == -1) {
-		warnx("asprintf() failed");
-		free(base);
+	/* Split the path at a slash */
+	for (p = path; (p = strchr(p, '/')) != NULL; p++) {
+		plen = p - path;
+		if (plen > 155)
+			break;
+		if (len - plen - 1 <= 100 && len - plen - 1 > 0) {
+			memcpy(hdr + 345, path, plen);
+			memcpy(hdr, p + 1, len - plen - 1);
+			return 0;
+		}
 	}
 
-	free(base);
+	warnx("%s: Path too long for tar", path);
+	return -1;
+}
 
-	fd = openat(dfd, name, O_WRONLY | O_CREAT | O_EXCL, 0666);
-	if (fd == -1) {
-		warn("openat");
-		free(name);
+static int
+nbu_tar_add_header(struct nbu_ctx *ctx, const char *path, char type,
+    uint64_t size)
+{
+	uint8_t *hdr;
+	uint64_t mtime;
+	unsigned int i, sum;
+
+	if (size > NBU_TAR_NUMBER_MAX) {
+		warnx("%s: File too large for tar", path);
 		return -1;
 	}
 
-	free(name);
+	/* All members get the modification time of the backup */
+	mtime = (ctx->mtime.tv_sec > 0) ? ctx->mtime.tv_sec : 0;
+	if (mtime > NBU_TAR_NUMBER_MAX)
+		mtime = NBU_TAR_NUMBER_MAX;
 
-	STAILQ_FOREACH(item, folder->items, entries) {
-		if (nbu_export_utf16_item_to_fd(ctx, item, fd) == -1) {
-			close(fd);
-			return -1;
-		}
-	}
+	if ((hdr = nbu_writer_reserve(ctx->tar, NBU_TAR_BLOCK_SIZE)) == NULL)
+		return -1;
 
-	close(fd);
-	return 0;
+	memset(hdr, 0, NBU_TAR_BLOCK_SIZE);
+
+	if (nbu_tar_set_path(hdr, path) == -1)
+		return -1;
+
+	snprintf((char *)hdr + 100, 8, "%07o", (type == '5') ? 0755 : 0644);
+	snprintf((char *)hdr + 108, 8, "%07o", 0);
+	snprintf((char *)hdr + 116, 8, "%07o", 0);
+	snprintf((char *)hdr + 124, 12, "%011llo", (unsigned long long)size);
+	snprintf((char *)hdr + 136, 12, "%011llo", (unsigned long long)mtime);
+	hdr[156] = type;
+	memcpy(hdr + 257, "ustar", 6);
+	memcpy(hdr + 263, "00", 2);
+
+	/* The checksum is computed with the checksum field set to spaces */
+	memset(hdr + 148, ' ', 8);
+	for (sum = 0, i = 0; i < NBU_TAR_BLOCK_SIZE; i++)
+		sum += hdr[i];
+	snprintf((char *)hdr + 148, 8, "%06o", sum);
+	hdr[155] = ' ';
+
+	return nbu_writer_commit(ctx->tar, NBU_TAR_BLOCK_SIZE);
 }
 
+/*
+ * Write a list of items as a member of the tar stream. The size must be in
+ * the header, so it is computed first. This also checks the items, so that
+ * the stream is not left with a partial member.
+ */
 static int
-nbu_export_mms_folder(struct nbu_ctx *ctx, struct nbu_folder *folder, int dfd,
+nbu_tar_export_item_list(struct nbu_ctx *ctx, struct nbu_stats *st,
+    const struct nbu_item_list *list, enum nbu_item_type type,
     const char *path)
 {
-	struct nbu_item *item;
-	char *base, *dir, *file;
-	int i, ret;
+	const uint8_t *data;
+	uint64_t size;
+	size_t i;
+	int ret;
 
-	if ((base = (char *)nbu_convert_utf16_to_utf8(folder->name)) == NULL)
-		return -1;
+	size = 0;
 
-	nbu_sanitise_filename(base);
+	for (i = list->first; i < list->first + list->nitems; i++) {
+		if ((data = nbu_get_item_data(ctx, i)) == NULL)
+			return -1;
 
-	if (asprintf(&dir, "%s/%s", path, base) == -1) {
-		warnx("asprintf() failed");
-		free(base);
+		if (type == NBU_ITEM_RAW)
+			size += ctx->item_len[i];
+		else if (ctx->item_len[i] % 2 != 0) {
+			warnx("Invalid item size");
+			return -1;
+		} else
+			size += utf16le_utf8_size(data, ctx->item_len[i] / 2);
 	}
 
-	free(base);
-
-	if (mkdirat(dfd, dir, 0777) == -1 && errno != EEXIST) {
-		warn("mkdirat: %s", dir);
-		free(dir);
-		return -1;
-	}
+	ctx->tar->st = st;
+	ret = -1;
 
-	ret = 0;
-	i = 1;
+	if (nbu_tar_add_header(ctx, path, '0', size) == -1)
+		goto out;
 
-	STAILQ_FOREACH(item, folder->items, entries) {
-		if (asprintf(&file, "%s/%d.mms", dir, i++) == -1) {
-			warnx("asprintf() failed");
-			ret = -1;
-			continue;
-		}
+	if (nbu_write_items(ctx->tar, list, type) == -1)
+		goto out;
 
-		if (nbu_export_item(ctx, item, dfd, file) == -1)
-			ret = -1;
+	if (size % NBU_TAR_BLOCK_SIZE != 0 && nbu_writer_add(ctx->tar,
+	    nbu_tar_zero, NBU_TAR_BLOCK_SIZE - size % NBU_TAR_BLOCK_SIZE) == -1)
+		goto out;
 
-		free(file);
-	}
+	st->files++;
+	ret = 0;
 
-	free(dir);
+out:
+	ctx->tar->st = &ctx->stats;
 	return ret;
 }
 
+/*
+ * Contacts and calendar items can also be exported as a table, with a row for
+ * each vCard, event or to-do. A column holds the values of a property, or a
+ * component of a structured value such as N. Multiple values of a column are
+ * separated by newlines.
+ */
+#define NBU_VALUE_TEXT	(-1)	/* The whole value */
+#define NBU_VALUE_LIST	(-2)	/* The components, separated by commas */
+#define NBU_VALUE_TYPE	(-3)	/* The type of the row, not a property */
+
+#define NBU_TABLE_COLUMNS_MAX 16
+
+struct nbu_table_column {
+	const char	*name;
+	const char	*property;
+	int		 component;
+};
+
+struct nbu_table {
+	const char	*rows[2];	/* Objects that are rows */
+	const struct nbu_table_column *columns;
+	size_t		 ncolumns;
+};
+
+static const struct nbu_table_column nbu_contact_columns[] = {
+	{ "formatted_name",	"FN",		NBU_VALUE_TEXT },
+	{ "family_name",	"N",		0 },
+	{ "given_name",		"N",		1 },
+	{ "additional_names",	"N",		2 },
+	{ "tel",		"TEL",		NBU_VALUE_TEXT },
+	{ "email",		"EMAIL",	NBU_VALUE_TEXT },
+	{ "address",		"ADR",		NBU_VALUE_LIST },
+	{ "org",		"ORG",		NBU_VALUE_LIST },
+	{ "title",		"TITLE",	NBU_VALUE_TEXT },
+	{ "url",		"URL",		NBU_VALUE_TEXT },
+	{ "birthday",		"BDAY",		NBU_VALUE_TEXT },
+	{ "note",		"NOTE",		NBU_VALUE_TEXT },
+};
+
+static const struct nbu_table_column nbu_calendar_columns[] = {
+	{ "type",		NULL,		NBU_VALUE_TYPE },
+	{ "summary",		"SUMMARY",	NBU_VALUE_TEXT },
+	{ "location",		"LOCATION",	NBU_VALUE_TEXT },
+	{ "description",	"DESCRIPTION",	NBU_VALUE_TEXT },
+	{ "start",		"DTSTART",	NBU_VALUE_TEXT },
+	{ "end",		"DTEND",	NBU_VALUE_TEXT },
+	{ "due",		"DUE",		NBU_VALUE_TEXT },
+	{ "categories",		"CATEGORIES",	NBU_VALUE_LIST },
+	{ "rrule",		"RRULE",	NBU_VALUE_TEXT },
+	{ "alarm",		"AALARM",	0 },
+	{ "priority",		"PRIORITY",	NBU_VALUE_TEXT },
+	{ "status",		"STATUS",	NBU_VALUE_TEXT },
+	{ "class",		"CLASS",	NBU_VALUE_TEXT },
+};
+
+static const struct nbu_table nbu_contact_table = {
+	{ "VCARD", NULL },
+	nbu_contact_columns,
+	nitems(nbu_contact_columns)
+};
+
+static const struct nbu_table nbu_calendar_table = {
+	{ "VEVENT", "VTODO" },
+	nbu_calendar_columns,
+	nitems(nbu_calendar_columns)
+};
+
+/* A property of a vCard or vCalendar object */
+struct nbu_vprop {
+	const uint8_t	*name;
+	size_t		 namelen;
+	const uint8_t	*value;
+	size_t		 valuelen;
+	const uint8_t	*charset;
+	size_t		 charsetlen;
+	int		 qp;
+	int		 base64;
+};
+
+/* The state of converting vCard or vCalendar objects to table rows */
+struct nbu_vconv {
+	const struct nbu_table *table;
+	int		 format;
+	const uint8_t	*p;
+	const uint8_t	*end;
+	int		 strip_fold;	/* Unfolding removes the whitespace */
+	struct nbu_index line;		/* Unfolded line */
+	struct nbu_index raw;		/* Value without quoted-printable */
+	struct nbu_index value;		/* Value in UTF-8 */
+	struct nbu_index fields[NBU_TABLE_COLUMNS_MAX];
+	struct nbu_index *out;
+};
+
 static int
-nbu_export_calendar(struct nbu_ctx *ctx, int dfd)
+nbu_vconv_equal(const uint8_t *s, size_t len, const char *t)
 {
-	return nbu_export_item_list(ctx, ctx->calendar, dfd,
-	    NBU_CALENDAR_FILE);
+	return strlen(t) == len && strncasecmp((const char *)s, t, len) == 0;
 }
 
+/* Check if the parameters of a line say it is quoted-printable */
 static int
-nbu_export_contacts(struct nbu_ctx *ctx, int dfd)
+nbu_vconv_is_qp(const uint8_t *line, size_t len)
 {
-	return nbu_export_item_list(ctx, ctx->contacts, dfd,
-	    NBU_CONTACTS_FILE);
+	const char qp[] = "QUOTED-PRINTABLE";
+	size_t i;
+
+	for (i = 0; i < len && line[i] != ':'; i++)
+		if (len - i >= sizeof qp - 1 &&
+		    strncasecmp((const char *)line + i, qp, sizeof qp - 1) == 0)
+			return 1;
+
+	return 0;
 }
 
+/*
+ * Read the next line and unfold it: continuation lines start with a space or
+ * tab. In a quoted-printable value, a "=" at the end of a line is a soft line
+ * break.
+ */
 static int
-nbu_export_memos(struct nbu_ctx *ctx, int dfd)
+nbu_vconv_next_line(struct nbu_vconv *v)
 {
-	struct nbu_item *item;
-	int i, ret;
-	char name[32];
+	const uint8_t *eol;
+	size_t len;
+	int qp;
 
-	if (ctx->memos == NULL || STAILQ_EMPTY(ctx->memos))
+	v->line.len = 0;
+	if (v->p == v->end)
 		return 0;
 
-	if (mkdirat(dfd, NBU_MEMOS_DIR, 0777) == -1 && errno != EEXIST) {
-		warn("mkdirat: %s", NBU_MEMOS_DIR);
-		return -1;
-	}
+	qp = -1;
 
-	ret = 0;
-	i = 1;
+	for (;;) {
+		if ((eol = memchr(v->p, '\n', v->end - v->p)) == NULL)
+			eol = v->end;
 
-	STAILQ_FOREACH(item, ctx->memos, entries) {
-		snprintf(name, sizeof name, "%s/memo-%d.txt", NBU_MEMOS_DIR,
-		    i++);
-		if (nbu_export_utf16_item(ctx, item, dfd, name) == -1)
-			ret = -1;
+		len = eol - v->p;
+		if (len > 0 && v->p[len - 1] == '\r')
+			len--;
+
+		nbu_index_put(&v->line, v->p, len);
+		v->p = (eol < v->end) ? eol + 1 : eol;
+
+		if (qp == -1)
+			qp = nbu_vconv_is_qp(v->line.data, v->line.len);
+
+		if (v->p < v->end && (*v->p == ' ' || *v->p == '\t')) {
+			if (v->strip_fold)
+				v->p++;
+		} else if (qp && v->line.len > 0 && v->p < v->end &&
+		    v->line.data[v->line.len - 1] == '=')
+			v->line.len--;
+		else
+			break;
 	}
 
-	return ret;
+	return !v->line.error;
 }
 
+/* Split a line into the name, the parameters that matter and the value */
 static int
-nbu_export_messages(struct nbu_ctx *ctx, int dfd)
+nbu_vconv_parse_line(const uint8_t *line, size_t len, struct nbu_vprop *prop)
 {
-	struct nbu_folder *folder;
-	int ret;
+	const uint8_t *param, *eq;
+	size_t i, plen;
+	int quoted;
 
-	if (ctx->messages == NULL || STAILQ_EMPTY(ctx->messages))
-		return 0;
+	memset(prop, 0, sizeof *prop);
+	prop->name = line;
 
-	if (mkdirat(dfd, NBU_MESSAGES_DIR, 0777) == -1 && errno != EEXIST) {
-		warn("mkdirat: %s", NBU_MESSAGES_DIR);
+	for (i = 0; i < len && line[i] != ';' && line[i] != ':'; i++)
+		/* Skip the group */
+		if (line[i] == '.')
+			prop->name = line + i + 1;
+
+	if (i == len)
 		return -1;
-	}
 
-	ret = 0;
+	prop->namelen = line + i - prop->name;
 
-	STAILQ_FOREACH(folder, ctx->messages, entries) {
-		if (nbu_export_message_folder(ctx, folder, dfd,
-		    NBU_MESSAGES_DIR) == -1)
-			ret = -1;
+	while (line[i] == ';') {
+		param = line + ++i;
+		for (quoted = 0; i < len; i++)
+			if (line[i] == '"')
+				quoted = !quoted;
+			else if (!quoted && (line[i] == ';' || line[i] == ':'))
+				break;
+
+		if (i == len)
+			return -1;
+
+		plen = line + i - param;
+		if ((eq = memchr(param, '=', plen)) == NULL)
+			eq = param - 1;
+
+		if (nbu_vconv_equal(eq + 1, param + plen - eq - 1,
+		    "QUOTED-PRINTABLE"))
+			prop->qp = 1;
+		else if (nbu_vconv_equal(eq + 1, param + plen - eq - 1,
+		    "BASE64") || nbu_vconv_equal(param, plen, "ENCODING=B"))
+			prop->base64 = 1;
+		else if (eq >= param && nbu_vconv_equal(param, eq - param,
+		    "CHARSET")) {
+			prop->charset = eq + 1;
+			prop->charsetlen = param + plen - eq - 1;
+		}
 	}
 
-	return ret;
+	prop->value = line + i + 1;
+	prop->valuelen = len - i - 1;
+	return 0;
 }
 
 static int
-nbu_export_mms(struct nbu_ctx *ctx, int dfd)
+nbu_vconv_hex(uint8_t c)
 {
-	struct nbu_folder *folder;
-	int ret;
-
-	if (ctx->mmses == NULL || STAILQ_EMPTY(ctx->mmses))
-		return 0;
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
 
-	if (mkdirat(dfd, NBU_MMS_DIR, 0777) == -1 && errno != EEXIST) {
-		warn("mkdirat: %s", NBU_MMS_DIR);
-		return -1;
+/*
+ * Decode a value to UTF-8. ISO-8859-1 is converted; other charsets are
+ * assumed to be UTF-8. Invalid UTF-8 is replaced, so that the table is valid
+ * UTF-8.
+ */
+static void
+nbu_vconv_decode(struct nbu_vconv *v, const struct nbu_vprop *prop)
+{
+	const uint8_t *s;
+	uint8_t buf[4], c;
+	size_t i, j, len, n;
+	uint32_t cp;
+	int hi, latin1, lo;
+
+	s = prop->value;
+	len = prop->valuelen;
+	v->value.len = 0;
+
+	if (prop->qp) {
+		v->raw.len = 0;
+		for (i = 0; i < len; i++) {
+			c = s[i];
+			if (c == '=' && i + 2 < len &&
+			    (hi = nbu_vconv_hex(s[i + 1])) != -1 &&
+			    (lo = nbu_vconv_hex(s[i + 2])) != -1) {
+				c = hi << 4 | lo;
+				i += 2;
+			}
+			nbu_index_put(&v->raw, &c, 1);
+		}
+		s = v->raw.data;
+		len = v->raw.len;
 	}
 
-	ret = 0;
+	latin1 = prop->charset != NULL &&
+	    (nbu_vconv_equal(prop->charset, prop->charsetlen, "ISO-8859-1") ||
+	    nbu_vconv_equal(prop->charset, prop->charsetlen, "LATIN1"));
 
-	STAILQ_FOREACH(folder, ctx->mmses, entries) {
-		if (nbu_export_mms_folder(ctx, folder, dfd, NBU_MMS_DIR) == -1)
-			ret =-1;
-	}
+	for (i = 0; i < len; i += n) {
+		/* Copy ASCII at once */
+		for (j = i; j < len && s[j] < 0x80; j++)
+			continue;
+		if (j > i) {
+			nbu_index_put(&v->value, s + i, j - i);
+			n = j - i;
+			continue;
+		}
 
-	return ret;
+		if (latin1) {
+			n = 1;
+			cp = s[i];
+		} else if ((n = utf8_decode(&cp, s + i, len - i)) == 0) {
+			n = 1;
+			cp = UTF_REPLACEMENT_CHAR;
+		}
+		nbu_index_put(&v->value, buf, utf8_encode(buf, cp));
+	}
 }
 
-static int
-nbu_read_vcards(struct nbu_ctx *ctx, struct nbu_item_list *list)
+/*
+ * Add a value to a field. Backslash escapes are removed. If the component is
+ * not NBU_VALUE_TEXT, the value is split into components at semicolons.
+ */
+static void
+nbu_vconv_add_value(struct nbu_index *field, const uint8_t *s, size_t len,
+    int component)
 {
-	long pos;
-	uint32_t i, len, nitems, test;
+	uint8_t c;
+	size_t begin, i, start;
+	int n, sep;
 
-	if (nbu_read_uint32(ctx, &nitems) == -1)
-		return -1;
+	start = field->len;
+	if (field->len > 0)
+		nbu_index_put(field, "\n", 1);
+	begin = field->len;
 
-	NBU_DPRINTF("%" PRIu32 " items\n", nitems);
+	n = 0;
+	sep = 0;
 
-	for (i = 0; i < nitems; i++) {
-		/* NbuExplorer does this. I don't know why. */
-		if (nbu_read_uint32(ctx, &test) == -1)
-			return -1;
-		if (test != 0x10)
-			NBU_DPRINTF("test 1: 0x%" PRIx32 " != 0x10\n", test);
-		else {
-			if (nbu_read_uint32(ctx, &test) == -1)
-				return -1;
-			if (test > 1)
-				NBU_DPRINTF("test 2: 0x%" PRIx32 " > 1\n",
-				    test);
-		}
+	for (i = 0; i < len; i++) {
+		c = s[i];
 
-		if (nbu_read_uint32(ctx, &len) == -1)
-			return -1;
+		if (c == ';' && component != NBU_VALUE_TEXT) {
+			n++;
+			sep = 1;
+			continue;
+		}
 
-		if (nbu_tell(ctx, &pos) == -1)
-			return -1;
+		if (c == '\\' && i + 1 < len) {
+			c = s[i + 1];
+			if (c == 'n' || c == 'N') {
+				c = '\n';
+				i++;
+			} else if (c == '\\' || c == ';' || c == ',' || c == ':')
+				i++;
+			else
+				c = '\\';
+		}
 
-		if (nbu_add_item(list, pos, len) == -1)
-			return -1;
+		if (component == NBU_VALUE_LIST) {
+			/* Join the components that are not empty */
+			if (sep && field->len > begin)
+				nbu_index_put(field, ", ", 2);
+			sep = 0;
+		} else if (component >= 0 && n != component)
+			continue;
 
-		if (nbu_seek(ctx, len, SEEK_CUR) == -1)
-			return -1;
+		nbu_index_put(field, &c, 1);
 	}
 
-	return 0;
+	/* Do not add an empty value */
+	if (field->len == begin)
+		field->len = start;
 }
 
-static struct nbu_folder *
-nbu_read_vcard_folder(struct nbu_ctx *ctx, uint64_t folder_pos)
+static void
+nbu_vconv_put_csv(struct nbu_index *out, const struct nbu_index *field)
 {
-	struct nbu_folder *folder;
-
-	if ((folder = nbu_new_folder()) == NULL)
-		goto error;
-
-	if (nbu_seek(ctx, folder_pos + 4, SEEK_SET) == -1)
-		goto error;
-
-	if ((folder->name = nbu_read_utf16(ctx)) == NULL)
-		goto error;
-
-#ifdef NBU_DEBUG
-	uint8_t *utf8;
-
-	if ((utf8 = nbu_convert_utf16_to_utf8(folder->name)) == NULL)
-		goto error;
+	size_t i, start;
 
-	NBU_DPRINTF("folder \"%s\"\n", utf8);
-	free(utf8);
-#endif
+	if (field->len == 0)
+		return;
 
-	if (nbu_read_vcards(ctx, folder->items) == -1)
-		goto error;
+	for (i = 0; i < field->len; i++)
+		if (field->data[i] == ',' || field->data[i] == '"' ||
+		    field->data[i] == '\r' || field->data[i] == '\n')
+			break;
 
-	return folder;
+	if (i == field->len) {
+		nbu_index_put(out, field->data, field->len);
+		return;
+	}
 
-error:
-	nbu_free_folder(folder);
-	return NULL;
+	/* Quote the field and double the quotes in it */
+	nbu_index_put(out, "\"", 1);
+	for (start = i = 0; i < field->len; i++)
+		if (field->data[i] == '"') {
+			nbu_index_put(out, field->data + start, i - start + 1);
+			start = i;
+		}
+	nbu_index_put(out, field->data + start, field->len - start);
+	nbu_index_put(out, "\"", 1);
 }
 
-static int
-nbu_read_vcard_section(struct nbu_ctx *ctx, uint64_t section_pos,
-    struct nbu_item_list **list)
+static void
+nbu_vconv_put_json(struct nbu_index *out, const struct nbu_index *field)
 {
-	long pos;
-	uint32_t nfolders, nitems;
-
-	if ((*list = nbu_new_item_list()) == NULL)
-		goto error;
+	char esc[8];
+	size_t i, start;
+	uint8_t c;
 
-	if (nbu_read_uint32(ctx, &nitems) == -1)
-		goto error;
+	nbu_index_put(out, "\"", 1);
 
-	NBU_DPRINTF("%" PRIu32 " items\n", nitems);
+	for (start = i = 0; i < field->len; i++) {
+		c = field->data[i];
+		if (c != '"' && c != '\\' && c >= 0x20)
+			continue;
 
-	if (nbu_read_uint32(ctx, &nfolders) == -1)
-		goto error;
+		nbu_index_put(out, field->data + start, i - start);
+		start = i + 1;
 
-	if (nfolders != 0) {
-		warnx("Section unexpectedly contains folders");
-		goto error;
+		if (c == '"' || c == '\\') {
+			esc[0] = '\\';
+			esc[1] = c;
+			nbu_index_put(out, esc, 2);
+		} else if (c == '\n')
+			nbu_index_put(out, "\\n", 2);
+		else {
+			snprintf(esc, sizeof esc, "\\u%04x", c);
+			nbu_index_put(out, esc, 6);
+		}
 	}
 
-	if (nbu_tell(ctx, &pos) == -1)
-		goto error;
+	nbu_index_put(out, field->data + start, field->len - start);
+	nbu_index_put(out, "\"", 1);
+}
 
-	if (nbu_seek(ctx, section_pos + 44, SEEK_SET) == -1)
-		goto error;
+static void
+nbu_vconv_put_header(struct nbu_vconv *v)
+{
+	size_t i;
 
-	if (nbu_read_vcards(ctx, *list) == -1)
-		goto error;
+	for (i = 0; i < v->table->ncolumns; i++) {
+		if (i > 0)
+			nbu_index_put(v->out, ",", 1);
+		nbu_index_put(v->out, v->table->columns[i].name,
+		    strlen(v->table->columns[i].name));
+	}
+	nbu_index_put(v->out, "\r\n", 2);
+}
 
-	if (nbu_seek(ctx, pos, SEEK_SET) == -1)
-		goto error;
+/* Write a row. Empty fields are left out of NDJSON rows. */
+static void
+nbu_vconv_put_row(struct nbu_vconv *v)
+{
+	const char *name;
+	size_t i;
+	int first;
 
-	return 0;
+	if (v->format == NBU_TABLE_CSV) {
+		for (i = 0; i < v->table->ncolumns; i++) {
+			if (i > 0)
+				nbu_index_put(v->out, ",", 1);
+			nbu_vconv_put_csv(v->out, &v->fields[i]);
+		}
+		nbu_index_put(v->out, "\r\n", 2);
+		return;
+	}
 
-error:
-	nbu_free_item_list(*list);
-	*list = NULL;
-	return -1;
+	nbu_index_put(v->out, "{", 1);
+	for (first = 1, i = 0; i < v->table->ncolumns; i++) {
+		if (v->fields[i].len == 0)
+			continue;
+		if (!first)
+			nbu_index_put(v->out, ",", 1);
+		first = 0;
+		name = v->table->columns[i].name;
+		nbu_index_put(v->out, "\"", 1);
+		nbu_index_put(v->out, name, strlen(name));
+		nbu_index_put(v->out, "\":", 2);
+		nbu_vconv_put_json(v->out, &v->fields[i]);
+	}
+	nbu_index_put(v->out, "}\n", 2);
 }
 
+/* Start a row if the object is one */
 static int
-nbu_read_vcard_folder_section(struct nbu_ctx *ctx,
-    struct nbu_folder_list **list)
+nbu_vconv_begin_row(struct nbu_vconv *v, const uint8_t *type, size_t len)
 {
-	struct nbu_folder *folder;
-	long pos;
-	uint64_t folder_pos;
-	uint32_t i, nfolders, nitems;
+	uint8_t c;
+	size_t i;
 
-	if ((*list = nbu_new_folder_list()) == NULL)
-		goto error;
+	for (i = 0; i < nitems(v->table->rows); i++)
+		if (v->table->rows[i] != NULL &&
+		    nbu_vconv_equal(type, len, v->table->rows[i]))
+			break;
 
-	if (nbu_read_uint32(ctx, &nitems) == -1)
-		goto error;
+	if (i == nitems(v->table->rows))
+		return 0;
 
-	if (nbu_read_uint32(ctx, &nfolders) == -1)
-		goto error;
+	for (i = 0; i < v->table->ncolumns; i++) {
+		v->fields[i].len = 0;
 
-	NBU_DPRINTF("%" PRIu32 " items in %" PRIu32 " folders\n", nitems,
-	    nfolders);
+		/* The type is the name of the object, without the "V" */
+		if (v->table->columns[i].component == NBU_VALUE_TYPE)
+			for (type++, len--; len > 0; type++, len--) {
+				c = tolower(*type);
+				nbu_index_put(&v->fields[i], &c, 1);
+			}
+	}
 
-	for (i = 0; i < nfolders; i++) {
-		/* Skip folder id */
-		if (nbu_seek(ctx, 4, SEEK_CUR) == -1)
-			goto error;
+	return 1;
+}
 
-		if (nbu_read_uint64(ctx, &folder_pos) == -1)
-			goto error;
+/* Add a property to the fields of a row */
+static void
+nbu_vconv_add_property(struct nbu_vconv *v, const struct nbu_vprop *prop)
+{
+	const struct nbu_table_column *col;
+	size_t i;
+	int decoded;
 
-		if (nbu_tell(ctx, &pos) == -1)
-			goto error;
+	decoded = 0;
 
-		if ((folder = nbu_read_vcard_folder(ctx, folder_pos)) == NULL)
-			goto error;
+	for (i = 0; i < v->table->ncolumns; i++) {
+		col = &v->table->columns[i];
+		if (col->property == NULL ||
+		    !nbu_vconv_equal(prop->name, prop->namelen, col->property))
+			continue;
 
-		STAILQ_INSERT_TAIL(*list, folder, entries);
+		if (!decoded) {
+			nbu_vconv_decode(v, prop);
+			decoded = 1;
+		}
 
-		if (nbu_seek(ctx, pos, SEEK_SET) == -1)
-			goto error;
+		nbu_vconv_add_value(&v->fields[i], v->value.data,
+		    v->value.len, col->component);
 	}
+}
 
-	return 0;
+/*
+ * Convert the objects in an item to rows. Properties of nested objects, such
+ * as alarms in an event, are ignored. A row that is not ended is still
+ * written.
+ */
+static void
+nbu_vconv_convert(struct nbu_vconv *v, const uint8_t *data, size_t len)
+{
+	struct nbu_vprop prop;
+	size_t depth, rowdepth;
+	int row;
+
+	v->p = data;
+	v->end = data + len;
+	v->strip_fold = 0;
+	depth = rowdepth = 0;
+	row = 0;
+
+	while (nbu_vconv_next_line(v)) {
+		if (nbu_vconv_parse_line(v->line.data, v->line.len, &prop) ==
+		    -1)
+			continue;
 
-error:
-	nbu_free_folder_list(*list);
-	*list = NULL;
-	return -1;
+		if (nbu_vconv_equal(prop.name, prop.namelen, "BEGIN")) {
+			if (!row && nbu_vconv_begin_row(v, prop.value,
+			    prop.valuelen)) {
+				row = 1;
+				rowdepth = depth;
+			}
+			depth++;
+		} else if (nbu_vconv_equal(prop.name, prop.namelen, "END")) {
+			if (depth > 0)
+				depth--;
+			if (row && depth == rowdepth) {
+				nbu_vconv_put_row(v);
+				row = 0;
+			}
+		} else if (nbu_vconv_equal(prop.name, prop.namelen,
+		    "VERSION")) {
+			/* Since vCard 3.0, unfolding removes the whitespace */
+			v->strip_fold = prop.valuelen > 0 &&
+			    prop.value[0] >= '3' && prop.value[0] <= '9';
+		} else if (row && depth == rowdepth + 1 && !prop.base64)
+			nbu_vconv_add_property(v, &prop);
+	}
+
+	if (row)
+		nbu_vconv_put_row(v);
 }
 
-static struct nbu_folder *
-nbu_read_group_folder(struct nbu_ctx *ctx, uint64_t folder_pos)
+/*
+ * Convert a list of vCard or vCalendar items to a table in a new buffer. CSV
+ * tables start with a header, unless they are appended to.
+ */
+static int
+nbu_convert_table(struct nbu_ctx *ctx, struct nbu_stats *st,
+    const struct nbu_item_list *list, enum nbu_item_type type, int header,
+    struct nbu_index *out)
 {
-	struct nbu_folder *folder;
-	uint32_t nitems;
+	struct nbu_vconv v;
+	const uint8_t *data;
+	size_t i;
+	uint64_t t;
+	int ret;
 
-	if ((folder = nbu_new_folder()) == NULL)
-		goto error;
+	memset(&v, 0, sizeof v);
+	v.table = (type == NBU_ITEM_CONTACTS) ? &nbu_contact_table :
+	    &nbu_calendar_table;
+	v.format = ctx->table_format;
+	v.out = out;
 
-	if (nbu_seek(ctx, folder_pos + 4, SEEK_SET) == -1)
-		goto error;
+	if (header && v.format == NBU_TABLE_CSV)
+		nbu_vconv_put_header(&v);
 
-	if ((folder->name = nbu_read_utf16(ctx)) == NULL)
-		goto error;
+	ret = 0;
+	t = ctx->timing ? nbu_now() : 0;
 
-	if (nbu_read_uint32(ctx, &nitems) == -1)
-		goto error;
+	for (i = list->first; i < list->first + list->nitems; i++) {
+		if ((data = nbu_get_item_data(ctx, i)) == NULL) {
+			ret = -1;
+			break;
+		}
+		st->bytes_read += ctx->item_len[i];
+		nbu_vconv_convert(&v, data, ctx->item_len[i]);
+	}
 
-#ifdef NBU_DEBUG
-	uint8_t *utf8;
+	if (ctx->timing)
+		st->transcode_time += nbu_now() - t;
 
-	if ((utf8 = nbu_convert_utf16_to_utf8(folder->name)) == NULL)
-		goto error;
+	if (out->error)
+		ret = -1;
+	for (i = 0; i < v.table->ncolumns; i++) {
+		if (v.fields[i].error)
+			ret = -1;
+		free(v.fields[i].data);
+	}
+	if (v.line.error || v.raw.error || v.value.error)
+		ret = -1;
+	free(v.line.data);
+	free(v.raw.data);
+	free(v.value.data);
+	return ret;
+}
 
-	NBU_DPRINTF("folder \"%s\", %" PRIu32 " items\n", utf8, nitems);
-	free(utf8);
-#endif
+/*
+ * Messages can also be exported as a columnar table, so that a column can be
+ * read without reading the others. The file starts with a header:
+ *
+ *	magic		8 bytes, "NBUTABLE"
+ *	version		uint32
+ *	ncolumns	uint32
+ *	nrows		uint64
+ *
+ * It is followed by a directory entry for each column:
+ *
+ *	name		16 bytes, padded with NULs
+ *	type		uint32, one of enum nbu_column_type
+ *	reserved	uint32
+ *	offset		uint64, from the start of the file
+ *	size		uint64
+ *
+ * The columns start at multiples of 8 bytes. Integers are little-endian.
+ */
+#define NBU_COLUMNS_MAGIC	"NBUTABLE"
+#define NBU_COLUMNS_MAGIC_LEN	8
+#define NBU_COLUMNS_VERSION	1
+#define NBU_COLUMN_NAME_LEN	16
+
+/* Time value of a message without a time */
+#define NBU_COLUMN_NO_TIME	INT64_MIN
+
+enum nbu_column_type {
+	/* An int64 for each row */
+	NBU_COLUMN_INT64 = 1,
+
+	/*
+	 * A uint64 offset for each row and one for the end, followed by the
+	 * UTF-8 strings. Row i is the bytes from offset i to offset i + 1.
+	 */
+	NBU_COLUMN_STRING = 2,
+
+	/*
+	 * A uint32 code for each row, padded to a multiple of 8 bytes,
+	 * followed by a uint64 number of values and the values in the layout
+	 * of a string column. The code of a row is the number of its value.
+	 */
+	NBU_COLUMN_DICT = 3
+};
 
-	/* TODO */
+enum {
+	NBU_MESSAGE_TIME,
+	NBU_MESSAGE_STATUS,
+	NBU_MESSAGE_BOX,
+	NBU_MESSAGE_NUMBER,
+	NBU_MESSAGE_TEXT,
+	NBU_MESSAGE_NCOLUMNS
+};
 
-	return folder;
+struct nbu_column {
+	const char	*name;
+	enum nbu_column_type type;
+	struct nbu_index data;		/* Values or codes */
+	struct nbu_index offsets;	/* Offsets of the strings */
+	struct nbu_index strings;
+	uint64_t	 nvalues;	/* Number of dictionary values */
+};
 
-error:
-	nbu_free_folder(folder);
-	return NULL;
+/* The fields of a message, in UTF-8 */
+struct nbu_message_row {
+	int64_t		 time;
+	struct nbu_index fields[NBU_MESSAGE_NCOLUMNS];
+};
+
+static void
+nbu_column_init(struct nbu_column *col, const char *name,
+    enum nbu_column_type type)
+{
+	memset(col, 0, sizeof *col);
+	col->name = name;
+	col->type = type;
+	if (type != NBU_COLUMN_INT64)
+		nbu_index_put_uint64(&col->offsets, 0);
 }
 
-static struct nbu_folder *
-nbu_read_message_folder(struct nbu_ctx *ctx, uint64_t folder_pos)
+static void
+nbu_column_free(struct nbu_column *col)
 {
-	struct nbu_folder *folder;
-	long pos;
-	uint32_t i, len, nitems;
+	free(col->data.data);
+	free(col->offsets.data);
+	free(col->strings.data);
+}
 
-	if ((folder = nbu_new_folder()) == NULL)
-		goto error;
+static int
+nbu_column_error(const struct nbu_column *col)
+{
+	return col->data.error || col->offsets.error || col->strings.error;
+}
 
-	if (nbu_seek(ctx, folder_pos + 4, SEEK_SET) == -1)
-		goto error;
+static void
+nbu_column_add_string(struct nbu_column *col, const uint8_t *s, size_t len)
+{
+	nbu_index_put(&col->strings, s, len);
+	nbu_index_put_uint64(&col->offsets, col->strings.len);
+}
 
-	if ((folder->name = nbu_read_utf16(ctx)) == NULL)
-		goto error;
+/*
+ * Add a value to a dictionary column. Such columns have few values, so they
+ * are searched linearly.
+ */
+static void
+nbu_column_add_dict(struct nbu_column *col, const uint8_t *s, size_t len)
+{
+	const uint8_t *offsets;
+	uint64_t end, i, start;
 
-	if (nbu_read_uint32(ctx, &nitems) == -1)
-		goto error;
+	offsets = col->offsets.data;
 
-#ifdef NBU_DEBUG
-	uint8_t *utf8;
+	for (i = 0; i < col->nvalues && !col->offsets.error; i++) {
+		start = le64toh(*(const uint64_t *)(offsets + 8 * i));
+		end = le64toh(*(const uint64_t *)(offsets + 8 * (i + 1)));
+		if (end - start == len && memcmp(col->strings.data + start, s,
+		    len) == 0)
+			break;
+	}
 
-	if ((utf8 = nbu_convert_utf16_to_utf8(folder->name)) == NULL)
-		goto error;
+	if (i == col->nvalues) {
+		nbu_column_add_string(col, s, len);
+		col->nvalues++;
+	}
 
-	NBU_DPRINTF("folder \"%s\", %" PRIu32 " messages\n", utf8, nitems);
-	free(utf8);
-#endif
+	nbu_index_put_uint32(&col->data, i);
+}
 
-	for (i = 0; i < nitems; i++) {
-		if (nbu_seek(ctx, 8, SEEK_CUR) == -1)
-			goto error;
+static uint64_t
+nbu_column_size(const struct nbu_column *col)
+{
+	switch (col->type) {
+	case NBU_COLUMN_INT64:
+		return col->data.len;
+	case NBU_COLUMN_STRING:
+		return col->offsets.len + col->strings.len;
+	case NBU_COLUMN_DICT:
+	default:
+		return (col->data.len + 7) / 8 * 8 + 8 + col->offsets.len +
+		    col->strings.len;
+	}
+}
 
-		if (nbu_read_uint32(ctx, &len) == -1)
-			goto error;
+static void
+nbu_column_put_padding(struct nbu_index *out)
+{
+	static const uint8_t zero[8];
 
-		if (nbu_tell(ctx, &pos) == -1)
-			goto error;
+	nbu_index_put(out, zero, (8 - out->len % 8) % 8);
+}
 
-		if (nbu_add_item(folder->items, pos, len) == -1)
-			goto error;
-
-		if (nbu_seek(ctx, len, SEEK_CUR) == -1)
-			goto error;
+static void
+nbu_column_put(struct nbu_index *out, const struct nbu_column *col)
+{
+	if (col->type == NBU_COLUMN_DICT) {
+		nbu_index_put(out, col->data.data, col->data.len);
+		nbu_column_put_padding(out);
+		nbu_index_put_uint64(out, col->nvalues);
+	} else if (col->type == NBU_COLUMN_INT64)
+		nbu_index_put(out, col->data.data, col->data.len);
+
+	if (col->type != NBU_COLUMN_INT64) {
+		nbu_index_put(out, col->offsets.data, col->offsets.len);
+		nbu_index_put(out, col->strings.data, col->strings.len);
 	}
 
-	return folder;
+	nbu_column_put_padding(out);
+}
 
-error:
-	nbu_free_folder(folder);
-	return NULL;
+/*
+ * Parse a time of the form YYYYMMDDTHHMMSS, optionally followed by Z, or of
+ * the form DD.MM.YYYY HH:MM:SS. Times without Z are local to the phone; they
+ * are stored as if they were UTC.
+ */
+static int64_t
+nbu_parse_message_time(const uint8_t *s, size_t len)
+{
+	struct tm tm;
+	char buf[32];
+	time_t t;
+	int n;
+
+	if (len >= sizeof buf)
+		return NBU_COLUMN_NO_TIME;
+
+	memcpy(buf, s, len);
+	buf[len] = '\0';
+	memset(&tm, 0, sizeof tm);
+
+	if (sscanf(buf, "%4d%2d%2dT%2d%2d%2d%n", &tm.tm_year, &tm.tm_mon,
+	    &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &n) == 6) {
+		if (buf[n] != '\0' && strcmp(buf + n, "Z") != 0)
+			return NBU_COLUMN_NO_TIME;
+	} else if (sscanf(buf, "%2d.%2d.%4d %2d:%2d:%2d%n", &tm.tm_mday,
+	    &tm.tm_mon, &tm.tm_year, &tm.tm_hour, &tm.tm_min, &tm.tm_sec,
+	    &n) == 6) {
+		if (buf[n] != '\0')
+			return NBU_COLUMN_NO_TIME;
+	} else
+		return NBU_COLUMN_NO_TIME;
+
+	if (tm.tm_mon < 1 || tm.tm_mon > 12 || tm.tm_mday < 1 ||
+	    tm.tm_mday > 31 || tm.tm_hour > 23 || tm.tm_min > 59 ||
+	    tm.tm_sec > 60)
+		return NBU_COLUMN_NO_TIME;
+
+	tm.tm_year -= 1900;
+	tm.tm_mon--;
+
+	if ((t = timegm(&tm)) == -1)
+		return NBU_COLUMN_NO_TIME;
+
+	return t;
 }
 
-static struct nbu_folder *
-nbu_read_mms_folder(struct nbu_ctx *ctx, uint64_t folder_pos)
+/*
+ * Parse the envelope of a vMessage. The time is taken from X-NOK-DT, or else
+ * from the Date line at the start of the body. The number is the first TEL
+ * property. The text is the rest of the body, with LF line endings.
+ */
+static void
+nbu_parse_message(struct nbu_vconv *v, struct nbu_message_row *row,
+    const uint8_t *s, size_t len)
 {
-	struct nbu_folder *folder;
-	uint16_t *utf16;
-	long pos;
-	uint32_t i, len, nitems;
-	uint8_t j, n;
+	struct nbu_vprop prop;
+	struct nbu_index *text;
+	const uint8_t *end, *eol, *line;
+	size_t i, linelen, nlines;
+	int body, first;
+
+	row->time = NBU_COLUMN_NO_TIME;
+	for (i = 0; i < NBU_MESSAGE_NCOLUMNS; i++)
+		row->fields[i].len = 0;
+
+	text = &row->fields[NBU_MESSAGE_TEXT];
+	end = s + len;
+	body = first = 0;
+	nlines = 0;
+
+	for (line = s; line < end; line = eol + (eol < end)) {
+		if ((eol = memchr(line, '\n', end - line)) == NULL)
+			eol = end;
+		linelen = eol - line;
+		if (linelen > 0 && line[linelen - 1] == '\r')
+			linelen--;
+
+		if (body) {
+			if (nbu_vconv_equal(line, linelen, "END:VBODY")) {
+				body = 0;
+				continue;
+			}
+			if (first && linelen > 5 &&
+			    strncasecmp((const char *)line, "Date:", 5) == 0) {
+				if (row->time == NBU_COLUMN_NO_TIME)
+					row->time = nbu_parse_message_time(
+					    line + 5, linelen - 5);
+			} else {
+				if (nlines++ > 0)
+					nbu_index_put(text, "\n", 1);
+				nbu_index_put(text, line, linelen);
+			}
+			first = 0;
+			continue;
+		}
 
-	if ((folder = nbu_new_folder()) == NULL)
-		goto error;
+		if (nbu_vconv_parse_line(line, linelen, &prop) == -1)
+			continue;
 
-	if (nbu_seek(ctx, folder_pos + 4, SEEK_SET) == -1)
-		goto error;
+		if (nbu_vconv_equal(prop.name, prop.namelen, "BEGIN")) {
+			if (nbu_vconv_equal(prop.value, prop.valuelen,
+			    "VBODY"))
+				body = first = 1;
+			continue;
+		}
 
-	if ((folder->name = nbu_read_utf16(ctx)) == NULL)
-		goto error;
+		if (nbu_vconv_equal(prop.name, prop.namelen, "X-NOK-DT")) {
+			row->time = nbu_parse_message_time(prop.value,
+			    prop.valuelen);
+			continue;
+		}
 
-	if (nbu_read_uint32(ctx, &nitems) == -1)
-		goto error;
+		if (nbu_vconv_equal(prop.name, prop.namelen, "X-IRMC-STATUS"))
+			i = NBU_MESSAGE_STATUS;
+		else if (nbu_vconv_equal(prop.name, prop.namelen,
+		    "X-IRMC-BOX"))
+			i = NBU_MESSAGE_BOX;
+		else if (nbu_vconv_equal(prop.name, prop.namelen, "TEL") &&
+		    row->fields[NBU_MESSAGE_NUMBER].len == 0)
+			i = NBU_MESSAGE_NUMBER;
+		else
+			continue;
 
-#ifdef NBU_DEBUG
-	uint8_t *utf8;
+		nbu_vconv_decode(v, &prop);
+		row->fields[i].len = 0;
+		nbu_index_put(&row->fields[i], v->value.data, v->value.len);
+	}
+}
 
-	if ((utf8 = nbu_convert_utf16_to_utf8(folder->name)) == NULL)
-		goto error;
+/* Convert a list of vMessage items to a columnar table in a new buffer */
+static int
+nbu_convert_columns(struct nbu_ctx *ctx, struct nbu_stats *st,
+    const struct nbu_item_list *list, struct nbu_index *out)
+{
+	struct nbu_column cols[NBU_MESSAGE_NCOLUMNS];
+	struct nbu_message_row row;
+	struct nbu_vconv v;
+	const uint8_t *data;
+	uint8_t *buf, name[NBU_COLUMN_NAME_LEN];
+	size_t bufsize, i, len, n;
+	uint64_t offset, t;
+	int ret;
 
-	NBU_DPRINTF("folder \"%s\", %" PRIu32 " messages\n", utf8, nitems);
-	free(utf8);
-#endif
+	nbu_column_init(&cols[NBU_MESSAGE_TIME], "time", NBU_COLUMN_INT64);
+	nbu_column_init(&cols[NBU_MESSAGE_STATUS], "status", NBU_COLUMN_DICT);
+	nbu_column_init(&cols[NBU_MESSAGE_BOX], "box", NBU_COLUMN_DICT);
+	nbu_column_init(&cols[NBU_MESSAGE_NUMBER], "number",
+	    NBU_COLUMN_STRING);
+	nbu_column_init(&cols[NBU_MESSAGE_TEXT], "text", NBU_COLUMN_STRING);
+
+	memset(&row, 0, sizeof row);
+	memset(&v, 0, sizeof v);
+	buf = NULL;
+	bufsize = 0;
+	ret = 0;
+	t = ctx->timing ? nbu_now() : 0;
 
-	for (i = 0; i < nitems; i++) {
-		if (nbu_seek(ctx, 8, SEEK_CUR) == -1)
-			goto error;
+	for (i = list->first; i < list->first + list->nitems; i++) {
+		if (ctx->item_len[i] % 2 != 0) {
+			warnx("Invalid item size");
+			ret = -1;
+			break;
+		}
 
-		if (nbu_read_uint8(ctx, &n) == -1)
-			goto error;
+		if ((data = nbu_get_item_data(ctx, i)) == NULL) {
+			ret = -1;
+			break;
+		}
 
-		NBU_DPRINTF("unknown number: %" PRIu8 "\n", n);
+		st->bytes_read += ctx->item_len[i];
+
+		/* A code unit is converted to at most 3 UTF-8 bytes */
+		n = ctx->item_len[i] / 2;
+		if (3 * n > bufsize) {
+			free(buf);
+			bufsize = 3 * n;
+			if ((buf = malloc(bufsize)) == NULL) {
+				warn(NULL);
+				ret = -1;
+				break;
+			}
+		}
 
-		for (j = 0; j < n; j++) {
-			if (nbu_seek(ctx, 8, SEEK_CUR) == -1)
-				goto error;
+		len = utf16le_convert_to_utf8(buf, data, &n);
+		nbu_parse_message(&v, &row, buf, len);
+
+		nbu_index_put_uint64(&cols[NBU_MESSAGE_TIME].data, row.time);
+		nbu_column_add_dict(&cols[NBU_MESSAGE_STATUS],
+		    row.fields[NBU_MESSAGE_STATUS].data,
+		    row.fields[NBU_MESSAGE_STATUS].len);
+		nbu_column_add_dict(&cols[NBU_MESSAGE_BOX],
+		    row.fields[NBU_MESSAGE_BOX].data,
+		    row.fields[NBU_MESSAGE_BOX].len);
+		nbu_column_add_string(&cols[NBU_MESSAGE_NUMBER],
+		    row.fields[NBU_MESSAGE_NUMBER].data,
+		    row.fields[NBU_MESSAGE_NUMBER].len);
+		nbu_column_add_string(&cols[NBU_MESSAGE_TEXT],
+		    row.fields[NBU_MESSAGE_TEXT].data,
+		    row.fields[NBU_MESSAGE_TEXT].len);
+	}
 
-			if ((utf16 = nbu_read_utf16(ctx)) == NULL)
-				goto error;
+	if (ctx->timing)
+		st->transcode_time += nbu_now() - t;
+
+	if (ret == 0) {
+		nbu_index_put(out, NBU_COLUMNS_MAGIC, NBU_COLUMNS_MAGIC_LEN);
+		nbu_index_put_uint32(out, NBU_COLUMNS_VERSION);
+		nbu_index_put_uint32(out, NBU_MESSAGE_NCOLUMNS);
+		nbu_index_put_uint64(out, list->nitems);
+
+		offset = out->len + NBU_MESSAGE_NCOLUMNS * 40;
+		for (i = 0; i < NBU_MESSAGE_NCOLUMNS; i++) {
+			memset(name, 0, sizeof name);
+			memcpy(name, cols[i].name, strlen(cols[i].name));
+			nbu_index_put(out, name, sizeof name);
+			nbu_index_put_uint32(out, cols[i].type);
+			nbu_index_put_uint32(out, 0);
+			nbu_index_put_uint64(out, offset);
+			nbu_index_put_uint64(out, nbu_column_size(&cols[i]));
+			offset += (nbu_column_size(&cols[i]) + 7) / 8 * 8;
+		}
 
-#ifdef NBU_DEBUG
-			if ((utf8 = nbu_convert_utf16_to_utf8(utf16)) ==
-			    NULL) {
-				free(utf16);
-				goto error;
-			}
+		for (i = 0; i < NBU_MESSAGE_NCOLUMNS; i++)
+			nbu_column_put(out, &cols[i]);
+	}
 
-			NBU_DPRINTF("unknown string %" PRIu8 ": \"%s\"\n",
-			    j + 1, utf8);
-			free(utf8);
-#endif
+	for (i = 0; i < NBU_MESSAGE_NCOLUMNS; i++) {
+		if (nbu_column_error(&cols[i]) || row.fields[i].error)
+			ret = -1;
+		nbu_column_free(&cols[i]);
+		free(row.fields[i].data);
+	}
 
-			/* TODO */
+	if (out->error || v.raw.error || v.value.error)
+		ret = -1;
 
-			free(utf16);
-		}
+	free(v.raw.data);
+	free(v.value.data);
+	free(buf);
+	return ret;
+}
 
-		if (nbu_seek(ctx, 20, SEEK_CUR) == -1)
-			goto error;
+/*
+ * Write a file from a buffer as a member of the tar stream. The writer is
+ * flushed, so that the buffer can be freed afterwards.
+ */
+static int
+nbu_tar_add_file(struct nbu_ctx *ctx, struct nbu_stats *st, const char *path,
+    const uint8_t *buf, size_t len)
+{
+	int ret;
 
-		if (nbu_read_uint32(ctx, &len) == -1)
-			goto error;
+	ctx->tar->st = st;
+	ret = -1;
 
-		if (nbu_tell(ctx, &pos) == -1)
-			goto error;
+	if (nbu_tar_add_header(ctx, path, '0', len) == -1)
+		goto out;
 
-		if (nbu_add_item(folder->items, pos, len) == -1)
-			goto error;
+	if (nbu_writer_add(ctx->tar, buf, len) == -1)
+		goto out;
 
-		if (nbu_seek(ctx, len, SEEK_CUR) == -1)
-			goto error;
+	if (len % NBU_TAR_BLOCK_SIZE != 0 && nbu_writer_add(ctx->tar,
+	    nbu_tar_zero, NBU_TAR_BLOCK_SIZE - len % NBU_TAR_BLOCK_SIZE) == -1)
+		goto out;
+
+	if (nbu_writer_flush(ctx->tar) == -1)
+		goto out;
+
+	st->files++;
+	ret = 0;
+
+out:
+	ctx->tar->st = &ctx->stats;
+	return ret;
+}
+
+static int
+nbu_export_table(struct nbu_ctx *ctx, struct nbu_stats *st,
+    const struct nbu_item_list *list, enum nbu_item_type type, int dfd,
+    const char *path, int flags)
+{
+	struct nbu_index out;
+	int fd, ret;
+
+	memset(&out, 0, sizeof out);
+
+	if (type == NBU_ITEM_MESSAGES)
+		ret = nbu_convert_columns(ctx, st, list, &out);
+	else
+		ret = nbu_convert_table(ctx, st, list, type,
+		    !(flags & O_APPEND), &out);
+
+	if (ret == -1) {
+		free(out.data);
+		return -1;
 	}
 
-	return folder;
+	if (ctx->tar != NULL) {
+		ret = nbu_tar_add_file(ctx, st, path, out.data, out.len);
+		free(out.data);
+		return ret;
+	}
 
-error:
-	nbu_free_folder(folder);
-	return NULL;
+	st->syscalls++;
+	if ((fd = openat(dfd, path, O_WRONLY | flags, 0666)) == -1) {
+		warn("openat: %s", path);
+		free(out.data);
+		return -1;
+	}
+
+	ret = nbu_write_file(ctx, st, fd, out.data, out.len);
+
+	st->syscalls++;
+	st->files++;
+	close(fd);
+	free(out.data);
+	return ret;
+}
+
+/*
+ * An MMS is stored as an m-retrieve-conf PDU: WSP-encoded headers, the last
+ * of which is the content type, followed by the body. A multipart body is a
+ * number of parts, each with a length of its headers and of its data. The
+ * parts are exported from the mapping as they are, without copying.
+ */
+#define NBU_MMS_MESSAGE_TYPE	0x0c	/* X-Mms-Message-Type */
+#define NBU_MMS_CONTENT_TYPE	0x04	/* Content-Type */
+
+/* WSP header fields of parts */
+#define NBU_WSP_CONTENT_LOCATION	0x0e
+#define NBU_WSP_CONTENT_DISPOSITION	0x2e
+
+/* WSP parameters that hold a file name */
+#define NBU_WSP_PARAM_NAME		0x05
+#define NBU_WSP_PARAM_FILENAME		0x06
+#define NBU_WSP_PARAM_NAME_1_4		0x17
+#define NBU_WSP_PARAM_FILENAME_1_4	0x18
+
+#define NBU_MMS_NAME_MAX	128
+#define NBU_MMS_TYPE_MAX	128
+
+/* Exported next to the parts; the name is not given to a part */
+#define NBU_MMS_STRINGS_FILE	"strings.txt"
+
+struct nbu_wsp {
+	const uint8_t	*p;
+	const uint8_t	*end;
+};
+
+struct nbu_mms_part {
+	const uint8_t	*data;
+	size_t		 len;
+	char		 type[NBU_MMS_TYPE_MAX];
+	char		 name[NBU_MMS_NAME_MAX];
+};
+
+/* Well-known content types, from the WAP assigned numbers */
+static const struct {
+	uint8_t		 code;
+	const char	*type;
+} nbu_wsp_content_types[] = {
+	{ 0x03, "text/plain" },
+	{ 0x06, "text/x-vcalendar" },
+	{ 0x07, "text/x-vcard" },
+	{ 0x0c, "multipart/mixed" },
+	{ 0x0f, "multipart/alternative" },
+	{ 0x1d, "image/gif" },
+	{ 0x1e, "image/jpeg" },
+	{ 0x20, "image/png" },
+	{ 0x21, "image/vnd.wap.wbmp" },
+	{ 0x23, "application/vnd.wap.multipart.mixed" },
+	{ 0x26, "application/vnd.wap.multipart.alternative" },
+	{ 0x33, "application/vnd.wap.multipart.related" },
+};
+
+/* File name extensions of parts without a name */
+static const struct {
+	const char	*type;
+	const char	*ext;
+} nbu_mms_extensions[] = {
+	{ "application/smil",	"smil" },
+	{ "audio/amr",		"amr" },
+	{ "audio/midi",		"mid" },
+	{ "audio/mid",		"mid" },
+	{ "audio/mpeg",		"mp3" },
+	{ "audio/mp4",		"m4a" },
+	{ "audio/wav",		"wav" },
+	{ "audio/x-wav",	"wav" },
+	{ "image/bmp",		"bmp" },
+	{ "image/gif",		"gif" },
+	{ "image/jpeg",		"jpg" },
+	{ "image/jpg",		"jpg" },
+	{ "image/png",		"png" },
+	{ "image/vnd.wap.wbmp",	"wbmp" },
+	{ "text/plain",		"txt" },
+	{ "text/x-vcalendar",	"vcs" },
+	{ "text/x-vcard",	"vcf" },
+	{ "video/3gpp",		"3gp" },
+	{ "video/mp4",		"mp4" },
+};
+
+static int
+nbu_wsp_uintvar(struct nbu_wsp *w, uint64_t *v)
+{
+	int i;
+
+	*v = 0;
+	for (i = 0; i < 5 && w->p < w->end; i++) {
+		*v = *v << 7 | (*w->p & 0x7f);
+		if ((*w->p++ & 0x80) == 0)
+			return 0;
+	}
+
+	return -1;
 }
 
+/* Read a value length: a byte up to 30, or 31 followed by a uintvar */
 static int
-nbu_read_advanced_settings_section(struct nbu_ctx *ctx,
-    __unused uint64_t section_pos)
+nbu_wsp_value_length(struct nbu_wsp *w, size_t *len)
 {
-	long pos;
-	uint64_t folder_pos;
-	uint32_t i, n, nfolders;
+	uint64_t v;
 
-	NBU_DPRINTF("reading section\n");
+	if (w->p == w->end || *w->p > 31)
+		return -1;
+
+	if (*w->p++ < 31)
+		v = w->p[-1];
+	else if (nbu_wsp_uintvar(w, &v) == -1)
+		return -1;
 
-	if (nbu_read_uint32(ctx, &n) == -1)
+	if (v > (uint64_t)(w->end - w->p))
 		return -1;
 
-	/* XXX Probably total number of items */
-	NBU_DPRINTF("unknown number: %" PRIu32 "\n", n);
+	*len = v;
+	return 0;
+}
+
+/* Read a NUL-terminated text string, without the quote that may start it */
+static const char *
+nbu_wsp_text(struct nbu_wsp *w)
+{
+	const uint8_t *nul, *s;
+
+	if (w->p == w->end || (nul = memchr(w->p, '\0', w->end - w->p)) ==
+	    NULL)
+		return NULL;
+
+	s = w->p;
+	if (*s == 0x7f || *s == '"')
+		s++;
+
+	w->p = nul + 1;
+	return (const char *)s;
+}
+
+/*
+ * Skip a value. In WSP, the first byte of a value says how long it is: a
+ * short integer, a value length or a text string.
+ */
+static int
+nbu_wsp_skip_value(struct nbu_wsp *w)
+{
+	size_t len;
 
-	if (nbu_read_uint32(ctx, &nfolders) == -1)
+	if (w->p == w->end)
 		return -1;
 
-	NBU_DPRINTF("%" PRIu32 " folders\n", nfolders);
+	if (*w->p >= 0x80) {
+		w->p++;
+		return 0;
+	}
 
-	for (i = 0; i < nfolders; i++) {
-		if (nbu_seek(ctx, 4, SEEK_CUR) == -1)
+	if (*w->p <= 31) {
+		if (nbu_wsp_value_length(w, &len) == -1)
 			return -1;
+		w->p += len;
+		return 0;
+	}
+
+	return (nbu_wsp_text(w) != NULL) ? 0 : -1;
+}
+
+/* Copy a string, or leave the buffer empty if the string is too long */
+static void
+nbu_mms_set_string(char *buf, size_t size, const char *s)
+{
+	if ((size_t)snprintf(buf, size, "%s", s) >= size)
+		buf[0] = '\0';
+}
+
+/* Read parameters and keep the file name, if any */
+static int
+nbu_wsp_params(struct nbu_wsp *w, char *name)
+{
+	const char *s, *token;
+	uint8_t param;
+
+	while (w->p < w->end) {
+		token = NULL;
+		param = 0;
 
-		if (nbu_read_uint64(ctx, &folder_pos) == -1)
+		if (*w->p >= 0x80)
+			param = *w->p++ & 0x7f;
+		else if ((token = nbu_wsp_text(w)) == NULL)
 			return -1;
 
-		if (nbu_tell(ctx, &pos) == -1)
+		if ((param == NBU_WSP_PARAM_NAME ||
+		    param == NBU_WSP_PARAM_FILENAME ||
+		    param == NBU_WSP_PARAM_NAME_1_4 ||
+		    param == NBU_WSP_PARAM_FILENAME_1_4 ||
+		    (token != NULL && (strcasecmp(token, "name") == 0 ||
+		    strcasecmp(token, "filename") == 0))) &&
+		    w->p < w->end && *w->p >= 0x20 && *w->p < 0x80) {
+			if ((s = nbu_wsp_text(w)) == NULL)
+				return -1;
+			nbu_mms_set_string(name, NBU_MMS_NAME_MAX, s);
+		} else if (nbu_wsp_skip_value(w) == -1)
 			return -1;
+	}
 
-		/* TODO */
+	return 0;
+}
 
-		if (nbu_seek(ctx, pos, SEEK_SET) == -1)
+/*
+ * Read a content type: a well-known type, a text string, or a value length
+ * followed by either of them and parameters.
+ */
+static int
+nbu_wsp_content_type(struct nbu_wsp *w, char *type, char *name)
+{
+	struct nbu_wsp params;
+	const char *s;
+	size_t i, len;
+	uint8_t code;
+
+	type[0] = '\0';
+	params.p = params.end = NULL;
+
+	if (w->p < w->end && *w->p <= 31) {
+		if (nbu_wsp_value_length(w, &len) == -1)
+			return -1;
+		params.end = w->p + len;
+	}
+
+	if (w->p == w->end)
+		return -1;
+
+	if (*w->p >= 0x80) {
+		code = *w->p++ & 0x7f;
+		for (i = 0; i < nitems(nbu_wsp_content_types); i++)
+			if (nbu_wsp_content_types[i].code == code) {
+				nbu_mms_set_string(type, NBU_MMS_TYPE_MAX,
+				    nbu_wsp_content_types[i].type);
+				break;
+			}
+	} else if (*w->p >= 0x20) {
+		if ((s = nbu_wsp_text(w)) == NULL)
+			return -1;
+		nbu_mms_set_string(type, NBU_MMS_TYPE_MAX, s);
+	} else if (params.end == NULL || nbu_wsp_skip_value(w) == -1)
+		/* A long integer is only allowed in the general form */
+		return -1;
+
+	if (params.end != NULL) {
+		if (w->p > params.end)
+			return -1;
+		params.p = w->p;
+		if (nbu_wsp_params(&params, name) == -1)
+			return -1;
+		w->p = params.end;
+	}
+
+	return 0;
+}
+
+/* Read the headers of a part and keep its file name */
+static int
+nbu_wsp_part_headers(struct nbu_wsp *w, char *name)
+{
+	struct nbu_wsp disp;
+	const char *field, *s;
+	size_t len;
+	uint8_t code;
+
+	while (w->p < w->end) {
+		if (*w->p >= 0x80) {
+			code = *w->p++ & 0x7f;
+			field = NULL;
+		} else if ((field = nbu_wsp_text(w)) == NULL)
+			return -1;
+		else
+			code = 0;
+
+		if (code == NBU_WSP_CONTENT_DISPOSITION && w->p < w->end &&
+		    *w->p <= 31) {
+			/* The disposition is followed by parameters */
+			if (nbu_wsp_value_length(w, &len) == -1)
+				return -1;
+			disp.p = w->p;
+			disp.end = w->p + len;
+			w->p += len;
+			if (nbu_wsp_skip_value(&disp) == 0 && name[0] == '\0')
+				nbu_wsp_params(&disp, name);
+		} else if ((code == NBU_WSP_CONTENT_LOCATION ||
+		    (field != NULL && strcasecmp(field, "Content-Location") ==
+		    0)) && w->p < w->end && *w->p >= 0x20 && *w->p < 0x80) {
+			if ((s = nbu_wsp_text(w)) == NULL)
+				return -1;
+			/* The location takes precedence over other names */
+			nbu_mms_set_string(name, NBU_MMS_NAME_MAX, s);
+			return 0;
+		} else if (nbu_wsp_skip_value(w) == -1)
 			return -1;
 	}
 
 	return 0;
 }
 
+/* Check if one of the first n parts has the specified name */
+static int
+nbu_mms_name_used(const struct nbu_mms_part *parts, size_t n,
+    const char *name)
+{
+	size_t i;
+
+	if (strcmp(name, NBU_MMS_STRINGS_FILE) == 0)
+		return 1;
+
+	for (i = 0; i < n; i++)
+		if (strcmp(parts[i].name, name) == 0)
+			return 1;
+
+	return 0;
+}
+
+/*
+ * Make the name of a part safe to use as a file name. Parts without a usable
+ * name, or with the name of an earlier part, are named after their number and
+ * type. If an earlier part has that name too, another number is appended.
+ */
+static void
+nbu_mms_name_part(struct nbu_mms_part *parts, size_t n)
+{
+	struct nbu_mms_part *part;
+	const char *ext;
+	size_t i, m;
+	char *s;
+
+	part = &parts[n];
+
+	for (s = part->name; *s != '\0'; s++)
+		if (*s == '/' || *s == '\\' || (unsigned char)*s < 0x20 ||
+		    *s == 0x7f)
+			*s = '_';
+
+	/* Do not create hidden files */
+	if (part->name[0] == '.')
+		part->name[0] = '_';
+
+	if (part->name[0] != '\0' && !nbu_mms_name_used(parts, n, part->name))
+		return;
+
+	ext = "bin";
+	for (i = 0; i < nitems(nbu_mms_extensions); i++)
+		if (strcasecmp(part->type, nbu_mms_extensions[i].type) == 0) {
+			ext = nbu_mms_extensions[i].ext;
+			break;
+		}
+
+	snprintf(part->name, sizeof part->name, "part-%zu.%s", n + 1, ext);
+
+	for (m = 2; nbu_mms_name_used(parts, n, part->name); m++)
+		snprintf(part->name, sizeof part->name, "part-%zu-%zu.%s", n + 1,
+		    m, ext);
+}
+
+static int
+nbu_mms_add_part(struct nbu_mms_part **parts, size_t *nparts)
+{
+	struct nbu_mms_part *newparts;
+
+	newparts = reallocarray(*parts, *nparts + 1, sizeof **parts);
+	if (newparts == NULL) {
+		warn(NULL);
+		return -1;
+	}
+
+	*parts = newparts;
+	memset(&newparts[*nparts], 0, sizeof **parts);
+	(*nparts)++;
+	return 0;
+}
+
+/*
+ * Split an MMS into its parts. The parts point into the data. Return -1 if
+ * the data is not an MMS or is malformed.
+ */
 static int
-nbu_read_bookmarks_section(struct nbu_ctx *ctx, __unused uint64_t section_pos)
+nbu_mms_split(const uint8_t *data, size_t len, struct nbu_mms_part **partsp,
+    size_t *npartsp)
+{
+	struct nbu_mms_part *parts, *part;
+	struct nbu_wsp w, hdr;
+	char name[NBU_MMS_NAME_MAX], type[NBU_MMS_TYPE_MAX];
+	uint64_t dlen, hlen, i, nentries;
+	size_t nparts;
+	uint8_t code;
+
+	w.p = data;
+	w.end = data + len;
+	parts = NULL;
+	nparts = 0;
+	name[0] = '\0';
+
+	/* The PDU must start with the message type */
+	if (len < 2 || data[0] != (0x80 | NBU_MMS_MESSAGE_TYPE))
+		return -1;
+
+	for (;;) {
+		if (w.p == w.end)
+			return -1;
+
+		if (*w.p >= 0x80) {
+			code = *w.p++ & 0x7f;
+			if (code == NBU_MMS_CONTENT_TYPE)
+				break;
+		} else if (nbu_wsp_text(&w) == NULL)
+			return -1;
+
+		if (nbu_wsp_skip_value(&w) == -1)
+			return -1;
+	}
+
+	if (nbu_wsp_content_type(&w, type, name) == -1)
+		return -1;
+
+	if (strncasecmp(type, "application/vnd.wap.multipart.", 30) != 0 &&
+	    strncasecmp(type, "multipart/", 10) != 0) {
+		/* The body is a single part */
+		if (nbu_mms_add_part(&parts, &nparts) == -1)
+			return -1;
+		part = &parts[0];
+		part->data = w.p;
+		part->len = w.end - w.p;
+		nbu_mms_set_string(part->type, sizeof part->type, type);
+		nbu_mms_set_string(part->name, sizeof part->name, name);
+		nbu_mms_name_part(parts, 0);
+		goto out;
+	}
+
+	if (nbu_wsp_uintvar(&w, &nentries) == -1)
+		return -1;
+
+	for (i = 0; i < nentries; i++) {
+		if (nbu_wsp_uintvar(&w, &hlen) == -1 ||
+		    nbu_wsp_uintvar(&w, &dlen) == -1 ||
+		    hlen > (uint64_t)(w.end - w.p) ||
+		    dlen > (uint64_t)(w.end - w.p) - hlen)
+			goto bad;
+
+		if (nbu_mms_add_part(&parts, &nparts) == -1)
+			goto bad;
+		part = &parts[nparts - 1];
+
+		hdr.p = w.p;
+		hdr.end = w.p + hlen;
+		if (nbu_wsp_content_type(&hdr, part->type, part->name) == -1 ||
+		    nbu_wsp_part_headers(&hdr, part->name) == -1)
+			goto bad;
+
+		part->data = w.p + hlen;
+		part->len = dlen;
+		nbu_mms_name_part(parts, nparts - 1);
+		w.p += hlen + dlen;
+	}
+
+out:
+	*partsp = parts;
+	*npartsp = nparts;
+	return 0;
+
+bad:
+	free(parts);
+	return -1;
+}
+
+/*
+ * Convert the strings that precede an MMS in the backup to UTF-8, one per
+ * line. Each string follows 8 unknown bytes.
+ */
+static int
+nbu_convert_mms_strings(struct nbu_ctx *ctx, size_t item,
+    struct nbu_index *out)
+{
+	const uint8_t *end, *p;
+	uint8_t *buf;
+	size_t len, n;
+	long pos;
+
+	pos = ctx->item_pos[item] - (long)nbu_mms_data_layout.size -
+	    (long)ctx->item_strings[item];
+	if (pos < 0) {
+		warnx("Unexpected end of file");
+		return -1;
+	}
+
+	p = ctx->map + pos;
+	end = p + ctx->item_strings[item];
+
+	/* A code unit is converted to at most 3 UTF-8 bytes */
+	if ((buf = malloc(3 * (ctx->item_strings[item] / 2))) == NULL) {
+		warn(NULL);
+		return -1;
+	}
+
+	while (end - p >= 10) {
+		n = p[8] | p[9] << 8;
+		p += 10;
+		if (n > (size_t)(end - p) / 2)
+			break;
+
+		len = n;
+		nbu_index_put(out, buf, utf16le_convert_to_utf8(buf, p, &len));
+		nbu_index_put(out, "\n", 1);
+		p += 2 * n;
+	}
+
+	free(buf);
+
+	if (p != end) {
+		warnx("MMS strings damaged");
+		return -1;
+	}
+
+	return out->error ? -1 : 0;
+}
+
+/* Write a file of a split MMS, in the directory of the MMS */
+static int
+nbu_export_mms_file(struct nbu_ctx *ctx, struct nbu_stats *st, int dfd,
+    const char *path, const char *name, const uint8_t *buf, size_t len,
+    int flags)
+{
+	char *file;
+	int fd, ret;
+
+	if (asprintf(&file, "%s/%s%s", path, name, nbu_file_suffix(ctx)) ==
+	    -1) {
+		warnx("asprintf() failed");
+		return -1;
+	}
+
+	if (ctx->tar != NULL) {
+		ret = nbu_tar_add_file(ctx, st, file, buf, len);
+		free(file);
+		return ret;
+	}
+
+	st->syscalls++;
+	if ((fd = openat(dfd, file, O_WRONLY | flags, 0666)) == -1) {
+		warn("openat: %s", file);
+		free(file);
+		return -1;
+	}
+
+	ret = nbu_write_file(ctx, st, fd, buf, len);
+
+	st->syscalls++;
+	st->files++;
+	close(fd);
+	free(file);
+	return ret;
+}
+
+/*
+ * Export the parts of an MMS to files in a directory. If the MMS cannot be
+ * split, it is exported to a single file, as without splitting.
+ */
+static int
+nbu_export_mms_parts(struct nbu_ctx *ctx, struct nbu_stats *st,
+    const struct nbu_item_list *list, int dfd, const char *path, int flags)
+{
+	struct nbu_index strings;
+	struct nbu_mms_part *parts;
+	const uint8_t *data;
+	char *file;
+	size_t i, nparts;
+	int ret;
+
+	if ((data = nbu_get_item_data(ctx, list->first)) == NULL)
+		return -1;
+
+	if (nbu_mms_split(data, ctx->item_len[list->first], &parts,
+	    &nparts) == -1) {
+		NBU_DPRINTF("%s: cannot split MMS\n", path);
+		if (asprintf(&file, "%s.mms%s", path, nbu_file_suffix(ctx)) ==
+		    -1) {
+			warnx("asprintf() failed");
+			return -1;
+		}
+		ret = nbu_export_item_list(ctx, st, list, NBU_ITEM_RAW, dfd,
+		    file, flags);
+		free(file);
+		return ret;
+	}
+
+	st->bytes_read += ctx->item_len[list->first];
+
+	if (ctx->tar != NULL) {
+		if (asprintf(&file, "%s/", path) == -1) {
+			warnx("asprintf() failed");
+			free(parts);
+			return -1;
+		}
+		ctx->tar->st = st;
+		ret = nbu_tar_add_header(ctx, file, '5', 0);
+		ctx->tar->st = &ctx->stats;
+		free(file);
+	} else {
+		st->syscalls++;
+		ret = 0;
+		if (mkdirat(dfd, path, 0777) == -1 && errno != EEXIST) {
+			warn("mkdirat: %s", path);
+			ret = -1;
+		}
+	}
+
+	for (i = 0; i < nparts && ret == 0; i++)
+		ret = nbu_export_mms_file(ctx, st, dfd, path, parts[i].name,
+		    parts[i].data, parts[i].len, flags);
+
+	free(parts);
+
+	if (ret == -1 || ctx->item_strings[list->first] == 0)
+		return ret;
+
+	memset(&strings, 0, sizeof strings);
+	st->bytes_read += ctx->item_strings[list->first];
+
+	if ((ret = nbu_convert_mms_strings(ctx, list->first, &strings)) == 0)
+		ret = nbu_export_mms_file(ctx, st, dfd, path,
+		    NBU_MMS_STRINGS_FILE, strings.data, strings.len, flags);
+
+	free(strings.data);
+	return ret;
+}
+
+/*
+ * Export a list of items to a file. The flags are passed to openat(); they
+ * say whether the file must be new, is overwritten or is appended to.
+ */
+static int
+nbu_export_item_list(struct nbu_ctx *ctx, struct nbu_stats *st,
+    const struct nbu_item_list *list, enum nbu_item_type type, int dfd,
+    const char *path, int flags)
+{
+	struct nbu_writer *w;
+	struct nbu_gzip gz;
+	size_t bufsize, i, len;
+	int fd, ret;
+
+	if (type == NBU_ITEM_CONTACTS || type == NBU_ITEM_CALENDAR ||
+	    type == NBU_ITEM_MESSAGES)
+		return nbu_export_table(ctx, st, list, type, dfd, path, flags);
+
+	if (type == NBU_ITEM_MMS_PARTS)
+		return nbu_export_mms_parts(ctx, st, list, dfd, path, flags);
+
+	if (ctx->tar != NULL)
+		return nbu_tar_export_item_list(ctx, st, list, type, path);
+
+	/*
+	 * Only converted data needs the buffer. Do not make the buffer
+	 * larger than the converted data can be.
+	 */
+	bufsize = 0;
+	if (type == NBU_ITEM_UTF16) {
+		len = 0;
+		for (i = list->first; i < list->first + list->nitems; i++) {
+			len += ctx->item_len[i] / 2;
+			if (len >= NBU_WRITER_BUF_SIZE / 3)
+				break;
+		}
+		bufsize = (len < NBU_WRITER_BUF_SIZE / 3) ? 3 * len :
+		    NBU_WRITER_BUF_SIZE;
+	}
+
+	if ((w = malloc(sizeof *w)) == NULL) {
+		warn(NULL);
+		return -1;
+	}
+
+	st->syscalls++;
+	fd = openat(dfd, path, O_WRONLY | flags, 0666);
+	if (fd == -1) {
+		warn("openat: %s", path);
+		free(w);
+		return -1;
+	}
+
+	if (nbu_writer_init(w, ctx, st, fd, bufsize) == -1) {
+		close(fd);
+		free(w);
+		return -1;
+	}
+
+	if (ctx->compress) {
+		if (nbu_gzip_init(&gz, ctx, st, fd, NULL) == -1) {
+			nbu_writer_free(w);
+			close(fd);
+			free(w);
+			return -1;
+		}
+		w->gz = &gz;
+	}
+
+	ret = nbu_write_items(w, list, type);
+
+	if (ret == 0)
+		ret = nbu_writer_flush(w);
+
+	if (w->gz != NULL) {
+		if (ret == 0)
+			ret = nbu_gzip_write(w->gz, NULL, 0, 1);
+		nbu_gzip_free(w->gz);
+	}
+
+	nbu_writer_free(w);
+	free(w);
+	st->syscalls++;
+	st->files++;
+	close(fd);
+	return ret;
+}
+
+/* Check if a file in the store has the given contents */
+static int
+nbu_store_matches(struct nbu_stats *st, int fd, const uint8_t *data,
+    size_t len)
+{
+	struct stat sb;
+	void *map;
+	int ret;
+
+	st->syscalls++;
+	if (fstat(fd, &sb) == -1 || (uintmax_t)sb.st_size != len)
+		return 0;
+
+	st->syscalls += 2;
+	map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		return 0;
+
+	ret = (memcmp(map, data, len) == 0);
+	munmap(map, len);
+	return ret;
+}
+
+/*
+ * Export a single item by linking the file to an identical file in the
+ * store. Files in the store are named after the hash and size of their
+ * contents. The contents are compared as well, so a hash collision only
+ * costs a copy. If the store does not have the item yet, it is exported as
+ * usual and then added to the store.
+ */
+static int
+nbu_export_stored_item(struct nbu_job *job, struct nbu_stats *st, int flags)
+{
+	struct nbu_ctx *ctx;
+	const uint8_t *data;
+	size_t item;
+	uint32_t len;
+	int fd, match;
+	char name[32];
+
+	ctx = job->ctx;
+	item = job->items.first;
+
+	if ((data = nbu_get_item_data(ctx, item)) == NULL)
+		return -1;
+
+	len = ctx->item_len[item];
+	snprintf(name, sizeof name, "%016" PRIx64 "-%" PRIu32,
+	    nbu_hash(data, len), len);
+
+	st->syscalls++;
+	if ((fd = openat(ctx->store_dfd, name, O_RDONLY)) != -1) {
+		match = nbu_store_matches(st, fd, data, len);
+		st->syscalls++;
+		close(fd);
+
+		if (match) {
+			st->syscalls++;
+			if (linkat(ctx->store_dfd, name, job->dfd, job->path,
+			    0) == 0) {
+				st->files_linked++;
+				st->bytes_linked += len;
+				return 0;
+			}
+
+			/* Otherwise the store may be on another file system */
+			if (errno == EEXIST) {
+				warn("linkat: %s", job->path);
+				return -1;
+			}
+			NBU_DPRINTF("cannot link %s: %s\n", job->path,
+			    strerror(errno));
+		}
+	}
+
+	if (nbu_export_item_list(ctx, st, &job->items, job->type, job->dfd,
+	    job->path, flags) == -1)
+		return -1;
+
+	/* Another job may have added the same contents already */
+	st->syscalls++;
+	if (linkat(job->dfd, job->path, ctx->store_dfd, name, 0) == -1 &&
+	    errno != EEXIST)
+		NBU_DPRINTF("cannot add %s to store: %s\n", job->path,
+		    strerror(errno));
+
+	return 0;
+}
+
+/* Export the items of a job, or some of them, to the file of the job */
+static int
+nbu_export_job_items(struct nbu_job *job, struct nbu_stats *st,
+    const struct nbu_item_list *list, int flags)
+{
+	struct nbu_ctx *ctx;
+
+	ctx = job->ctx;
+
+	/*
+	 * The file may be linked to the store, by this run or an earlier one.
+	 * Truncating it would change the store and every export linked to
+	 * it, so remove the file and create a new one.
+	 */
+	if ((flags & O_TRUNC) && job->type != NBU_ITEM_MMS_PARTS) {
+		st->syscalls++;
+		if (unlinkat(job->dfd, job->path, 0) == -1 && errno != ENOENT) {
+			warn("unlinkat: %s", job->path);
+			return -1;
+		}
+	}
+
+	/* The store only holds uncompressed files */
+	if (job->dedup && ctx->store_dfd != -1 && ctx->tar == NULL &&
+	    !ctx->compress && !(flags & O_APPEND) && list->nitems == 1 &&
+	    ctx->item_len[list->first] > 0)
+		return nbu_export_stored_item(job, st, flags);
+
+	return nbu_export_item_list(ctx, st, list, job->type, job->dfd,
+	    job->path, flags);
+}
+
+static int
+nbu_compare_manifest_entries(const void *a, const void *b)
+{
+	const struct nbu_manifest_entry *ea, *eb;
+
+	ea = a;
+	eb = b;
+	return strcmp(ea->path, eb->path);
+}
+
+static const struct nbu_manifest_entry *
+nbu_find_manifest_entry(struct nbu_ctx *ctx, const char *path)
+{
+	struct nbu_manifest_entry key;
+
+	if (ctx->nmanifest == 0)
+		return NULL;
+
+	key.path = (char *)path;
+	return bsearch(&key, ctx->manifest, ctx->nmanifest,
+	    sizeof *ctx->manifest, nbu_compare_manifest_entries);
+}
+
+/*
+ * Check if the parts of an MMS have been exported. They are in a directory,
+ * or, if the MMS could not be split, in a single file.
+ */
+static int
+nbu_mms_parts_exist(struct nbu_job *job, struct nbu_stats *st,
+    const struct nbu_manifest_entry *old)
+{
+	struct stat sb;
+	char *file;
+	int ret;
+
+	st->syscalls++;
+	if (fstatat(job->dfd, job->path, &sb, 0) == 0)
+		return S_ISDIR(sb.st_mode);
+
+	if (asprintf(&file, "%s.mms%s", job->path, nbu_file_suffix(job->ctx)) ==
+	    -1) {
+		warnx("asprintf() failed");
+		return 0;
+	}
+
+	st->syscalls++;
+	ret = fstatat(job->dfd, file, &sb, 0) == 0 && S_ISREG(sb.st_mode) &&
+	    (uint64_t)sb.st_size == old->size;
+	free(file);
+	return ret;
+}
+
+/*
+ * Export the items of a job incrementally. If the manifest shows that the
+ * file already contains the first items of the job, only the remaining items
+ * are appended. The file must still have the size recorded in the manifest.
+ */
+static int
+nbu_update_item_list(struct nbu_job *job, struct nbu_stats *st)
+{
+	struct nbu_ctx *ctx;
+	struct nbu_item_list rest;
+	struct stat sb;
+	const struct nbu_manifest_entry *old;
+	const uint8_t *data;
+	uint64_t hash, written;
+	size_t i, n;
+	int found, ret;
+
+	ctx = job->ctx;
+	old = nbu_find_manifest_entry(ctx, job->path);
+	hash = NBU_HASH_INIT;
+	found = 0;
+
+	for (n = 0; ; n++) {
+		if (old != NULL && n == old->nitems && hash == old->hash)
+			found = 1;
+		if (n == job->items.nitems)
+			break;
+
+		i = job->items.first + n;
+		if ((data = nbu_get_item_data(ctx, i)) == NULL)
+			return -1;
+		hash = nbu_hash_more(hash, data, ctx->item_len[i]);
+	}
+
+	/* A columnar table cannot be appended to */
+	if (found && job->type == NBU_ITEM_MESSAGES &&
+	    old->nitems != job->items.nitems)
+		found = 0;
+
+	if (found) {
+		if (job->type == NBU_ITEM_MMS_PARTS)
+			found = nbu_mms_parts_exist(job, st, old);
+		else {
+			st->syscalls++;
+			if (fstatat(job->dfd, job->path, &sb, 0) == -1 ||
+			    (uint64_t)sb.st_size != old->size)
+				found = 0;
+		}
+	}
+
+	job->entry.nitems = job->items.nitems;
+	job->entry.hash = hash;
+
+	if (found && old->nitems == job->items.nitems) {
+		NBU_DPRINTF("%s: up to date\n", job->path);
+		job->entry.size = old->size;
+		job->entry.valid = 1;
+		st->files_skipped++;
+		return 0;
+	}
+
+	written = st->bytes_written + st->bytes_linked;
+
+	if (found) {
+		NBU_DPRINTF("%s: appending %zu items\n", job->path,
+		    job->items.nitems - (size_t)old->nitems);
+		rest.first = job->items.first + old->nitems;
+		rest.nitems = job->items.nitems - old->nitems;
+		ret = nbu_export_job_items(job, st, &rest, O_APPEND);
+		job->entry.size = old->size;
+	} else {
+		ret = nbu_export_job_items(job, st, &job->items,
+		    O_CREAT | O_TRUNC);
+		job->entry.size = 0;
+	}
+
+	job->entry.size += st->bytes_written + st->bytes_linked - written;
+	job->entry.valid = (ret == 0);
+	return ret;
+}
+
+/*
+ * Compress a buffer to a gzip member. The buffer is replaced by the
+ * compressed data.
+ */
+static int
+nbu_gzip_buffer(struct nbu_ctx *ctx, struct nbu_stats *st, uint8_t **buf,
+    size_t *len)
+{
+	struct nbu_gzip gz;
+	struct nbu_index out;
+	int ret;
+
+	memset(&out, 0, sizeof out);
+
+	if (nbu_gzip_init(&gz, ctx, st, -1, &out) == -1)
+		return -1;
+
+	ret = nbu_gzip_write(&gz, *buf, *len, 1);
+	nbu_gzip_free(&gz);
+
+	if (ret == -1) {
+		free(out.data);
+		return -1;
+	}
+
+	free(*buf);
+	*buf = out.data;
+	*len = out.len;
+	return 0;
+}
+
+/*
+ * Convert a segment of a message folder and write it when it is its turn. If
+ * files are compressed, each segment is compressed to a gzip member of its
+ * own before waiting, so that segments are also compressed in parallel.
+ */
+static int
+nbu_export_segment(struct nbu_job *job, struct nbu_stats *st)
+{
+	struct nbu_segment_group *g;
+	uint8_t *buf;
+	size_t len;
+	uint64_t t;
+	int ret;
+
+	g = job->group;
+	buf = NULL;
+	len = 0;
+	ret = nbu_convert_items(job->ctx, st, &job->items, &buf, &len);
+
+	if (ret == 0 && job->ctx->compress)
+		ret = nbu_gzip_buffer(job->ctx, st, &buf, &len);
+
+	pthread_mutex_lock(&g->mtx);
+	while (g->next != job->segment)
+		pthread_cond_wait(&g->cond, &g->mtx);
+	pthread_mutex_unlock(&g->mtx);
+
+	/* Until the next segment is allowed to write, g is ours */
+	if (ret == -1)
+		g->failed = 1;
+
+	if (job->segment == 0 && !g->failed) {
+		st->syscalls++;
+		g->fd = openat(job->dfd, g->path, O_WRONLY | O_CREAT | O_EXCL,
+		    0666);
+		if (g->fd == -1) {
+			warn("openat: %s", g->path);
+			g->failed = 1;
+			ret = -1;
+		} else
+			st->files++;
+	}
+
+	if (!g->failed) {
+		t = job->ctx->timing ? nbu_now() : 0;
+		if (nbu_write(st, g->fd, buf, len) == -1) {
+			g->failed = 1;
+			ret = -1;
+		}
+		if (job->ctx->timing)
+			st->write_time += nbu_now() - t;
+	}
+
+	if (job->segment == g->nsegments - 1 && g->fd != -1) {
+		st->syscalls++;
+		close(g->fd);
+		g->fd = -1;
+	}
+
+	pthread_mutex_lock(&g->mtx);
+	g->next++;
+	pthread_cond_broadcast(&g->cond);
+	pthread_mutex_unlock(&g->mtx);
+
+	free(buf);
+	return ret;
+}
+
+static int
+nbu_run_job(void *arg)
+{
+	struct nbu_job *job;
+	struct nbu_stats st;
+	int ret;
+
+	job = arg;
+	memset(&st, 0, sizeof st);
+
+	if (job->group != NULL)
+		ret = nbu_export_segment(job, &st);
+	else if (job->ctx->incremental && job->ctx->tar == NULL)
+		ret = nbu_update_item_list(job, &st);
+	else
+		ret = nbu_export_job_items(job, &st, &job->items,
+		    O_CREAT | O_EXCL);
+
+	pthread_mutex_lock(&job->ctx->stats_mutex);
+	nbu_add_stats(&job->ctx->job_stats, &st);
+	pthread_mutex_unlock(&job->ctx->stats_mutex);
+
+	return ret;
+}
+
+/*
+ * Append the suffix of exported files to a path. The path is freed, also if
+ * the suffix cannot be appended.
+ */
+static char *
+nbu_add_file_suffix(struct nbu_ctx *ctx, char *path)
+{
+	char *newpath;
+
+	if (*nbu_file_suffix(ctx) == '\0')
+		return path;
+
+	if (asprintf(&newpath, "%s%s", path, nbu_file_suffix(ctx)) == -1) {
+		warnx("asprintf() failed");
+		newpath = NULL;
+	}
+
+	free(path);
+	return newpath;
+}
+
+/*
+ * Schedule the export of a list of items to a file. The job takes ownership
+ * of the path. If dedup is set, the file may be linked to the store.
+ */
+static int
+nbu_add_job(struct nbu_ctx *ctx, const struct nbu_item_list *items,
+    enum nbu_item_type type, int dedup, int dfd, char *path)
+{
+	struct nbu_job **newplan, *job;
+	size_t i, newsize, pos;
+
+	/* The parts of an MMS are in a directory that keeps its name */
+	if (path != NULL && type != NBU_ITEM_MMS_PARTS &&
+	    (path = nbu_add_file_suffix(ctx, path)) == NULL)
+		return -1;
+
+	if (ctx->nplanned == ctx->plan_size) {
+		newsize = (ctx->plan_size == 0) ? 64 : ctx->plan_size * 2;
+		newplan = reallocarray(ctx->plan, newsize, sizeof *newplan);
+		if (newplan == NULL) {
+			warn(NULL);
+			free(path);
+			return -1;
+		}
+		ctx->plan = newplan;
+		ctx->plan_size = newsize;
+	}
+
+	if ((job = malloc(sizeof *job)) == NULL) {
+		warn(NULL);
+		free(path);
+		return -1;
+	}
+
+	job->ctx = ctx;
+	job->items = *items;
+	job->type = type;
+	job->dedup = dedup;
+	job->dfd = dfd;
+	job->path = path;
+	job->start = ctx->size;
+	job->end = 0;
+	memset(&job->entry, 0, sizeof job->entry);
+	job->entry.path = path;
+	job->group = NULL;
+	job->segment = 0;
+
+	for (i = items->first; i < items->first + items->nitems; i++) {
+		if (ctx->item_pos[i] < 0)
+			continue;
+		pos = ctx->item_pos[i];
+		if (pos < job->start)
+			job->start = pos;
+		if (pos + ctx->item_len[i] > job->end)
+			job->end = pos + ctx->item_len[i];
+	}
+
+	ctx->plan[ctx->nplanned++] = job;
+	return 0;
+}
+
+static void
+nbu_free_segment_group(struct nbu_segment_group *g)
+{
+	pthread_cond_destroy(&g->cond);
+	pthread_mutex_destroy(&g->mtx);
+	free(g->path);
+	free(g);
+}
+
+/*
+ * Schedule the export of a message folder. A large folder is split into
+ * segments, so that it can be converted by several jobs at once. The output
+ * is the same.
+ */
+static int
+nbu_add_folder_job(struct nbu_ctx *ctx, const struct nbu_item_list *items,
+    int dfd, char *path)
+{
+	struct nbu_segment_group *g;
+	struct nbu_item_list seg;
+	struct nbu_job *job;
+	size_t end, i, size, start;
+	int error;
+
+	size = 0;
+	end = items->first + items->nitems;
+	for (i = items->first; i < end; i++)
+		size += ctx->item_len[i];
+
+	if (ctx->njobs <= 1 || ctx->tar != NULL || ctx->incremental ||
+	    size < 2 * NBU_SEGMENT_SIZE)
+		return nbu_add_job(ctx, items, NBU_ITEM_UTF16, 0, dfd, path);
+
+	if ((path = nbu_add_file_suffix(ctx, path)) == NULL)
+		return -1;
+
+	if ((g = calloc(1, sizeof *g)) == NULL) {
+		warn(NULL);
+		free(path);
+		return -1;
+	}
+
+	if ((error = pthread_mutex_init(&g->mtx, NULL)) != 0) {
+		warnc(error, "pthread_mutex_init");
+		free(g);
+		free(path);
+		return -1;
+	}
+
+	if ((error = pthread_cond_init(&g->cond, NULL)) != 0) {
+		warnc(error, "pthread_cond_init");
+		pthread_mutex_destroy(&g->mtx);
+		free(g);
+		free(path);
+		return -1;
+	}
+
+	g->fd = -1;
+	g->path = path;
+	start = 0;
+
+	for (i = items->first; i < end; g->nsegments++) {
+		seg.first = i;
+		for (size = 0; i < end && (size == 0 ||
+		    size + ctx->item_len[i] <= NBU_SEGMENT_SIZE); i++)
+			size += ctx->item_len[i];
+		seg.nitems = i - seg.first;
+
+		if (nbu_add_job(ctx, &seg, NBU_ITEM_UTF16, 0, dfd, NULL) ==
+		    -1) {
+			if (g->nsegments == 0)
+				nbu_free_segment_group(g);
+			return -1;
+		}
+
+		job = ctx->plan[ctx->nplanned - 1];
+		job->group = g;
+		job->segment = g->nsegments;
+
+		/* Do not let the plan start a segment before an earlier one */
+		if (job->start < start)
+			job->start = start;
+		start = job->start;
+	}
+
+	return 0;
+}
+
+static int
+nbu_compare_jobs(const void *a, const void *b)
+{
+	const struct nbu_job *ja, *jb;
+
+	ja = *(struct nbu_job * const *)a;
+	jb = *(struct nbu_job * const *)b;
+
+	if (ja->start < jb->start)
+		return -1;
+	if (ja->start > jb->start)
+		return 1;
+
+	/* Segments must be started in order; see nbu_export_segment() */
+	if (ja->group != NULL && ja->group == jb->group)
+		return (ja->segment < jb->segment) ? -1 : 1;
+	return 0;
+}
+
+static void
+nbu_advise(struct nbu_ctx *ctx, size_t start, size_t end, size_t pagesize)
+{
+	start -= start % pagesize;
+	if (end > ctx->size)
+		end = ctx->size;
+	if (end <= start)
+		return;
+
+	ctx->stats.syscalls += 2;
+	posix_madvise(ctx->map + start, end - start, POSIX_MADV_SEQUENTIAL);
+	posix_madvise(ctx->map + start, end - start, POSIX_MADV_WILLNEED);
+}
+
+/*
+ * Start the planned jobs in the order of their position in the backup, so
+ * that the backup is read from front to back. Before that, tell the kernel
+ * which parts of the backup are about to be read. The jobs remain in the plan
+ * until nbu_free_plan() is called.
+ */
+static void
+nbu_run_plan(struct nbu_ctx *ctx)
+{
+	struct nbu_job *job;
+	size_t end, i, pagesize, start;
+	long n;
+
+	qsort(ctx->plan, ctx->nplanned, sizeof *ctx->plan, nbu_compare_jobs);
+
+	pagesize = ((n = sysconf(_SC_PAGESIZE)) > 0) ? n : 4096;
+	start = end = 0;
+
+	for (i = 0; i < ctx->nplanned; i++) {
+		job = ctx->plan[i];
+		if (job->end <= job->start)
+			continue;
+
+		if (end == 0 || job->start > end + NBU_ADVICE_GAP) {
+			nbu_advise(ctx, start, end, pagesize);
+			start = job->start;
+		}
+		if (job->end > end)
+			end = job->end;
+	}
+
+	nbu_advise(ctx, start, end, pagesize);
+
+	for (i = 0; i < ctx->nplanned; i++)
+		pool_add(ctx->pool, nbu_run_job, ctx->plan[i]);
+}
+
+/* Free the plan after its jobs have finished */
+static void
+nbu_free_plan(struct nbu_ctx *ctx)
+{
+	size_t i;
+
+	for (i = 0; i < ctx->nplanned; i++) {
+		if (ctx->plan[i]->group != NULL && ctx->plan[i]->segment == 0)
+			nbu_free_segment_group(ctx->plan[i]->group);
+		free(ctx->plan[i]->path);
+		free(ctx->plan[i]);
+	}
+
+	free(ctx->plan);
+	ctx->plan = NULL;
+	ctx->nplanned = ctx->plan_size = 0;
+}
+
+static int
+nbu_make_dir(struct nbu_ctx *ctx, int dfd, const char *path)
+{
+	char *name;
+	int ret;
+
+	if (ctx->tar != NULL) {
+		if (asprintf(&name, "%s/", path) == -1) {
+			warnx("asprintf() failed");
+			return -1;
+		}
+		ret = nbu_tar_add_header(ctx, name, '5', 0);
+		free(name);
+		return ret;
+	}
+
+	ctx->stats.syscalls++;
+	if (mkdirat(dfd, path, 0777) == -1 && errno != EEXIST) {
+		warn("mkdirat: %s", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Check if a folder was selected for export */
+static int
+nbu_folder_selected(struct nbu_ctx *ctx, const char *name)
+{
+	size_t i;
+
+	if (ctx->nselect_folders == 0)
+		return 1;
+
+	for (i = 0; i < ctx->nselect_folders; i++)
+		if (strcmp(ctx->select_folders[i], name) == 0)
+			return 1;
+
+	return 0;
+}
+
+/* Restrict an item list to the selected item range */
+static void
+nbu_select_item_range(struct nbu_ctx *ctx, const struct nbu_item_list *list,
+    struct nbu_item_list *sel)
+{
+	size_t first, last;
+
+	first = ctx->select_first - 1;
+	last = (ctx->select_last < list->nitems) ?
+	    ctx->select_last : list->nitems;
+
+	sel->first = list->first;
+	sel->nitems = 0;
+
+	if (first < last) {
+		sel->first += first;
+		sel->nitems = last - first;
+	}
+}
+
+/* Return the name of a folder as used for selection and export */
+static char *
+nbu_get_folder_name(const struct nbu_folder *folder)
+{
+	char *name;
+
+	if ((name = (char *)nbu_convert_utf16_to_utf8(folder->name)) != NULL)
+		nbu_sanitise_filename(name);
+	return name;
+}
+
+static int
+nbu_export_message_folder(struct nbu_ctx *ctx, struct nbu_folder *folder,
+    int dfd, const char *path)
+{
+	struct nbu_item_list items;
+	char *base, *name;
+
+	if ((base = nbu_get_folder_name(folder)) == NULL)
+		return -1;
+
+	if (!nbu_folder_selected(ctx, base)) {
+		free(base);
+		return 0;
+	}
+
+	if (asprintf(&name, "%s/%s.vmg", path, base) == -1) {
+		warnx("asprintf() failed");
+		free(base);
+		return -1;
+	}
+
+	nbu_select_item_range(ctx, &folder->items, &items);
+	if (nbu_add_folder_job(ctx, &items, dfd, name) == -1) {
+		free(base);
+		return -1;
+	}
+
+	if (ctx->message_columns) {
+		if (asprintf(&name, "%s/%s.col", path, base) == -1) {
+			warnx("asprintf() failed");
+			free(base);
+			return -1;
+		}
+		if (nbu_add_job(ctx, &items, NBU_ITEM_MESSAGES, 0, dfd,
+		    name) == -1) {
+			free(base);
+			return -1;
+		}
+	}
+
+	free(base);
+	return 0;
+}
+
+static int
+nbu_export_bookmark_folder(struct nbu_ctx *ctx, struct nbu_folder *folder,
+    int dfd, const char *path)
+{
+	struct nbu_item_list items;
+	char *base, *name;
+
+	if ((base = nbu_get_folder_name(folder)) == NULL)
+		return -1;
+
+	if (!nbu_folder_selected(ctx, base)) {
+		free(base);
+		return 0;
+	}
+
+	if (asprintf(&name, "%s/%s.vbk", path, base) == -1) {
+		warnx("asprintf() failed");
+		free(base);
+		return -1;
+	}
+
+	free(base);
+	nbu_select_item_range(ctx, &folder->items, &items);
+	return nbu_add_job(ctx, &items, NBU_ITEM_RAW, 0, dfd, name);
+}
+
+static int
+nbu_export_mms_folder(struct nbu_ctx *ctx, struct nbu_folder *folder, int dfd,
+    const char *path)
+{
+	struct nbu_item_list item, items;
+	char *base, *dir, *file;
+	size_t i;
+	int ret;
+
+	if ((base = nbu_get_folder_name(folder)) == NULL)
+		return -1;
+
+	if (!nbu_folder_selected(ctx, base)) {
+		free(base);
+		return 0;
+	}
+
+	if (asprintf(&dir, "%s/%s", path, base) == -1) {
+		warnx("asprintf() failed");
+		free(base);
+		return -1;
+	}
+
+	free(base);
+
+	if (nbu_make_dir(ctx, dfd, dir) == -1) {
+		free(dir);
+		return -1;
+	}
+
+	ret = 0;
+	item.nitems = 1;
+	nbu_select_item_range(ctx, &folder->items, &items);
+
+	for (i = 0; i < items.nitems; i++) {
+		item.first = items.first + i;
+
+		if (asprintf(&file, ctx->mms_parts ? "%s/%zu" : "%s/%zu.mms",
+		    dir, item.first - folder->items.first + 1) == -1) {
+			warnx("asprintf() failed");
+			ret = -1;
+			continue;
+		}
+
+		if (ctx->mms_parts) {
+			if (nbu_add_job(ctx, &item, NBU_ITEM_MMS_PARTS, 0, dfd,
+			    file) == -1)
+				ret = -1;
+		} else if (nbu_add_job(ctx, &item, NBU_ITEM_RAW, 1, dfd,
+		    file) == -1)
+			ret = -1;
+	}
+
+	free(dir);
+	return ret;
+}
+
+/* If a table format is set, also export the items as a table */
+static int
+nbu_add_table_job(struct nbu_ctx *ctx, const struct nbu_item_list *items,
+    enum nbu_item_type type, int dfd, const char *name)
+{
+	char *path;
+
+	if (ctx->table_format == NBU_TABLE_NONE)
+		return 0;
+
+	if (asprintf(&path, "%s.%s", name,
+	    (ctx->table_format == NBU_TABLE_CSV) ? "csv" : "ndjson") == -1) {
+		warnx("asprintf() failed");
+		return -1;
+	}
+
+	return nbu_add_job(ctx, items, type, 0, dfd, path);
+}
+
+static int
+nbu_export_bookmarks(struct nbu_ctx *ctx, int dfd)
+{
+	size_t i;
+	int ret;
+
+	if (ctx->bookmarks.nfolders == 0)
+		return 0;
+
+	if (nbu_make_dir(ctx, dfd, NBU_BOOKMARKS_DIR) == -1)
+		return -1;
+
+	ret = 0;
+
+	for (i = 0; i < ctx->bookmarks.nfolders; i++) {
+		if (nbu_export_bookmark_folder(ctx,
+		    &ctx->folders[ctx->bookmarks.first + i], dfd,
+		    NBU_BOOKMARKS_DIR) == -1)
+			ret = -1;
+	}
+
+	return ret;
+}
+
+static int
+nbu_export_calendar(struct nbu_ctx *ctx, int dfd)
+{
+	struct nbu_item_list items;
+	char *path;
+
+	nbu_select_item_range(ctx, &ctx->calendar, &items);
+	if (items.nitems == 0)
+		return 0;
+
+	if ((path = strdup(NBU_CALENDAR_FILE)) == NULL) {
+		warn(NULL);
+		return -1;
+	}
+
+	if (nbu_add_job(ctx, &items, NBU_ITEM_RAW, 0, dfd, path) == -1)
+		return -1;
+
+	return nbu_add_table_job(ctx, &items, NBU_ITEM_CALENDAR, dfd,
+	    NBU_CALENDAR_TABLE);
+}
+
+static int
+nbu_export_contacts(struct nbu_ctx *ctx, int dfd)
+{
+	struct nbu_item_list items;
+	char *path;
+
+	nbu_select_item_range(ctx, &ctx->contacts, &items);
+	if (items.nitems == 0)
+		return 0;
+
+	if ((path = strdup(NBU_CONTACTS_FILE)) == NULL) {
+		warn(NULL);
+		return -1;
+	}
+
+	if (nbu_add_job(ctx, &items, NBU_ITEM_RAW, 0, dfd, path) == -1)
+		return -1;
+
+	return nbu_add_table_job(ctx, &items, NBU_ITEM_CONTACTS, dfd,
+	    NBU_CONTACTS_TABLE);
+}
+
+/*
+ * Export the contact groups as a table, with the name and the number of
+ * members of each group. The table is CSV unless NDJSON tables are chosen.
+ */
+static int
+nbu_export_groups(struct nbu_ctx *ctx, int dfd)
+{
+	struct nbu_folder *folder;
+	struct nbu_index field, out;
+	uint8_t *name;
+	char *path, num[16];
+	size_t i;
+	int fd, format, ret;
+
+	if (ctx->groups.nfolders == 0)
+		return 0;
+
+	format = (ctx->table_format == NBU_TABLE_NDJSON) ? NBU_TABLE_NDJSON :
+	    NBU_TABLE_CSV;
+
+	if (asprintf(&path, "%s.%s%s", NBU_GROUPS_TABLE,
+	    (format == NBU_TABLE_CSV) ? "csv" : "ndjson",
+	    nbu_file_suffix(ctx)) == -1) {
+		warnx("asprintf() failed");
+		return -1;
+	}
+
+	memset(&field, 0, sizeof field);
+	memset(&out, 0, sizeof out);
+
+	if (format == NBU_TABLE_CSV)
+		nbu_index_put(&out, "name,members\r\n", 14);
+
+	ret = 0;
+
+	for (i = 0; i < ctx->groups.nfolders; i++) {
+		folder = &ctx->folders[ctx->groups.first + i];
+		if ((name = nbu_convert_utf16_to_utf8(folder->name)) == NULL) {
+			ret = -1;
+			goto out;
+		}
+
+		field.len = 0;
+		nbu_index_put(&field, name, strlen((char *)name));
+		free(name);
+		snprintf(num, sizeof num, "%" PRIu32, folder->nmembers);
+
+		if (format == NBU_TABLE_CSV) {
+			nbu_vconv_put_csv(&out, &field);
+			nbu_index_put(&out, ",", 1);
+			nbu_index_put(&out, num, strlen(num));
+			nbu_index_put(&out, "\r\n", 2);
+		} else {
+			nbu_index_put(&out, "{\"name\":", 8);
+			nbu_vconv_put_json(&out, &field);
+			nbu_index_put(&out, ",\"members\":", 11);
+			nbu_index_put(&out, num, strlen(num));
+			nbu_index_put(&out, "}\n", 2);
+		}
+	}
+
+	if (field.error || out.error) {
+		ret = -1;
+		goto out;
+	}
+
+	if (ctx->tar != NULL) {
+		ret = nbu_tar_add_file(ctx, &ctx->stats, path, out.data,
+		    out.len);
+		goto out;
+	}
+
+	ctx->stats.syscalls++;
+	if ((fd = openat(dfd, path, O_WRONLY | O_CREAT |
+	    (ctx->incremental ? O_TRUNC : O_EXCL), 0666)) == -1) {
+		warn("openat: %s", path);
+		ret = -1;
+		goto out;
+	}
+
+	ret = nbu_write_file(ctx, &ctx->stats, fd, out.data, out.len);
+
+	ctx->stats.syscalls++;
+	ctx->stats.files++;
+	close(fd);
+
+out:
+	free(field.data);
+	free(out.data);
+	free(path);
+	return ret;
+}
+
+static int
+nbu_export_memos(struct nbu_ctx *ctx, int dfd)
+{
+	struct nbu_item_list item, items;
+	char *name;
+	size_t i;
+	int ret;
+
+	nbu_select_item_range(ctx, &ctx->memos, &items);
+	if (items.nitems == 0)
+		return 0;
+
+	if (nbu_make_dir(ctx, dfd, NBU_MEMOS_DIR) == -1)
+		return -1;
+
+	ret = 0;
+	item.nitems = 1;
+
+	for (i = 0; i < items.nitems; i++) {
+		item.first = items.first + i;
+
+		if (asprintf(&name, "%s/memo-%zu.txt", NBU_MEMOS_DIR,
+		    item.first - ctx->memos.first + 1) == -1) {
+			warnx("asprintf() failed");
+			ret = -1;
+			continue;
+		}
+		if (nbu_add_job(ctx, &item, NBU_ITEM_UTF16, 0, dfd, name) == -1)
+			ret = -1;
+	}
+
+	return ret;
+}
+
+static int
+nbu_export_messages(struct nbu_ctx *ctx, int dfd)
+{
+	size_t i;
+	int ret;
+
+	if (ctx->messages.nfolders == 0)
+		return 0;
+
+	if (nbu_make_dir(ctx, dfd, NBU_MESSAGES_DIR) == -1)
+		return -1;
+
+	ret = 0;
+
+	for (i = 0; i < ctx->messages.nfolders; i++) {
+		if (nbu_export_message_folder(ctx,
+		    &ctx->folders[ctx->messages.first + i], dfd,
+		    NBU_MESSAGES_DIR) == -1)
+			ret = -1;
+	}
+
+	return ret;
+}
+
+static int
+nbu_export_mms(struct nbu_ctx *ctx, int dfd)
+{
+	size_t i;
+	int ret;
+
+	if (ctx->mmses.nfolders == 0)
+		return 0;
+
+	if (nbu_make_dir(ctx, dfd, NBU_MMS_DIR) == -1)
+		return -1;
+
+	ret = 0;
+
+	for (i = 0; i < ctx->mmses.nfolders; i++) {
+		if (nbu_export_mms_folder(ctx,
+		    &ctx->folders[ctx->mmses.first + i], dfd, NBU_MMS_DIR) == -1)
+			ret = -1;
+	}
+
+	return ret;
+}
+
+/*
+ * Read vCards. The length of each vCard is preceded by one or two 32-bit
+ * integers, so their headers are not records of a fixed size.
+ */
+static int
+nbu_read_vcards(struct nbu_ctx *ctx, struct nbu_item_list *list)
+{
+	long pos;
+	uint32_t i, len, nitems, test;
+
+	if (nbu_read_uint32(ctx, &nitems) == -1)
+		return -1;
+
+	NBU_DPRINTF("%" PRIu32 " items\n", nitems);
+
+	for (i = 0; i < nitems; i++) {
+		/* NbuExplorer does this. I don't know why. */
+		if (nbu_read_uint32(ctx, &test) == -1)
+			return -1;
+		if (test != 0x10)
+			NBU_DPRINTF("test 1: 0x%" PRIx32 " != 0x10\n", test);
+		else {
+			if (nbu_read_uint32(ctx, &test) == -1)
+				return -1;
+			if (test > 1)
+				NBU_DPRINTF("test 2: 0x%" PRIx32 " > 1\n",
+				    test);
+		}
+
+		if (nbu_read_uint32(ctx, &len) == -1)
+			return -1;
+
+		if (nbu_tell(ctx, &pos) == -1)
+			return -1;
+
+		if (nbu_add_item(ctx, list, pos, len) == -1)
+			return -1;
+
+		if (nbu_seek(ctx, len, SEEK_CUR) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Read the name of a folder, which follows a 32-bit integer */
+static uint16_t *
+nbu_read_folder_name(struct nbu_ctx *ctx, uint64_t folder_pos)
+{
+	uint16_t *name;
+	uint8_t *utf8;
+
+	if (nbu_seek(ctx, folder_pos + 4, SEEK_SET) == -1)
+		return NULL;
+
+	if ((name = nbu_read_utf16(ctx)) == NULL)
+		return NULL;
+
+	if (nbu_debug && (utf8 = nbu_convert_utf16_to_utf8(name)) != NULL) {
+		NBU_DPRINTF("folder \"%s\"\n", utf8);
+		free(utf8);
+	}
+
+	return name;
+}
+
+/*
+ * Add a folder with the specified name to a list. The name is freed if the
+ * folder cannot be added.
+ */
+static struct nbu_folder *
+nbu_add_named_folder(struct nbu_ctx *ctx, struct nbu_folder_list *list,
+    uint16_t *name)
+{
+	struct nbu_folder *folder;
+
+	if ((folder = nbu_add_folder(ctx, list)) == NULL) {
+		free(name);
+		return NULL;
+	}
+
+	folder->name = name;
+	return folder;
+}
+
+static int
+nbu_read_vcard_folder(struct nbu_ctx *ctx, struct nbu_folder_list *list,
+    uint64_t folder_pos)
+{
+	struct nbu_folder *folder;
+	uint16_t *name;
+
+	if ((name = nbu_read_folder_name(ctx, folder_pos)) == NULL)
+		return -1;
+
+	if ((folder = nbu_add_named_folder(ctx, list, name)) == NULL)
+		return -1;
+
+	return nbu_read_vcards(ctx, &folder->items);
+}
+
+static int
+nbu_read_group_folder(struct nbu_ctx *ctx, struct nbu_folder_list *list,
+    uint64_t folder_pos)
+{
+	struct nbu_folder *folder;
+	uint64_t v[NBU_LAYOUT_NFIELDS];
+	uint16_t *name;
+
+	if ((name = nbu_read_folder_name(ctx, folder_pos)) == NULL)
+		return -1;
+
+	if ((folder = nbu_add_named_folder(ctx, list, name)) == NULL)
+		return -1;
+
+	if (nbu_read_record(ctx, &nbu_count_layout, v) == NULL)
+		return -1;
+
+	NBU_DPRINTF("%" PRIu64 " items\n", v[0]);
+
+	/*
+	 * The count is followed by a record for each member. The layout of
+	 * the records is not known, so the members cannot be matched to the
+	 * contacts and only their number is kept.
+	 */
+	folder->nmembers = v[0];
+	return 0;
+}
+
+static int
+nbu_read_advanced_settings_folder(__unused struct nbu_ctx *ctx,
+    __unused struct nbu_folder_list *list, __unused uint64_t folder_pos)
+{
+	/* The layout of the folders is not known, so nothing is kept */
+	return 0;
+}
+
+static int
+nbu_read_message_folder(struct nbu_ctx *ctx, struct nbu_folder_list *list,
+    uint64_t folder_pos)
+{
+	struct nbu_folder *folder;
+	uint64_t i, nitems, v[NBU_LAYOUT_NFIELDS];
+	uint16_t *name;
+	long pos;
+
+	if ((name = nbu_read_folder_name(ctx, folder_pos)) == NULL)
+		return -1;
+
+	if ((folder = nbu_add_named_folder(ctx, list, name)) == NULL)
+		return -1;
+
+	if (nbu_read_record(ctx, &nbu_count_layout, v) == NULL)
+		return -1;
+
+	nitems = v[0];
+	NBU_DPRINTF("%" PRIu64 " messages\n", nitems);
+
+	for (i = 0; i < nitems; i++) {
+		if (nbu_read_record(ctx, &nbu_message_layout, v) == NULL)
+			return -1;
+
+		if (nbu_tell(ctx, &pos) == -1)
+			return -1;
+
+		if (nbu_add_item(ctx, &folder->items, pos, v[0]) == -1)
+			return -1;
+
+		if (nbu_seek(ctx, v[0], SEEK_CUR) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int
+nbu_read_mms_folder(struct nbu_ctx *ctx, struct nbu_folder_list *list,
+    uint64_t folder_pos)
+{
+	struct nbu_folder *folder;
+	uint64_t i, j, n, nitems, v[NBU_LAYOUT_NFIELDS];
+	uint16_t *name, *utf16;
+	long pos, start;
+	uint8_t *utf8;
+
+	if ((name = nbu_read_folder_name(ctx, folder_pos)) == NULL)
+		return -1;
+
+	if ((folder = nbu_add_named_folder(ctx, list, name)) == NULL)
+		return -1;
+
+	if (nbu_read_record(ctx, &nbu_count_layout, v) == NULL)
+		return -1;
+
+	nitems = v[0];
+	NBU_DPRINTF("%" PRIu64 " messages\n", nitems);
+
+	for (i = 0; i < nitems; i++) {
+		if (nbu_read_record(ctx, &nbu_mms_layout, v) == NULL)
+			return -1;
+
+		n = v[0];
+		NBU_DPRINTF("unknown number: %" PRIu64 "\n", n);
+
+		/* The strings are kept for nbu_convert_mms_strings() */
+		if (nbu_tell(ctx, &start) == -1)
+			return -1;
+
+		for (j = 0; j < n; j++) {
+			if (nbu_seek(ctx, 8, SEEK_CUR) == -1)
+				return -1;
+
+			if (!nbu_debug) {
+				if (nbu_skip_utf16(ctx) == -1)
+					return -1;
+				continue;
+			}
+
+			if ((utf16 = nbu_read_utf16(ctx)) == NULL)
+				return -1;
+
+			if ((utf8 = nbu_convert_utf16_to_utf8(utf16)) !=
+			    NULL) {
+				NBU_DPRINTF("unknown string %" PRIu64
+				    ": \"%s\"\n", j + 1, utf8);
+				free(utf8);
+			}
+
+			free(utf16);
+		}
+
+		if (nbu_tell(ctx, &pos) == -1)
+			return -1;
+
+		if (pos - start > UINT32_MAX) {
+			warnx("MMS strings too long");
+			return -1;
+		}
+
+		if (nbu_read_record(ctx, &nbu_mms_data_layout, v) == NULL)
+			return -1;
+
+		if (nbu_add_item(ctx, &folder->items,
+		    pos + nbu_mms_data_layout.size, v[0]) == -1)
+			return -1;
+
+		ctx->item_strings[ctx->nitems - 1] = pos - start;
+
+		if (nbu_seek(ctx, v[0], SEEK_CUR) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Read a section without folders. Its items start at the offset given by the
+ * section table.
+ */
+static int
+nbu_read_item_section(struct nbu_ctx *ctx,
+    const struct nbu_section_entry *entry)
+{
+	if (entry->nfolders != 0) {
+		warnx("Section unexpectedly contains folders");
+		return -1;
+	}
+
+	return nbu_seek(ctx, entry->pos + entry->section->items_offset,
+	    SEEK_SET);
+}
+
+/*
+ * Read a section with folders. The section header is followed by a record
+ * for each folder, which gives the position of the folder.
+ */
+static int
+nbu_read_folder_section(struct nbu_ctx *ctx,
+    const struct nbu_section_entry *entry, struct nbu_folder_list *list,
+    int (*read_folder)(struct nbu_ctx *, struct nbu_folder_list *, uint64_t))
+{
+	size_t nitems, pos;
+	uint64_t v[NBU_LAYOUT_NFIELDS];
+	uint32_t i;
+	int ret;
+
+	NBU_DPRINTF("%" PRIu32 " items in %" PRIu32 " folders\n",
+	    entry->nitems, entry->nfolders);
+
+	pos = entry->folders_pos;
+	ret = 0;
+
+	for (i = 0; i < entry->nfolders; i++) {
+		if (nbu_seek(ctx, pos, SEEK_SET) == -1)
+			return -1;
+
+		if (nbu_read_record(ctx, &nbu_folder_layout, v) == NULL)
+			return -1;
+
+		pos = ctx->pos;
+		nitems = ctx->nitems;
+
+		/* Folders have their own offsets, so go on with the next */
+		if (read_folder(ctx, list, v[0]) == -1) {
+			NBU_DPRINTF("folder %" PRIu32 " damaged at item %zu\n",
+			    i + 1, ctx->nitems - nitems + 1);
+			ret = -1;
+		}
+	}
+
+	return ret;
+}
+
+static int
+nbu_read_advanced_settings_section(struct nbu_ctx *ctx,
+    const struct nbu_section_entry *entry)
+{
+	NBU_DPRINTF("reading section\n");
+	return nbu_read_folder_section(ctx, entry, NULL,
+	    nbu_read_advanced_settings_folder);
+}
+
+static int
+nbu_read_bookmarks_section(struct nbu_ctx *ctx,
+    const struct nbu_section_entry *entry)
+{
+	NBU_DPRINTF("reading section\n");
+	return nbu_read_folder_section(ctx, entry, &ctx->bookmarks,
+	    nbu_read_vcard_folder);
+}
+
+static int
+nbu_read_calendar_section(struct nbu_ctx *ctx,
+    const struct nbu_section_entry *entry)
+{
+	NBU_DPRINTF("reading section\n");
+
+	if (nbu_read_item_section(ctx, entry) == -1)
+		return -1;
+
+	return nbu_read_vcards(ctx, &ctx->calendar);
+}
+
+static int
+nbu_read_contacts_section(struct nbu_ctx *ctx,
+    const struct nbu_section_entry *entry)
+{
+	NBU_DPRINTF("reading section\n");
+
+	if (nbu_read_item_section(ctx, entry) == -1)
+		return -1;
+
+	return nbu_read_vcards(ctx, &ctx->contacts);
+}
+
+static int
+nbu_read_groups_section(struct nbu_ctx *ctx,
+    const struct nbu_section_entry *entry)
+{
+	NBU_DPRINTF("reading section\n");
+	return nbu_read_folder_section(ctx, entry, &ctx->groups,
+	    nbu_read_group_folder);
+}
+
+static int
+nbu_read_memos_section(struct nbu_ctx *ctx,
+    const struct nbu_section_entry *entry)
+{
+	long pos;
+	uint64_t v[NBU_LAYOUT_NFIELDS];
+	uint32_t i;
+	uint16_t len;
+
+	NBU_DPRINTF("reading section\n");
+	NBU_DPRINTF("%" PRIu32 " memos\n", entry->nitems);
+
+	if (nbu_read_item_section(ctx, entry) == -1)
+		return -1;
+
+	for (i = 0; i < entry->nitems; i++) {
+		if (nbu_read_record(ctx, &nbu_memo_layout, v) == NULL)
+			return -1;
+
+		/* Here, length is in UTF-16 code units, not bytes */
+		if (v[0] > UINT16_MAX / 2) {
+			warnx("Memo too large");
+			return -1;
+		}
+		len = v[0] * 2;
+
+		if (nbu_tell(ctx, &pos) == -1)
+			return -1;
+
+		if (nbu_add_item(ctx, &ctx->memos, pos, len) == -1)
+			return -1;
+
+		if (nbu_seek(ctx, len, SEEK_CUR) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int
+nbu_read_messages_section(struct nbu_ctx *ctx,
+    const struct nbu_section_entry *entry)
+{
+	NBU_DPRINTF("reading section\n");
+	return nbu_read_folder_section(ctx, entry, &ctx->messages,
+	    nbu_read_message_folder);
+}
+
+static int
+nbu_read_mms_section(struct nbu_ctx *ctx,
+    const struct nbu_section_entry *entry)
+{
+	NBU_DPRINTF("reading section\n");
+	return nbu_read_folder_section(ctx, entry, &ctx->mmses,
+	    nbu_read_mms_folder);
+}
+
+static int
+nbu_read_section_entry(struct nbu_ctx *ctx, uint32_t i)
+{
+	struct nbu_section_entry *entry;
+	const uint8_t *guid;
+	size_t j;
+	uint64_t v[NBU_LAYOUT_NFIELDS];
+	char guidstr[NBU_GUID_STRING_LEN];
+
+	entry = &ctx->sections[ctx->nsections];
+
+	if ((guid = nbu_read_record(ctx, &nbu_directory_layout, v)) == NULL)
+		return -1;
+
+	NBU_DPRINTF("section %" PRIu32 ": guid %s\n",
+	    i + 1, nbu_guid_to_string(guidstr, guid));
+
+	for (j = 0; j < nitems(nbu_sections); j++)
+		if (memcmp(guid, nbu_sections[j].guid, NBU_GUID_LEN) == 0)
+			break;
+
+	if (j == nitems(nbu_sections)) {
+		warnx("Unsupported backup section");
+		return -1;
+	}
+
+	entry->section = &nbu_sections[j];
+	entry->pos = v[0];
+	entry->len = v[1];
+	entry->nitems = v[2];
+	entry->nfolders = v[3];
+	ctx->nsections++;
+
+	if (nbu_tell(ctx, &entry->folders_pos) == -1)
+		return -1;
+
+	/* Skip the folder records */
+	if (entry->section->folders) {
+		if (entry->nfolders > ctx->size / nbu_folder_layout.size) {
+			warnx("Invalid number of folders");
+			return -1;
+		}
+		if (nbu_seek(ctx, (long)entry->nfolders *
+		    nbu_folder_layout.size, SEEK_CUR) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Read the section directory. The sections themselves are read on demand by
+ * nbu_read_section().
+ *
+ * The entries differ in size, so a damaged entry makes the rest of the
+ * directory unreadable. The sections before it can still be read.
+ */
+static int
+nbu_read_sections(struct nbu_ctx *ctx)
+{
+	uint32_t i, nsections;
+
+	if (nbu_read_uint32(ctx, &nsections) == -1)
+		return -1;
+
+	NBU_DPRINTF("backup contains %" PRIu32 " sections\n", nsections);
+
+	/* Each directory entry takes at least 40 bytes */
+	if (nsections > ctx->size / 40) {
+		warnx("Invalid number of sections");
+		return -1;
+	}
+
+	if (nsections > 0 && (ctx->sections = calloc(nsections,
+	    sizeof *ctx->sections)) == NULL) {
+		warn(NULL);
+		return -1;
+	}
+
+	for (i = 0; i < nsections; i++)
+		if (nbu_read_section_entry(ctx, i) == -1) {
+			ctx->nsections_lost = nsections - ctx->nsections;
+			warnx("Section directory damaged; %zu of %" PRIu32
+			    " sections lost", ctx->nsections_lost, nsections);
+			break;
+		}
+
+	return 0;
+}
+
+/*
+ * Read all sections of the specified type that have not been read yet. Items
+ * are only added once they have been found to lie within the backup, so if a
+ * section is damaged, the items before the damage are kept, as are the
+ * folders after a damaged folder.
+ */
+static int
+nbu_read_section(struct nbu_ctx *ctx, enum nbu_section_type type)
+{
+	struct nbu_section_entry *entry;
+	size_t i, nfolders, nitems;
+	int ret;
+
+	ret = 0;
+
+	if (ctx->nsections_lost > 0)
+		ret = -1;
+
+	for (i = 0; i < ctx->nsections; i++) {
+		entry = &ctx->sections[i];
+		if (entry->section->type != type)
+			continue;
+
+		if (entry->state == NBU_SECTION_UNREAD) {
+			nfolders = ctx->nfolders;
+			nitems = ctx->nitems;
+
+			if (entry->section->read(ctx, entry) == 0)
+				entry->state = NBU_SECTION_READ;
+			else
+				entry->state = NBU_SECTION_FAILED;
+
+			entry->folders_found = ctx->nfolders - nfolders;
+			entry->items_found = ctx->nitems - nitems;
+
+			if (entry->state == NBU_SECTION_FAILED)
+				warnx("%s section damaged; %zu items recovered",
+				    entry->section->name, entry->items_found);
+		}
+
+		if (entry->state == NBU_SECTION_FAILED)
+			ret = -1;
+	}
+
+	return ret;
+}
+
+/*
+ * Read all sections that are indexed. Nothing is kept of the advanced
+ * settings section, so it is only read for its debug messages.
+ */
+static int
+nbu_read_all_sections(struct nbu_ctx *ctx)
+{
+	size_t i;
+	int ret;
+
+	ret = 0;
+
+	for (i = 0; i < nitems(nbu_sections); i++) {
+		if (!nbu_debug &&
+		    nbu_sections[i].type == NBU_SECTION_ADVANCED_SETTINGS)
+			continue;
+		if (nbu_read_section(ctx, nbu_sections[i].type) == -1)
+			ret = -1;
+	}
+
+	return ret;
+}
+
+static int
+nbu_read_backup(struct nbu_ctx *ctx)
+{
+	uint64_t pos;
+
+	if (nbu_seek(ctx, 20, SEEK_SET) == -1)
+		return -1;
+
+	if (nbu_read_uint64(ctx, &pos) == -1)
+		return -1;
+
+	if (nbu_seek(ctx, pos + 20, SEEK_SET) == -1)
+		return -1;
+
+	if (nbu_read_file_time(ctx, &ctx->backup_time) == -1)
+		return -1;
+
+	if ((ctx->phone_imei = nbu_read_utf16(ctx)) == NULL)
+		return -1;
+
+	if ((ctx->phone_model = nbu_read_utf16(ctx)) == NULL)
+		return -1;
+
+	if ((ctx->phone_name = nbu_read_utf16(ctx)) == NULL)
+		return -1;
+
+	if ((ctx->phone_firmware = nbu_read_utf16(ctx)) == NULL)
+		return -1;
+
+	if ((ctx->phone_language = nbu_read_utf16(ctx)) == NULL)
+		return -1;
+
+	if (nbu_debug)
+		nbu_print_phone_info(ctx);
+
+	if (nbu_seek(ctx, 20, SEEK_CUR) == -1)
+		return -1;
+
+	return nbu_read_sections(ctx);
+}
+
+/*
+ * Compute the key that ties an index to the backup: its size, modification
+ * time and a hash of its header. A spooled backup has a new modification time
+ * every time, so a hash of its entire contents is used instead.
+ */
+static void
+nbu_index_key(struct nbu_ctx *ctx, uint64_t *key)
+{
+	key[0] = ctx->size;
+
+	if (ctx->spool_hash != 0) {
+		key[1] = 0;
+		key[2] = 0;
+		key[3] = ctx->spool_hash;
+	} else {
+		key[1] = ctx->mtime.tv_sec;
+		key[2] = ctx->mtime.tv_nsec;
+		key[3] = nbu_hash(ctx->map, (ctx->size < NBU_INDEX_HASH_LEN) ?
+		    ctx->size : NBU_INDEX_HASH_LEN);
+	}
+}
+
+static void
+nbu_index_put(struct nbu_index *idx, const void *ptr, size_t len)
+{
+	uint8_t *newdata;
+	size_t newsize;
+
+	if (idx->error)
+		return;
+
+	if (len > idx->size - idx->len) {
+		newsize = (idx->size == 0) ? 4096 : idx->size;
+		while (len > newsize - idx->len) {
+			if (newsize > SIZE_MAX / 2) {
+				warnx("Index too large");
+				idx->error = 1;
+				return;
+			}
+			newsize *= 2;
+		}
+
+		if ((newdata = realloc(idx->data, newsize)) == NULL) {
+			warn(NULL);
+			idx->error = 1;
+			return;
+		}
+
+		idx->data = newdata;
+		idx->size = newsize;
+	}
+
+	memcpy(idx->data + idx->len, ptr, len);
+	idx->len += len;
+}
+
+static void
+nbu_index_put_uint32(struct nbu_index *idx, uint32_t u)
+{
+	u = htole32(u);
+	nbu_index_put(idx, &u, sizeof u);
+}
+
+static void
+nbu_index_put_uint64(struct nbu_index *idx, uint64_t u)
+{
+	u = htole64(u);
+	nbu_index_put(idx, &u, sizeof u);
+}
+
+static void
+nbu_index_put_key(struct nbu_index *idx, struct nbu_ctx *ctx)
+{
+	uint64_t key[NBU_INDEX_KEY_LEN];
+	size_t i;
+
+	nbu_index_key(ctx, key);
+
+	for (i = 0; i < NBU_INDEX_KEY_LEN; i++)
+		nbu_index_put_uint64(idx, key[i]);
+}
+
+static void
+nbu_index_put_utf16(struct nbu_index *idx, const uint16_t *utf16)
+{
+	size_t i, len;
+	uint16_t u;
+
+	for (len = 0; utf16[len] != 0; len++)
+		continue;
+
+	nbu_index_put_uint32(idx, len);
+	for (i = 0; i < len; i++) {
+		u = htole16(utf16[i]);
+		nbu_index_put(idx, &u, sizeof u);
+	}
+}
+
+static void
+nbu_index_put_string(struct nbu_index *idx, const char *s)
+{
+	size_t len;
+
+	len = strlen(s);
+	nbu_index_put_uint32(idx, len);
+	nbu_index_put(idx, s, len);
+}
+
+static void
+nbu_index_get(struct nbu_index *idx, void *ptr, size_t len)
+{
+	if (idx->error || len > idx->len - idx->pos) {
+		idx->error = 1;
+		memset(ptr, 0, len);
+		return;
+	}
+
+	memcpy(ptr, idx->data + idx->pos, len);
+	idx->pos += len;
+}
+
+static uint32_t
+nbu_index_get_uint32(struct nbu_index *idx)
+{
+	uint32_t u;
+
+	nbu_index_get(idx, &u, sizeof u);
+	return le32toh(u);
+}
+
+static uint64_t
+nbu_index_get_uint64(struct nbu_index *idx)
+{
+	uint64_t u;
+
+	nbu_index_get(idx, &u, sizeof u);
+	return le64toh(u);
+}
+
+static int
+nbu_index_key_matches(struct nbu_index *idx, struct nbu_ctx *ctx)
+{
+	uint64_t key[NBU_INDEX_KEY_LEN];
+	size_t i;
+
+	nbu_index_key(ctx, key);
+
+	for (i = 0; i < NBU_INDEX_KEY_LEN; i++)
+		if (nbu_index_get_uint64(idx) != key[i])
+			return 0;
+
+	return !idx->error;
+}
+
+static uint16_t *
+nbu_index_get_utf16(struct nbu_index *idx)
+{
+	uint16_t *utf16;
+	uint32_t i, len;
+
+	len = nbu_index_get_uint32(idx);
+	if (idx->error || len > (idx->len - idx->pos) / 2) {
+		idx->error = 1;
+		return NULL;
+	}
+
+	if ((utf16 = reallocarray(NULL, (size_t)len + 1, sizeof *utf16)) ==
+	    NULL) {
+		idx->error = 1;
+		return NULL;
+	}
+
+	for (i = 0; i < len; i++) {
+		nbu_index_get(idx, &utf16[i], sizeof utf16[i]);
+		utf16[i] = le16toh(utf16[i]);
+	}
+
+	utf16[len] = 0;
+	return utf16;
+}
+
+static char *
+nbu_index_get_string(struct nbu_index *idx)
+{
+	char *s;
+	uint32_t len;
+
+	len = nbu_index_get_uint32(idx);
+	if (idx->error || len > idx->len - idx->pos) {
+		idx->error = 1;
+		return NULL;
+	}
+
+	if ((s = malloc((size_t)len + 1)) == NULL) {
+		idx->error = 1;
+		return NULL;
+	}
+
+	nbu_index_get(idx, s, len);
+	s[len] = '\0';
+	return s;
+}
+
+static void
+nbu_index_put_item_list(struct nbu_index *idx, const struct nbu_item_list *list)
+{
+	nbu_index_put_uint64(idx, list->first);
+	nbu_index_put_uint64(idx, list->nitems);
+}
+
+static void
+nbu_index_put_folder_list(struct nbu_index *idx,
+    const struct nbu_folder_list *list)
+{
+	nbu_index_put_uint64(idx, list->first);
+	nbu_index_put_uint64(idx, list->nfolders);
+}
+
+static void
+nbu_index_get_item_list(struct nbu_index *idx, struct nbu_item_list *list,
+    size_t nitems)
+{
+	list->first = nbu_index_get_uint64(idx);
+	list->nitems = nbu_index_get_uint64(idx);
+
+	if (list->first > nitems || list->nitems > nitems - list->first)
+		idx->error = 1;
+}
+
+static void
+nbu_index_get_folder_list(struct nbu_index *idx, struct nbu_folder_list *list,
+    size_t nfolders)
+{
+	list->first = nbu_index_get_uint64(idx);
+	list->nfolders = nbu_index_get_uint64(idx);
+
+	if (list->first > nfolders || list->nfolders > nfolders - list->first)
+		idx->error = 1;
+}
+
+/*
+ * Write an index file. The data is written to a new temporary file next to
+ * it, which then replaces the file. An interrupted write therefore does not
+ * leave a truncated file behind, and runs that write the same index at the
+ * same time do not write to the same temporary file. An index is only a
+ * cache, so writing it is not counted in the statistics.
+ */
+static int
+nbu_write_index_file(const struct nbu_index *idx, const char *path)
+{
+	struct nbu_stats st;
+	char *tmp;
+	int fd, ret;
+
+	if (asprintf(&tmp, "%s%s", path, NBU_INDEX_TMP_SUFFIX) == -1) {
+		warnx("asprintf() failed");
+		return -1;
+	}
+
+	ret = -1;
+	memset(&st, 0, sizeof st);
+
+	if ((fd = mkstemp(tmp)) == -1)
+		warn("mkstemp: %s", tmp);
+	else {
+		ret = nbu_write(&st, fd, idx->data, idx->len);
+		close(fd);
+
+		if (ret == 0 && rename(tmp, path) == -1) {
+			warn("rename: %s", path);
+			ret = -1;
+		}
+		if (ret == -1)
+			unlink(tmp);
+	}
+
+	free(tmp);
+	return ret;
+}
+
+/*
+ * Save the parsed index of the backup, so that later calls to nbu_open() can
+ * load it instead of parsing the backup again. The index is tied to the size,
+ * modification time and header of the backup.
+ */
+static int
+nbu_save_index(struct nbu_ctx *ctx, const char *path)
+{
+	struct nbu_index idx;
+	size_t i;
+	int ret;
+
+	memset(&idx, 0, sizeof idx);
+
+	nbu_index_put(&idx, NBU_INDEX_MAGIC, NBU_INDEX_MAGIC_LEN);
+	nbu_index_put_uint32(&idx, NBU_INDEX_VERSION);
+	nbu_index_put_key(&idx, ctx);
+
+	nbu_index_put_uint64(&idx, ctx->backup_time);
+	nbu_index_put_utf16(&idx, ctx->phone_imei);
+	nbu_index_put_utf16(&idx, ctx->phone_model);
+	nbu_index_put_utf16(&idx, ctx->phone_name);
+	nbu_index_put_utf16(&idx, ctx->phone_firmware);
+	nbu_index_put_utf16(&idx, ctx->phone_language);
+
+	nbu_index_put_uint64(&idx, ctx->nitems);
+	for (i = 0; i < ctx->nitems; i++) {
+		nbu_index_put_uint64(&idx, ctx->item_pos[i]);
+		nbu_index_put_uint32(&idx, ctx->item_len[i]);
+		nbu_index_put_uint32(&idx, ctx->item_strings[i]);
+	}
+
+	nbu_index_put_uint64(&idx, ctx->nfolders);
+	for (i = 0; i < ctx->nfolders; i++) {
+		nbu_index_put_utf16(&idx, ctx->folders[i].name);
+		nbu_index_put_item_list(&idx, &ctx->folders[i].items);
+		nbu_index_put_uint32(&idx, ctx->folders[i].nmembers);
+	}
+
+	nbu_index_put_folder_list(&idx, &ctx->bookmarks);
+	nbu_index_put_folder_list(&idx, &ctx->groups);
+	nbu_index_put_folder_list(&idx, &ctx->messages);
+	nbu_index_put_folder_list(&idx, &ctx->mmses);
+	nbu_index_put_item_list(&idx, &ctx->calendar);
+	nbu_index_put_item_list(&idx, &ctx->contacts);
+	nbu_index_put_item_list(&idx, &ctx->memos);
+
+	/* Detect truncated or otherwise damaged index files */
+	if (!idx.error)
+		nbu_index_put_uint64(&idx, nbu_hash(idx.data, idx.len));
+
+	if (idx.error) {
+		free(idx.data);
+		return -1;
+	}
+
+	ret = nbu_write_index_file(&idx, path);
+	free(idx.data);
+	return ret;
+}
+
+static int
+nbu_read_index_file(struct nbu_stats *stats, struct nbu_index *idx, int dfd,
+    const char *path)
+{
+	struct stat st;
+	ssize_t n;
+	int fd;
+
+	stats->syscalls += 2;
+
+	if ((fd = openat(dfd, path, O_RDONLY)) == -1) {
+		if (errno != ENOENT)
+			warn("openat: %s", path);
+		return -1;
+	}
+
+	if (fstat(fd, &st) == -1) {
+		warn("fstat: %s", path);
+		goto error;
+	}
+
+	if (st.st_size <= 0 || (uintmax_t)st.st_size > SIZE_MAX)
+		goto error;
+
+	idx->size = st.st_size;
+	if ((idx->data = malloc(idx->size)) == NULL) {
+		warn(NULL);
+		goto error;
+	}
+
+	for (idx->len = 0; idx->len < idx->size; idx->len += n) {
+		stats->syscalls++;
+		n = read(fd, idx->data + idx->len, idx->size - idx->len);
+		if (n == -1) {
+			warn("read: %s", path);
+			goto error;
+		}
+		if (n == 0)
+			break;
+	}
+
+	stats->syscalls++;
+	close(fd);
+	return 0;
+
+error:
+	close(fd);
+	return -1;
+}
+
+/* Free everything read from the backup or from an index */
+static void
+nbu_free_index(struct nbu_ctx *ctx)
+{
+	size_t i;
+
+	free(ctx->phone_imei);
+	free(ctx->phone_model);
+	free(ctx->phone_name);
+	free(ctx->phone_firmware);
+	free(ctx->phone_language);
+	free(ctx->sections);
+
+	for (i = 0; i < ctx->nfolders; i++)
+		free(ctx->folders[i].name);
+	free(ctx->folders);
+	free(ctx->item_pos);
+	free(ctx->item_len);
+	free(ctx->item_strings);
+
+	ctx->phone_imei = ctx->phone_model = ctx->phone_name = NULL;
+	ctx->phone_firmware = ctx->phone_language = NULL;
+	ctx->sections = NULL;
+	ctx->nsections = 0;
+	ctx->folders = NULL;
+	ctx->nfolders = ctx->folders_size = 0;
+	ctx->item_pos = NULL;
+	ctx->item_len = NULL;
+	ctx->item_strings = NULL;
+	ctx->nitems = ctx->items_size = 0;
+	memset(&ctx->bookmarks, 0, sizeof ctx->bookmarks);
+	memset(&ctx->groups, 0, sizeof ctx->groups);
+	memset(&ctx->messages, 0, sizeof ctx->messages);
+	memset(&ctx->mmses, 0, sizeof ctx->mmses);
+	memset(&ctx->calendar, 0, sizeof ctx->calendar);
+	memset(&ctx->contacts, 0, sizeof ctx->contacts);
+	memset(&ctx->memos, 0, sizeof ctx->memos);
+}
+
+/*
+ * Load an index saved by nbu_save_index(). Fail if the index does not exist,
+ * is damaged or does not belong to the backup.
+ */
+static int
+nbu_load_index(struct nbu_ctx *ctx, const char *path)
+{
+	struct nbu_index idx;
+	uint64_t hash, nfolders, nitems;
+	size_t i;
+	char magic[NBU_INDEX_MAGIC_LEN];
+
+	memset(&idx, 0, sizeof idx);
+
+	if (nbu_read_index_file(&ctx->stats, &idx, AT_FDCWD, path) == -1) {
+		free(idx.data);
+		return -1;
+	}
+
+	/* The index ends with a hash of everything before it */
+	if (idx.len < sizeof hash)
+		goto error;
+
+	idx.len -= sizeof hash;
+	memcpy(&hash, idx.data + idx.len, sizeof hash);
+	if (nbu_hash(idx.data, idx.len) != le64toh(hash))
+		goto error;
+
+	nbu_index_get(&idx, magic, sizeof magic);
+	if (memcmp(magic, NBU_INDEX_MAGIC, sizeof magic) != 0 ||
+	    nbu_index_get_uint32(&idx) != NBU_INDEX_VERSION ||
+	    !nbu_index_key_matches(&idx, ctx))
+		goto error;
+
+	ctx->backup_time = nbu_index_get_uint64(&idx);
+	ctx->phone_imei = nbu_index_get_utf16(&idx);
+	ctx->phone_model = nbu_index_get_utf16(&idx);
+	ctx->phone_name = nbu_index_get_utf16(&idx);
+	ctx->phone_firmware = nbu_index_get_utf16(&idx);
+	ctx->phone_language = nbu_index_get_utf16(&idx);
+
+	/* Each item takes 16 bytes */
+	nitems = nbu_index_get_uint64(&idx);
+	if (idx.error || nitems > (idx.len - idx.pos) / 16)
+		goto error;
+
+	if (nitems > 0 && ((ctx->item_pos = reallocarray(NULL, nitems,
+	    sizeof *ctx->item_pos)) == NULL ||
+	    (ctx->item_len = reallocarray(NULL, nitems,
+	    sizeof *ctx->item_len)) == NULL ||
+	    (ctx->item_strings = reallocarray(NULL, nitems,
+	    sizeof *ctx->item_strings)) == NULL)) {
+		warn(NULL);
+		goto error;
+	}
+
+	ctx->nitems = ctx->items_size = nitems;
+	for (i = 0; i < nitems; i++) {
+		ctx->item_pos[i] = nbu_index_get_uint64(&idx);
+		ctx->item_len[i] = nbu_index_get_uint32(&idx);
+		ctx->item_strings[i] = nbu_index_get_uint32(&idx);
+		if (ctx->item_pos[i] < 0)
+			idx.error = 1;
+	}
+
+	/* Each folder takes at least 24 bytes */
+	nfolders = nbu_index_get_uint64(&idx);
+	if (idx.error || nfolders > (idx.len - idx.pos) / 24)
+		goto error;
+
+	if (nfolders > 0 && (ctx->folders = calloc(nfolders,
+	    sizeof *ctx->folders)) == NULL) {
+		warn(NULL);
+		goto error;
+	}
+
+	ctx->nfolders = ctx->folders_size = nfolders;
+	for (i = 0; i < nfolders; i++) {
+		ctx->folders[i].name = nbu_index_get_utf16(&idx);
+		nbu_index_get_item_list(&idx, &ctx->folders[i].items, nitems);
+		ctx->folders[i].nmembers = nbu_index_get_uint32(&idx);
+	}
+
+	nbu_index_get_folder_list(&idx, &ctx->bookmarks, nfolders);
+	nbu_index_get_folder_list(&idx, &ctx->groups, nfolders);
+	nbu_index_get_folder_list(&idx, &ctx->messages, nfolders);
+	nbu_index_get_folder_list(&idx, &ctx->mmses, nfolders);
+	nbu_index_get_item_list(&idx, &ctx->calendar, nitems);
+	nbu_index_get_item_list(&idx, &ctx->contacts, nitems);
+	nbu_index_get_item_list(&idx, &ctx->memos, nitems);
+
+	if (idx.error || idx.pos != idx.len)
+		goto error;
+
+	free(idx.data);
+	NBU_DPRINTF("loaded index %s\n", path);
+	return 0;
+
+error:
+	free(idx.data);
+	nbu_free_index(ctx);
+	NBU_DPRINTF("cannot use index %s\n", path);
+	return -1;
+}
+
+static void
+nbu_free_manifest(struct nbu_ctx *ctx)
+{
+	size_t i;
+
+	for (i = 0; i < ctx->nmanifest; i++)
+		free(ctx->manifest[i].path);
+	free(ctx->manifest);
+	ctx->manifest = NULL;
+	ctx->nmanifest = 0;
+}
+
+/*
+ * Load the manifest of a previous export to the directory. Without a usable
+ * manifest, all files are exported again.
+ */
+static void
+nbu_load_manifest(struct nbu_ctx *ctx, int dfd)
+{
+	struct nbu_index idx;
+	struct nbu_manifest_entry *e;
+	uint64_t hash, n;
+	size_t i;
+	char magic[NBU_INDEX_MAGIC_LEN];
+
+	memset(&idx, 0, sizeof idx);
+
+	if (nbu_read_index_file(&ctx->stats, &idx, dfd, NBU_MANIFEST_FILE) ==
+	    -1) {
+		free(idx.data);
+		return;
+	}
+
+	if (idx.len < sizeof hash)
+		goto error;
+
+	idx.len -= sizeof hash;
+	memcpy(&hash, idx.data + idx.len, sizeof hash);
+	if (nbu_hash(idx.data, idx.len) != le64toh(hash))
+		goto error;
+
+	nbu_index_get(&idx, magic, sizeof magic);
+	if (memcmp(magic, NBU_MANIFEST_MAGIC, sizeof magic) != 0 ||
+	    nbu_index_get_uint32(&idx) != NBU_MANIFEST_VERSION)
+		goto error;
+
+	/* Each entry takes at least 28 bytes */
+	n = nbu_index_get_uint64(&idx);
+	if (idx.error || n > (idx.len - idx.pos) / 28)
+		goto error;
+
+	if (n > 0 && (ctx->manifest = calloc(n, sizeof *ctx->manifest)) ==
+	    NULL) {
+		warn(NULL);
+		goto error;
+	}
+
+	for (i = 0; i < n; i++) {
+		e = &ctx->manifest[ctx->nmanifest++];
+		e->path = nbu_index_get_string(&idx);
+		e->nitems = nbu_index_get_uint64(&idx);
+		e->hash = nbu_index_get_uint64(&idx);
+		e->size = nbu_index_get_uint64(&idx);
+		e->valid = 1;
+		if (idx.error)
+			goto error;
+	}
+
+	if (idx.pos != idx.len)
+		goto error;
+
+	qsort(ctx->manifest, ctx->nmanifest, sizeof *ctx->manifest,
+	    nbu_compare_manifest_entries);
+
+	free(idx.data);
+	NBU_DPRINTF("loaded manifest with %zu entries\n", ctx->nmanifest);
+	return;
+
+error:
+	free(idx.data);
+	nbu_free_manifest(ctx);
+	warnx("%s: Invalid manifest; exporting all files", NBU_MANIFEST_FILE);
+}
+
+static int
+nbu_compare_manifest_entry_ptrs(const void *a, const void *b)
+{
+	return nbu_compare_manifest_entries(
+	    *(const struct nbu_manifest_entry * const *)a,
+	    *(const struct nbu_manifest_entry * const *)b);
+}
+
+/*
+ * Save the manifest of the export to the directory. It describes the files
+ * exported by the planned jobs and, unless they were exported again, the
+ * files in the previous manifest. The manifest is replaced atomically.
+ */
+static int
+nbu_save_manifest(struct nbu_ctx *ctx, int dfd)
+{
+	struct nbu_index idx;
+	struct nbu_manifest_entry **entries, *e;
+	size_t i, nentries, njobs, nvalid;
+	int fd, ret;
+
+	if ((entries = reallocarray(NULL, ctx->nplanned + ctx->nmanifest,
+	    sizeof *entries)) == NULL) {
+		warn(NULL);
+		return -1;
+	}
+
+	for (i = 0; i < ctx->nplanned; i++)
+		entries[i] = &ctx->plan[i]->entry;
+
+	njobs = nentries = ctx->nplanned;
+	qsort(entries, njobs, sizeof *entries, nbu_compare_manifest_entry_ptrs);
+
+	for (i = 0; i < ctx->nmanifest; i++) {
+		e = &ctx->manifest[i];
+		if (bsearch(&e, entries, njobs, sizeof *entries,
+		    nbu_compare_manifest_entry_ptrs) == NULL)
+			entries[nentries++] = e;
+	}
+
+	qsort(entries, nentries, sizeof *entries,
+	    nbu_compare_manifest_entry_ptrs);
+
+	nvalid = 0;
+	for (i = 0; i < nentries; i++)
+		if (entries[i]->valid)
+			nvalid++;
+
+	memset(&idx, 0, sizeof idx);
+
+	nbu_index_put(&idx, NBU_MANIFEST_MAGIC, NBU_INDEX_MAGIC_LEN);
+	nbu_index_put_uint32(&idx, NBU_MANIFEST_VERSION);
+	nbu_index_put_uint64(&idx, nvalid);
+
+	for (i = 0; i < nentries; i++) {
+		if (!entries[i]->valid)
+			continue;
+		nbu_index_put_string(&idx, entries[i]->path);
+		nbu_index_put_uint64(&idx, entries[i]->nitems);
+		nbu_index_put_uint64(&idx, entries[i]->hash);
+		nbu_index_put_uint64(&idx, entries[i]->size);
+	}
+
+	free(entries);
+
+	if (!idx.error)
+		nbu_index_put_uint64(&idx, nbu_hash(idx.data, idx.len));
+
+	if (idx.error) {
+		free(idx.data);
+		return -1;
+	}
+
+	ret = -1;
+
+	ctx->stats.syscalls++;
+	fd = openat(dfd, NBU_MANIFEST_TMP_FILE, O_WRONLY | O_CREAT | O_TRUNC,
+	    0666);
+	if (fd == -1)
+		warn("openat: %s", NBU_MANIFEST_TMP_FILE);
+	else {
+		ret = nbu_write(&ctx->stats, fd, idx.data, idx.len);
+		ctx->stats.syscalls++;
+		close(fd);
+
+		ctx->stats.syscalls++;
+		if (ret == 0 && renameat(dfd, NBU_MANIFEST_TMP_FILE, dfd,
+		    NBU_MANIFEST_FILE) == -1) {
+			warn("renameat: %s", NBU_MANIFEST_FILE);
+			ret = -1;
+		}
+	}
+
+	free(idx.data);
+	return ret;
+}
+
+static const struct {
+	int		 select;
+	enum nbu_section_type type;
+	int		 (*export)(struct nbu_ctx *, int);
+} nbu_exports[] = {
+	{ NBU_EXPORT_BOOKMARKS, NBU_SECTION_BOOKMARKS, nbu_export_bookmarks },
+	{ NBU_EXPORT_CALENDAR, NBU_SECTION_CALENDAR, nbu_export_calendar },
+	{ NBU_EXPORT_CONTACTS, NBU_SECTION_CONTACTS, nbu_export_contacts },
+	{ NBU_EXPORT_GROUPS, NBU_SECTION_GROUPS, nbu_export_groups },
+	{ NBU_EXPORT_MEMOS, NBU_SECTION_MEMOS, nbu_export_memos },
+	{ NBU_EXPORT_MESSAGES, NBU_SECTION_MESSAGES, nbu_export_messages },
+	{ NBU_EXPORT_MMS, NBU_SECTION_MMS, nbu_export_mms },
+};
+
+/* Allocate a context with the default settings and no index */
+static struct nbu_ctx *
+nbu_new_ctx(void)
+{
+	struct nbu_ctx *ctx;
+	int error;
+
+	if ((ctx = calloc(1, sizeof *ctx)) == NULL) {
+		warn(NULL);
+		return NULL;
+	}
+
+	if ((error = pthread_mutex_init(&ctx->stats_mutex, NULL)) != 0) {
+		warnc(error, "pthread_mutex_init");
+		free(ctx);
+		return NULL;
+	}
+
+	ctx->store_dfd = -1;
+	ctx->select_sections = NBU_EXPORT_ALL;
+	ctx->select_first = 1;
+	ctx->select_last = SIZE_MAX;
+	return ctx;
+}
+
+static int
+nbu_open_fd_name(struct nbu_ctx **ctxp, int fd, const char *name,
+    const char *index)
+{
+	struct nbu_ctx *ctx;
+	uint64_t t;
+	int ret;
+
+	ret = -1;
+	t = nbu_now();
+
+	if ((ctx = nbu_new_ctx()) == NULL)
+		goto out;
+
+	if (nbu_map(ctx, fd, name) == -1)
+		goto out;
+
+	if (index != NULL && nbu_load_index(ctx, index) == 0) {
+		ret = 0;
+		goto out;
+	}
+
+	if (nbu_read_backup(ctx) == -1)
+		goto out;
+
+	/*
+	 * The index must contain all sections. It is only a cache, so failing
+	 * to save it is not fatal.
+	 */
+	if (index != NULL && nbu_read_all_sections(ctx) == 0)
+		nbu_save_index(ctx, index);
+
+	ret = 0;
+
+out:
+	if (ctx != NULL)
+		ctx->stats.open_time = nbu_now() - t;
+	*ctxp = ctx;
+	return ret;
+}
+
+int
+nbu_open(struct nbu_ctx **ctxp, const char *path, const char *index)
+{
+	int fd, ret;
+
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		warn("open: %s", path);
+		*ctxp = NULL;
+		return -1;
+	}
+
+	ret = nbu_open_fd_name(ctxp, fd, path, index);
+	if (*ctxp != NULL)
+		(*ctxp)->stats.syscalls += 2;
+	close(fd);
+	return ret;
+}
+
+/*
+ * Like nbu_open(), but read the backup from a descriptor. If the descriptor
+ * does not refer to a regular file, the backup is copied to a temporary file
+ * first. The caller must close the descriptor.
+ */
+int
+nbu_open_fd(struct nbu_ctx **ctxp, int fd, const char *index)
+{
+	return nbu_open_fd_name(ctxp, fd, "stdin", index);
+}
+
+/*
+ * Create a context that shares the index of another one, but has its own
+ * settings, selection and statistics. All sections are read first, and
+ * sections that are not read then are never read, so that the index no longer
+ * changes. Contexts that share an index can then be used by different threads
+ * at the same time. A context must not be closed before its clones.
+ */
+int
+nbu_clone(struct nbu_ctx **clonep, struct nbu_ctx *ctx)
+{
+	struct nbu_ctx *clone;
+	size_t i;
+
+	*clonep = NULL;
+
+	if (ctx->parent != NULL)
+		ctx = ctx->parent;
+
+	/* Damaged sections stay damaged; they are reported when exporting */
+	nbu_read_all_sections(ctx);
+
+	/* Reading the remaining sections would change the shared index */
+	for (i = 0; i < ctx->nsections; i++)
+		if (ctx->sections[i].state == NBU_SECTION_UNREAD)
+			ctx->sections[i].state = NBU_SECTION_SKIPPED;
+
+	if ((clone = nbu_new_ctx()) == NULL)
+		return -1;
+
+	clone->parent = ctx;
+	clone->map = ctx->map;
+	clone->size = ctx->size;
+	clone->mtime = ctx->mtime;
+	clone->spool_hash = ctx->spool_hash;
+	clone->sections = ctx->sections;
+	clone->nsections = ctx->nsections;
+	clone->nsections_lost = ctx->nsections_lost;
+	clone->backup_time = ctx->backup_time;
+	clone->phone_imei = ctx->phone_imei;
+	clone->phone_model = ctx->phone_model;
+	clone->phone_name = ctx->phone_name;
+	clone->phone_firmware = ctx->phone_firmware;
+	clone->phone_language = ctx->phone_language;
+	clone->item_pos = ctx->item_pos;
+	clone->item_len = ctx->item_len;
+	clone->item_strings = ctx->item_strings;
+	clone->nitems = clone->items_size = ctx->nitems;
+	clone->folders = ctx->folders;
+	clone->nfolders = clone->folders_size = ctx->nfolders;
+	clone->bookmarks = ctx->bookmarks;
+	clone->groups = ctx->groups;
+	clone->messages = ctx->messages;
+	clone->mmses = ctx->mmses;
+	clone->calendar = ctx->calendar;
+	clone->contacts = ctx->contacts;
+	clone->memos = ctx->memos;
+
+	*clonep = clone;
+	return 0;
+}
+
+void
+nbu_set_jobs(struct nbu_ctx *ctx, int njobs)
+{
+	ctx->njobs = njobs;
+}
+
+void
+nbu_select_sections(struct nbu_ctx *ctx, int sections)
+{
+	ctx->select_sections = sections;
+}
+
+int
+nbu_select_folder(struct nbu_ctx *ctx, const char *name)
+{
+	char **folders, *s;
+
+	folders = reallocarray(ctx->select_folders, ctx->nselect_folders + 1,
+	    sizeof *folders);
+	if (folders == NULL) {
+		warn(NULL);
+		return -1;
+	}
+
+	ctx->select_folders = folders;
+
+	if ((s = strdup(name)) == NULL) {
+		warn(NULL);
+		return -1;
+	}
+
+	ctx->select_folders[ctx->nselect_folders++] = s;
+	return 0;
+}
+
+void
+nbu_select_items(struct nbu_ctx *ctx, size_t first, size_t last)
+{
+	ctx->select_first = first;
+	ctx->select_last = last;
+}
+
+/* Measure transcode and write times. This adds a bit of overhead. */
+void
+nbu_set_timing(struct nbu_ctx *ctx, int timing)
+{
+	ctx->timing = timing;
+}
+
+/* Only write files that are not up to date in the export directory */
+void
+nbu_set_incremental(struct nbu_ctx *ctx, int incremental)
+{
+	ctx->incremental = incremental;
+}
+
+/* Also export contacts and calendar items as CSV or NDJSON tables */
+void
+nbu_set_table_format(struct nbu_ctx *ctx, int format)
+{
+	ctx->table_format = format;
+}
+
+/* Also export each message folder as a columnar table */
+void
+nbu_set_message_columns(struct nbu_ctx *ctx, int columns)
+{
+	ctx->message_columns = columns;
+}
+
+/* Export the parts of each MMS to a directory instead of a single file */
+void
+nbu_set_mms_parts(struct nbu_ctx *ctx, int parts)
+{
+	ctx->mms_parts = parts;
+}
+
+/*
+ * Compress exported files with gzip and add the suffix .gz to their names.
+ * Files in a tar stream are not compressed, and compressed files are not
+ * linked to the store.
+ */
+void
+nbu_set_compression(struct nbu_ctx *ctx, int compress)
+{
+	ctx->compress = compress;
+}
+
+/* Link exported MMS files to a single copy in a store directory */
+int
+nbu_set_store(struct nbu_ctx *ctx, const char *path)
+{
+	int dfd;
+
+	ctx->stats.syscalls += 2;
+
+	if (mkdir(path, 0777) == -1 && errno != EEXIST) {
+		warn("mkdir: %s", path);
+		return -1;
+	}
+
+	if ((dfd = open(path, O_RDONLY | O_DIRECTORY)) == -1) {
+		warn("open: %s", path);
+		return -1;
+	}
+
+	if (ctx->store_dfd != -1)
+		close(ctx->store_dfd);
+	ctx->store_dfd = dfd;
+	return 0;
+}
+
+void
+nbu_get_stats(struct nbu_ctx *ctx, struct nbu_stats *stats)
+{
+	size_t i;
+
+	*stats = ctx->stats;
+
+	pthread_mutex_lock(&ctx->stats_mutex);
+	nbu_add_stats(stats, &ctx->job_stats);
+	pthread_mutex_unlock(&ctx->stats_mutex);
+
+	stats->ncalendar = ctx->calendar.nitems;
+	stats->ncontacts = ctx->contacts.nitems;
+	stats->ngroups = ctx->groups.nfolders;
+	stats->nmemos = ctx->memos.nitems;
+
+	for (i = 0; i < ctx->messages.nfolders; i++)
+		stats->nmessages +=
+		    ctx->folders[ctx->messages.first + i].items.nitems;
+
+	for (i = 0; i < ctx->mmses.nfolders; i++)
+		stats->nmms += ctx->folders[ctx->mmses.first + i].items.nitems;
+
+	for (i = 0; i < ctx->bookmarks.nfolders; i++)
+		stats->nbookmarks +=
+		    ctx->folders[ctx->bookmarks.first + i].items.nitems;
+}
+
+/* Print debug messages to stderr */
+void
+nbu_set_debug(int debug)
+{
+	nbu_debug = debug;
+}
+
+void
+nbu_close(struct nbu_ctx *ctx)
+{
+	size_t i;
+
+	if (ctx == NULL)
+		return;
+
+	if (ctx->search != NULL) {
+		free(ctx->search->idx.data);
+		free(ctx->search);
+	}
+
+	/* A clone does not own its index */
+	if (ctx->parent == NULL) {
+		if (ctx->map != NULL)
+			munmap(ctx->map, ctx->size);
+		nbu_free_index(ctx);
+	}
+
+	if (ctx->store_dfd != -1)
+		close(ctx->store_dfd);
+
+	for (i = 0; i < ctx->nselect_folders; i++)
+		free(ctx->select_folders[i]);
+	free(ctx->select_folders);
+
+	pthread_mutex_destroy(&ctx->stats_mutex);
+	free(ctx);
+}
+
+/*
+ * Read the selected sections. Set selected[i] if the section of nbu_exports[i]
+ * is selected. The items of a damaged section that could be read are still
+ * exported, but the export fails.
+ */
+static int
+nbu_read_selected_sections(struct nbu_ctx *ctx, int *selected)
+{
+	size_t i;
+	uint64_t t;
+	int ret;
+
+	ret = 0;
+	t = nbu_now();
+
+	for (i = 0; i < nitems(nbu_exports); i++) {
+		selected[i] = (ctx->select_sections & nbu_exports[i].select) != 0;
+		if (selected[i] &&
+		    nbu_read_section(ctx, nbu_exports[i].type) == -1)
+			ret = -1;
+	}
+
+	ctx->stats.read_time += nbu_now() - t;
+	return ret;
+}
+
+/* Export the selected sections to a directory or to the tar stream */
+static int
+nbu_export_sections(struct nbu_ctx *ctx, int dfd)
+{
+	size_t i;
+	uint64_t t;
+	int ret, selected[nitems(nbu_exports)];
+
+	/* The members of a tar stream are written one at a time */
+	if ((ctx->pool = pool_new((ctx->tar != NULL) ? 1 : ctx->njobs)) ==
+	    NULL)
+		return -1;
+
+	/*
+	 * Read the sections before starting any jobs. Reading a section may
+	 * move the item array while the jobs are using it.
+	 */
+	ret = nbu_read_selected_sections(ctx, selected);
+	t = nbu_now();
+
+	for (i = 0; i < nitems(nbu_exports); i++)
+		if (selected[i] && nbu_exports[i].export(ctx, dfd) == -1)
+			ret = -1;
+
+	nbu_run_plan(ctx);
+
+	if (pool_wait(ctx->pool) == -1)
+		ret = -1;
+
+	if (ctx->incremental && ctx->tar == NULL &&
+	    nbu_save_manifest(ctx, dfd) == -1)
+		ret = -1;
+
+	nbu_free_plan(ctx);
+
+	ctx->stats.export_time += nbu_now() - t;
+	pool_free(ctx->pool);
+	ctx->pool = NULL;
+	return ret;
+}
+
+int
+nbu_export(struct nbu_ctx *ctx, const char *path)
+{
+	int dfd, ret;
+
+	ctx->stats.syscalls += 2;
+
+	if (mkdir(path, 0777) == -1 && errno != EEXIST) {
+		warn("mkdir: %s", path);
+		return -1;
+	}
+
+	if ((dfd = open(path, O_RDONLY | O_DIRECTORY)) == -1) {
+		warn("open: %s", path);
+		return -1;
+	}
+
+	if (ctx->incremental)
+		nbu_load_manifest(ctx, dfd);
+
+	ret = nbu_export_sections(ctx, dfd);
+	nbu_free_manifest(ctx);
+
+	ctx->stats.syscalls++;
+	close(dfd);
+	return ret;
+}
+
+/*
+ * Export to a tar stream instead of a directory. The data is written straight
+ * from the backup; no files are created.
+ */
+int
+nbu_export_tar(struct nbu_ctx *ctx, int fd)
+{
+	struct nbu_writer *w;
+	int ret;
+
+	if ((w = malloc(sizeof *w)) == NULL) {
+		warn(NULL);
+		return -1;
+	}
+
+	if (nbu_writer_init(w, ctx, &ctx->stats, fd, NBU_WRITER_BUF_SIZE) ==
+	    -1) {
+		free(w);
+		return -1;
+	}
+
+	ctx->tar = w;
+	ret = nbu_export_sections(ctx, -1);
+	ctx->tar = NULL;
+
+	/* End of archive */
+	if (nbu_writer_add(w, nbu_tar_zero, sizeof nbu_tar_zero) == -1 ||
+	    nbu_writer_add(w, nbu_tar_zero, sizeof nbu_tar_zero) == -1 ||
+	    nbu_writer_flush(w) == -1)
+		ret = -1;
+
+	nbu_writer_free(w);
+	free(w);
+	return ret;
+}
+
+/* State of nbu_visit() */
+struct nbu_visitor {
+	struct nbu_ctx	*ctx;
+	int		 flags;
+	int		 (*func)(const struct nbu_item *, void *);
+	void		*arg;
+	struct nbu_item	 item;
+	uint8_t		*buf;
+	size_t		 bufsize;
+
+	/* If set, only items for which it returns 1 are visited */
+	int		 (*filter)(struct nbu_visitor *, size_t);
+};
+
+static int
+nbu_visit_item(struct nbu_visitor *v, size_t item, int utf16)
+{
+	struct nbu_ctx *ctx;
+	const uint8_t *data;
+	uint8_t *newbuf;
+	size_t len;
+	uint64_t t;
+
+	ctx = v->ctx;
+
+	if (v->filter != NULL && !v->filter(v, item))
+		return 0;
+
+	if ((data = nbu_get_item_data(ctx, item)) == NULL)
+		return -1;
+
+	if (utf16 && ctx->item_len[item] % 2 != 0) {
+		warnx("Invalid item size");
+		return -1;
+	}
+
+	ctx->stats.bytes_read += ctx->item_len[item];
+
+	if (!utf16 || !(v->flags & NBU_VISIT_UTF8)) {
+		v->item.data = data;
+		v->item.len = ctx->item_len[item];
+		v->item.utf16 = utf16;
+		return v->func(&v->item, v->arg);
+	}
+
+	/* A code unit is converted to at most 3 UTF-8 bytes */
+	len = ctx->item_len[item] / 2;
+	if (3 * len > v->bufsize) {
+		if ((newbuf = realloc(v->buf, 3 * len)) == NULL) {
+			warn(NULL);
+			return -1;
+		}
+		v->buf = newbuf;
+		v->bufsize = 3 * len;
+	}
+
+	t = ctx->timing ? nbu_now() : 0;
+	v->item.data = v->buf;
+	v->item.len = utf16le_convert_to_utf8(v->buf, data, &len);
+	v->item.utf16 = 0;
+	if (ctx->timing)
+		ctx->stats.transcode_time += nbu_now() - t;
+
+	return v->func(&v->item, v->arg);
+}
+
+static int
+nbu_visit_item_list(struct nbu_visitor *v, const struct nbu_item_list *list,
+    int utf16)
+{
+	struct nbu_item_list items;
+	size_t i;
+	int ret;
+
+	nbu_select_item_range(v->ctx, list, &items);
+
+	for (i = items.first; i < items.first + items.nitems; i++) {
+		v->item.index = i - list->first + 1;
+		if ((ret = nbu_visit_item(v, i, utf16)) != 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int
+nbu_visit_folders(struct nbu_visitor *v, const struct nbu_folder_list *list,
+    int utf16)
+{
+	struct nbu_folder *folder;
+	char *name;
+	size_t i;
+	int ret;
+
+	for (i = 0; i < list->nfolders; i++) {
+		folder = &v->ctx->folders[list->first + i];
+
+		if ((name = nbu_get_folder_name(folder)) == NULL)
+			return -1;
+
+		if (!nbu_folder_selected(v->ctx, name)) {
+			free(name);
+			continue;
+		}
+
+		v->item.folder = name;
+		ret = nbu_visit_item_list(v, &folder->items, utf16);
+		v->item.folder = NULL;
+		free(name);
+
+		if (ret != 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int
+nbu_run_visitor(struct nbu_visitor *v)
+{
+	struct nbu_ctx *ctx;
+	size_t i;
+	uint64_t t;
+	int ret, selected[nitems(nbu_exports)], status;
+
+	ctx = v->ctx;
+	ret = nbu_read_selected_sections(ctx, selected);
+	t = nbu_now();
+
+	for (i = 0; i < nitems(nbu_exports); i++) {
+		if (!selected[i])
+			continue;
+
+		v->item.section = nbu_exports[i].select;
+
+		switch (nbu_exports[i].select) {
+		case NBU_EXPORT_BOOKMARKS:
+			status = nbu_visit_folders(v, &ctx->bookmarks, 0);
+			break;
+		case NBU_EXPORT_CALENDAR:
+			status = nbu_visit_item_list(v, &ctx->calendar, 0);
+			break;
+		case NBU_EXPORT_CONTACTS:
+			status = nbu_visit_item_list(v, &ctx->contacts, 0);
+			break;
+		case NBU_EXPORT_MEMOS:
+			status = nbu_visit_item_list(v, &ctx->memos, 1);
+			break;
+		case NBU_EXPORT_MESSAGES:
+			status = nbu_visit_folders(v, &ctx->messages, 1);
+			break;
+		case NBU_EXPORT_MMS:
+			status = nbu_visit_folders(v, &ctx->mmses, 0);
+			break;
+		default:
+			status = 0;
+			break;
+		}
+
+		if (status != 0) {
+			ret = status;
+			break;
+		}
+	}
+
+	ctx->stats.export_time += nbu_now() - t;
+	return ret;
+}
+
+/*
+ * Call a function for each selected item, in the order in which they would
+ * be exported. If the function returns non-zero, stop and return that value.
+ * The item is only valid during the call.
+ */
+int
+nbu_visit(struct nbu_ctx *ctx, int flags,
+    int (*func)(const struct nbu_item *, void *), void *arg)
+{
+	struct nbu_visitor v;
+	int ret;
+
+	memset(&v, 0, sizeof v);
+	v.ctx = ctx;
+	v.flags = flags;
+	v.func = func;
+	v.arg = arg;
+
+	ret = nbu_run_visitor(&v);
+	free(v.buf);
+	return ret;
+}
+
+/*
+ * Check the integrity of a backup without exporting it. All sections are read,
+ * which only involves their folder and item headers, and the function is
+ * called for each entry in the section directory. A section is damaged if it
+ * could not be read completely or if it extends beyond the end of the backup.
+ * Return -1 if any part of the backup is damaged. If the function returns
+ * non-zero, stop and return that value.
+ *
+ * The backup must have been opened without an index.
+ */
+int
+nbu_check(struct nbu_ctx *ctx,
+    int (*func)(const struct nbu_section_report *, void *), void *arg)
+{
+	struct nbu_section_entry *entry;
+	struct nbu_section_report r;
+	size_t i;
+	uint64_t t;
+	int ret, status;
+
+	ret = (ctx->nsections_lost > 0) ? -1 : 0;
+	t = nbu_now();
+
+	for (i = 0; i < ctx->nsections; i++) {
+		entry = &ctx->sections[i];
+		nbu_read_section(ctx, entry->section->type);
+
+		r.name = entry->section->name;
+		r.pos = entry->pos;
+		r.len = entry->len;
+		r.nfolders = entry->folders_found;
+		r.nitems = entry->items_found;
+		r.nitems_stated = entry->nitems;
+		r.damaged = (entry->state == NBU_SECTION_FAILED);
+
+		if (entry->pos > ctx->size || entry->len > ctx->size -
+		    entry->pos) {
+			warnx("%s section extends beyond end of file", r.name);
+			r.damaged = 1;
+		}
+
+		if (r.damaged)
+			ret = -1;
+
+		if ((status = func(&r, arg)) != 0) {
+			ret = status;
+			break;
+		}
+	}
+
+	ctx->stats.read_time += nbu_now() - t;
+	return ret;
+}
+
+static uint8_t
+nbu_search_lower(uint8_t c)
 {
-	NBU_DPRINTF("reading section\n");
-	return nbu_read_vcard_folder_section(ctx, &ctx->bookmarks);
+	return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
 }
 
-static int
-nbu_read_calendar_section(struct nbu_ctx *ctx, uint64_t section_pos)
+/* Hash a trigram to a bucket, ignoring ASCII case */
+static uint32_t
+nbu_search_bucket(const uint8_t *p)
 {
-	NBU_DPRINTF("reading section\n");
-	return nbu_read_vcard_section(ctx, section_pos, &ctx->calendar);
+	uint32_t key;
+
+	key = (uint32_t)nbu_search_lower(p[0]) << 16 |
+	    nbu_search_lower(p[1]) << 8 | nbu_search_lower(p[2]);
+	return (key * 2654435761U) % NBU_SEARCH_BUCKETS;
 }
 
 static int
-nbu_read_contacts_section(struct nbu_ctx *ctx, uint64_t section_pos)
+nbu_compare_uint32(const void *a, const void *b)
 {
-	NBU_DPRINTF("reading section\n");
-	return nbu_read_vcard_section(ctx, section_pos, &ctx->contacts);
+	uint32_t ua, ub;
+
+	ua = *(const uint32_t *)a;
+	ub = *(const uint32_t *)b;
+	return (ua < ub) ? -1 : (ua > ub);
 }
 
-static int
-nbu_read_groups_section(struct nbu_ctx *ctx, __unused uint64_t section_pos)
+/* Compute the buckets of some text, without duplicates */
+static size_t
+nbu_search_buckets(uint32_t *buckets, const uint8_t *text, size_t len)
 {
-	struct nbu_folder *folder;
-	long pos;
-	uint64_t folder_pos;
-	uint32_t i, n, ngroups;
+	size_t i, n;
 
-	NBU_DPRINTF("reading section\n");
+	if (len < 3)
+		return 0;
 
-	if (nbu_read_uint32(ctx, &n) == -1)
-		return -1;
+	for (i = 0; i < len - 2; i++)
+		buckets[i] = nbu_search_bucket(text + i);
 
-	/* XXX Probably total number of items */
-	NBU_DPRINTF("unknown number: %" PRIu32 "\n", n);
+	qsort(buckets, len - 2, sizeof *buckets, nbu_compare_uint32);
 
-	if (nbu_read_uint32(ctx, &ngroups) == -1)
-		return -1;
+	for (i = n = 0; i < len - 2; i++)
+		if (n == 0 || buckets[i] != buckets[n - 1])
+			buckets[n++] = buckets[i];
 
-	NBU_DPRINTF("%" PRIu32 " groups\n", ngroups);
+	return n;
+}
 
-	for (i = 0; i < ngroups; i++) {
-		if (nbu_seek(ctx, 4, SEEK_CUR) == -1)
-			return -1;
+/* State while building a search index */
+struct nbu_search_builder {
+	struct nbu_ctx	*ctx;
+	uint8_t		*text;
+	size_t		 textsize;
+
+	/* The buckets of all items, one item after another */
+	uint32_t	*buckets;
+	size_t		 nbuckets;
+	size_t		 buckets_size;
+
+	/* The last document added to each bucket, plus one */
+	size_t		*seen;
+
+	/* The documents with text and their number of buckets */
+	size_t		*docs;
+	size_t		*doc_nbuckets;
+	size_t		 nitems;
+	size_t		 items_size;
+	size_t		 ndocs;
+};
 
-		if (nbu_read_uint64(ctx, &folder_pos) == -1)
+static int
+nbu_search_add_item(struct nbu_search_builder *b, size_t item)
+{
+	struct nbu_ctx *ctx;
+	const uint8_t *data;
+	void *p;
+	size_t i, len, newsize;
+	uint32_t bucket;
+
+	ctx = b->ctx;
+	b->ndocs++;
+
+	/* Export reports damaged items; they cannot be found */
+	if (ctx->item_len[item] % 2 != 0 ||
+	    (data = nbu_get_item_data(ctx, item)) == NULL)
+		return 0;
+
+	/* A code unit is converted to at most 3 UTF-8 bytes */
+	len = ctx->item_len[item] / 2;
+	if (3 * len > b->textsize) {
+		if ((p = realloc(b->text, 3 * len)) == NULL) {
+			warn(NULL);
 			return -1;
+		}
+		b->text = p;
+		b->textsize = 3 * len;
+	}
 
-		if (nbu_tell(ctx, &pos) == -1)
+	len = utf16le_convert_to_utf8(b->text, data, &len);
+
+	if (len > b->buckets_size - b->nbuckets) {
+		newsize = (b->buckets_size == 0) ? 65536 : b->buckets_size;
+		while (len > newsize - b->nbuckets)
+			newsize *= 2;
+		if ((p = reallocarray(b->buckets, newsize,
+		    sizeof *b->buckets)) == NULL) {
+			warn(NULL);
 			return -1;
+		}
+		b->buckets = p;
+		b->buckets_size = newsize;
+	}
 
-		if ((folder = nbu_read_group_folder(ctx, folder_pos)) == NULL)
+	if (b->nitems == b->items_size) {
+		newsize = (b->items_size == 0) ? 1024 : b->items_size * 2;
+		if ((p = reallocarray(b->docs, newsize,
+		    sizeof *b->docs)) == NULL) {
+			warn(NULL);
+			return -1;
+		}
+		b->docs = p;
+		if ((p = reallocarray(b->doc_nbuckets, newsize,
+		    sizeof *b->doc_nbuckets)) == NULL) {
+			warn(NULL);
 			return -1;
+		}
+		b->doc_nbuckets = p;
+		b->items_size = newsize;
+	}
 
-		/* TODO */
-		nbu_free_folder(folder);
+	b->docs[b->nitems] = b->ndocs - 1;
+	b->doc_nbuckets[b->nitems] = 0;
 
-		if (nbu_seek(ctx, pos, SEEK_SET) == -1)
-			return -1;
+	for (i = 0; i + 2 < len; i++) {
+		bucket = nbu_search_bucket(b->text + i);
+		if (b->seen[bucket] != b->ndocs) {
+			b->seen[bucket] = b->ndocs;
+			b->buckets[b->nbuckets++] = bucket;
+			b->doc_nbuckets[b->nitems]++;
+		}
 	}
 
+	b->nitems++;
 	return 0;
 }
 
 static int
-nbu_read_memos_section(struct nbu_ctx *ctx, uint64_t section_pos)
+nbu_search_add_item_list(struct nbu_search_builder *b,
+    const struct nbu_item_list *list)
 {
-	long memo_pos, pos;
-	uint32_t i, nmemos;
-	uint16_t len;
-
-	NBU_DPRINTF("reading section\n");
-
-	if ((ctx->memos = nbu_new_item_list()) == NULL)
-		return -1;
-
-	if (nbu_read_uint32(ctx, &nmemos) == -1)
-		return -1;
-
-	NBU_DPRINTF("%" PRIu32 " memos\n", nmemos);
-
-	if (nbu_tell(ctx, &pos) == -1)
-		return -1;
-
-	pos += 4;
-
-	if (nbu_seek(ctx, section_pos + 48, SEEK_SET) == -1)
-		return -1;
-
-	for (i = 0; i < nmemos; i++) {
-		if (nbu_seek(ctx, 4, SEEK_CUR) == -1)
-			return -1;
-
-		/* Here, length is in UTF-16 code units, not bytes */
-		if (nbu_read_uint16(ctx, &len) == -1)
-			return -1;
+	size_t i;
 
-		/* Convert length to bytes */
-		if (len > UINT16_MAX / 2) {
-			warnx("Memo too large");
+	for (i = list->first; i < list->first + list->nitems; i++)
+		if (nbu_search_add_item(b, i) == -1)
 			return -1;
-		}
-		len *= 2;
 
-		if (nbu_tell(ctx, &memo_pos) == -1)
-			return -1;
+	return 0;
+}
 
-		if (nbu_add_item(ctx->memos, memo_pos, len) == -1)
-			return -1;
+static void
+nbu_index_put_varint(struct nbu_index *idx, uint64_t u)
+{
+	uint8_t c;
+
+	do {
+		c = u & 0x7f;
+		u >>= 7;
+		if (u != 0)
+			c |= 0x80;
+		nbu_index_put(idx, &c, 1);
+	} while (u != 0);
+}
 
-		if (nbu_seek(ctx, len, SEEK_CUR) == -1)
-			return -1;
+static uint64_t
+nbu_index_get_varint(struct nbu_index *idx, size_t end)
+{
+	uint64_t u;
+	int shift;
+	uint8_t c;
+
+	u = 0;
+	for (shift = 0; shift < 64; shift += 7) {
+		if (idx->pos >= end) {
+			idx->error = 1;
+			return 0;
+		}
+		c = idx->data[idx->pos++];
+		u |= (uint64_t)(c & 0x7f) << shift;
+		if (!(c & 0x80))
+			return u;
 	}
 
-	if (nbu_seek(ctx, pos, SEEK_SET) == -1)
-		return -1;
-
+	idx->error = 1;
 	return 0;
 }
 
+static void
+nbu_search_put_header(struct nbu_ctx *ctx, struct nbu_index *idx,
+    size_t ndocs)
+{
+	nbu_index_put(idx, NBU_SEARCH_MAGIC, NBU_INDEX_MAGIC_LEN);
+	nbu_index_put_uint32(idx, NBU_SEARCH_VERSION);
+	nbu_index_put_key(idx, ctx);
+	nbu_index_put_uint64(idx, ndocs);
+	nbu_index_put_uint32(idx, NBU_SEARCH_BUCKETS);
+}
+
+/* Serialise the lists of the documents in each bucket */
 static int
-nbu_read_messages_section(struct nbu_ctx *ctx, __unused uint64_t section_pos)
+nbu_search_serialise(struct nbu_ctx *ctx, struct nbu_search_builder *b,
+    struct nbu_index *idx)
 {
-	struct nbu_folder *folder;
-	long pos;
-	uint64_t folder_pos;
-	uint32_t i, nfolders, nmessages;
+	struct nbu_index lists;
+	size_t *pos, *postings;
+	size_t bucket, i, j, k, prev;
 
-	NBU_DPRINTF("reading section\n");
+	memset(&lists, 0, sizeof lists);
 
-	if ((ctx->messages = nbu_new_folder_list()) == NULL)
+	if ((pos = calloc(NBU_SEARCH_BUCKETS + 1, sizeof *pos)) == NULL) {
+		warn(NULL);
 		return -1;
+	}
 
-	if (nbu_read_uint32(ctx, &nmessages) == -1)
+	if ((postings = reallocarray(NULL, (b->nbuckets > 0) ? b->nbuckets :
+	    1, sizeof *postings)) == NULL) {
+		warn(NULL);
+		free(pos);
 		return -1;
+	}
 
-	if (nbu_read_uint32(ctx, &nfolders) == -1)
-		return -1;
+	/* Sort the documents by bucket; they stay in order within a bucket */
+	for (i = 0; i < b->nbuckets; i++)
+		pos[b->buckets[i] + 1]++;
+	for (i = 0; i < NBU_SEARCH_BUCKETS; i++)
+		pos[i + 1] += pos[i];
 
-	NBU_DPRINTF("%" PRIu32 " messages in %" PRIu32 " folders\n", nmessages,
-	    nfolders);
+	for (i = k = 0; i < b->nitems; i++)
+		for (j = 0; j < b->doc_nbuckets[i]; j++, k++)
+			postings[pos[b->buckets[k]]++] = b->docs[i];
 
-	for (i = 0; i < nfolders; i++) {
-		if (nbu_seek(ctx, 4, SEEK_CUR) == -1)
-			return -1;
+	nbu_search_put_header(ctx, idx, b->ndocs);
 
-		if (nbu_read_uint64(ctx, &folder_pos) == -1)
-			return -1;
+	/* pos[bucket] is now the end of the bucket */
+	for (bucket = 0, i = 0; bucket < NBU_SEARCH_BUCKETS; bucket++) {
+		nbu_index_put_uint64(idx, lists.len);
+		for (prev = 0; i < pos[bucket]; i++) {
+			nbu_index_put_varint(&lists, postings[i] - prev);
+			prev = postings[i];
+		}
+	}
+	nbu_index_put_uint64(idx, lists.len);
 
-		if (nbu_tell(ctx, &pos) == -1)
-			return -1;
+	if (lists.error)
+		idx->error = 1;
+	else
+		nbu_index_put(idx, lists.data, lists.len);
 
-		if ((folder = nbu_read_message_folder(ctx, folder_pos)) ==
-		    NULL)
-			return -1;
+	if (!idx->error)
+		nbu_index_put_uint64(idx, nbu_hash(idx->data, idx->len));
 
-		STAILQ_INSERT_TAIL(ctx->messages, folder, entries);
+	free(lists.data);
+	free(postings);
+	free(pos);
+	return idx->error ? -1 : 0;
+}
 
-		if (nbu_seek(ctx, pos, SEEK_SET) == -1)
-			return -1;
+static int
+nbu_search_build(struct nbu_ctx *ctx, struct nbu_index *idx)
+{
+	struct nbu_search_builder b;
+	size_t i;
+	int ret;
+
+	memset(&b, 0, sizeof b);
+	b.ctx = ctx;
+
+	if ((b.seen = calloc(NBU_SEARCH_BUCKETS, sizeof *b.seen)) == NULL) {
+		warn(NULL);
+		return -1;
 	}
 
-	return 0;
+	ret = nbu_search_add_item_list(&b, &ctx->memos);
+
+	for (i = 0; ret == 0 && i < ctx->messages.nfolders; i++)
+		ret = nbu_search_add_item_list(&b,
+		    &ctx->folders[ctx->messages.first + i].items);
+
+	if (ret == 0)
+		ret = nbu_search_serialise(ctx, &b, idx);
+
+	free(b.text);
+	free(b.buckets);
+	free(b.seen);
+	free(b.docs);
+	free(b.doc_nbuckets);
+	return ret;
 }
 
+/*
+ * Check a serialised search index and find its parts. Fail if it does not
+ * belong to the backup.
+ */
 static int
-nbu_read_mms_section(struct nbu_ctx *ctx, __unused uint64_t section_pos)
+nbu_search_parse(struct nbu_ctx *ctx, struct nbu_search_index *s)
 {
-	struct nbu_folder *folder;
-	long pos;
-	uint64_t folder_pos;
-	uint32_t i, nfolders, nmessages;
+	struct nbu_index *idx;
+	uint64_t hash;
+	char magic[NBU_INDEX_MAGIC_LEN];
 
-	NBU_DPRINTF("reading section\n");
+	idx = &s->idx;
 
-	if ((ctx->mmses = nbu_new_folder_list()) == NULL)
+	if (idx->len < sizeof hash)
 		return -1;
 
-	if (nbu_read_uint32(ctx, &nmessages) == -1)
+	idx->len -= sizeof hash;
+	memcpy(&hash, idx->data + idx->len, sizeof hash);
+	if (nbu_hash(idx->data, idx->len) != le64toh(hash))
 		return -1;
 
-	if (nbu_read_uint32(ctx, &nfolders) == -1)
+	idx->pos = 0;
+	nbu_index_get(idx, magic, sizeof magic);
+	if (memcmp(magic, NBU_SEARCH_MAGIC, sizeof magic) != 0 ||
+	    nbu_index_get_uint32(idx) != NBU_SEARCH_VERSION ||
+	    !nbu_index_key_matches(idx, ctx) ||
+	    nbu_index_get_uint64(idx) != s->ndocs ||
+	    nbu_index_get_uint32(idx) != NBU_SEARCH_BUCKETS || idx->error)
 		return -1;
 
-	NBU_DPRINTF("%" PRIu32 " messages in %" PRIu32 " folders\n", nmessages,
-	    nfolders);
+	s->offsets = idx->pos;
+	if ((idx->len - idx->pos) / 8 < NBU_SEARCH_BUCKETS + 1)
+		return -1;
 
-	for (i = 0; i < nfolders; i++) {
-		if (nbu_seek(ctx, 4, SEEK_CUR) == -1)
-			return -1;
+	s->postings = s->offsets + 8 * (NBU_SEARCH_BUCKETS + 1);
+	return 0;
+}
 
-		if (nbu_read_uint64(ctx, &folder_pos) == -1)
-			return -1;
+/* Load the search index from a file, or build it and save it there */
+static int
+nbu_search_load(struct nbu_ctx *ctx, const char *path)
+{
+	struct nbu_search_index *s;
+	size_t i;
+	int damaged;
+
+	/*
+	 * The items of damaged sections that could be read are indexed too.
+	 * The search then reports the damage. Such an index is not cached.
+	 */
+	damaged = 0;
+	if (nbu_read_section(ctx, NBU_SECTION_MEMOS) == -1)
+		damaged = 1;
+	if (nbu_read_section(ctx, NBU_SECTION_MESSAGES) == -1)
+		damaged = 1;
+	if (damaged)
+		path = NULL;
+
+	if ((s = calloc(1, sizeof *s)) == NULL) {
+		warn(NULL);
+		return -1;
+	}
 
-		if (nbu_tell(ctx, &pos) == -1)
-			return -1;
+	s->ndocs = ctx->memos.nitems;
+	for (i = 0; i < ctx->messages.nfolders; i++)
+		s->ndocs += ctx->folders[ctx->messages.first + i].items.nitems;
 
-		if ((folder = nbu_read_mms_folder(ctx, folder_pos)) == NULL)
-			return -1;
+	if (path != NULL &&
+	    nbu_read_index_file(&ctx->stats, &s->idx, AT_FDCWD, path) == 0 &&
+	    nbu_search_parse(ctx, s) == 0) {
+		NBU_DPRINTF("loaded search index %s\n", path);
+		ctx->search = s;
+		return 0;
+	}
 
-		STAILQ_INSERT_TAIL(ctx->mmses, folder, entries);
+	free(s->idx.data);
+	memset(&s->idx, 0, sizeof s->idx);
 
-		if (nbu_seek(ctx, pos, SEEK_SET) == -1)
-			return -1;
+	if (nbu_search_build(ctx, &s->idx) == -1) {
+		free(s->idx.data);
+		free(s);
+		return -1;
+	}
+
+	/* The index is only a cache, so failing to save it is not fatal */
+	if (path != NULL)
+		nbu_write_index_file(&s->idx, path);
+
+	if (nbu_search_parse(ctx, s) == -1) {
+		warnx("Invalid search index");
+		free(s->idx.data);
+		free(s);
+		return -1;
 	}
 
+	ctx->search = s;
 	return 0;
 }
 
-static int
-nbu_read_section(struct nbu_ctx *ctx, uint8_t guid[NBU_GUID_LEN], uint64_t pos)
+/* Return the item of a document */
+static size_t
+nbu_search_doc_item(struct nbu_ctx *ctx, size_t doc)
 {
+	const struct nbu_item_list *list;
 	size_t i;
 
-	for (i = 0; i < nitems(nbu_sections); i++) {
-		if (memcmp(guid, nbu_sections[i].guid, NBU_GUID_LEN) == 0)
-			return nbu_sections[i].read(ctx, pos);
+	list = &ctx->memos;
+	if (doc < list->nitems)
+		return list->first + doc;
+
+	doc -= list->nitems;
+	for (i = 0; i < ctx->messages.nfolders; i++) {
+		list = &ctx->folders[ctx->messages.first + i].items;
+		if (doc < list->nitems)
+			break;
+		doc -= list->nitems;
 	}
 
-	warnx("Unsupported backup section");
-	return -1;
+	return list->first + doc;
 }
 
+/* Decode the documents in a bucket */
 static int
-nbu_read_sections(struct nbu_ctx *ctx)
+nbu_search_get_bucket(struct nbu_ctx *ctx, uint32_t bucket, size_t **itemsp,
+    size_t *nitemsp)
 {
-	uint64_t pos;
-	uint32_t i, nsections;
-	uint8_t guid[NBU_GUID_LEN];
-
-	if (nbu_read_uint32(ctx, &nsections) == -1)
+	struct nbu_index *idx;
+	uint64_t end, start, u;
+	size_t *items, n, size;
+	void *p;
+
+	idx = &ctx->search->idx;
+	idx->pos = ctx->search->offsets + 8 * (size_t)bucket;
+	start = nbu_index_get_uint64(idx);
+	end = nbu_index_get_uint64(idx);
+
+	if (start > end || end > idx->len - ctx->search->postings) {
+		warnx("Invalid search index");
 		return -1;
+	}
 
-	NBU_DPRINTF("backup contains %" PRIu32 " sections\n", nsections);
-
-	for (i = 0; i < nsections; i++) {
-		if (nbu_read(ctx, guid, sizeof guid) == -1)
+	items = NULL;
+	n = size = 0;
+	u = 0;
+	idx->pos = ctx->search->postings + start;
+	idx->error = 0;
+
+	while (idx->pos < ctx->search->postings + end) {
+		u += nbu_index_get_varint(idx, ctx->search->postings + end);
+		if (idx->error || u >= ctx->search->ndocs) {
+			warnx("Invalid search index");
+			free(items);
 			return -1;
+		}
 
-		if (nbu_read_uint64(ctx, &pos) == -1)
-			return -1;
+		if (n == size) {
+			size = (size == 0) ? 64 : size * 2;
+			if ((p = reallocarray(items, size, sizeof *items)) ==
+			    NULL) {
+				warn(NULL);
+				free(items);
+				return -1;
+			}
+			items = p;
+		}
+		items[n++] = u;
+	}
 
-		/* Skip section length */
-		if (nbu_seek(ctx, 8, SEEK_CUR) == -1)
-			return -1;
+	*itemsp = items;
+	*nitemsp = n;
+	return 0;
+}
 
-		NBU_DPRINTF("section %" PRIu32 ": guid %s\n",
-		    i + 1, nbu_guid_to_string(guid));
+/* State of nbu_search() */
+struct nbu_search_query {
+	uint8_t		*text;
+	size_t		 len;
+	int		 all;		/* All items are candidates */
+	size_t		*items;
+	size_t		 nitems;
+	int		 (*func)(const struct nbu_item *, void *);
+	void		*arg;
+};
 
-		if (nbu_read_section(ctx, guid, pos) == -1)
-			return -1;
-	}
+static int
+nbu_compare_size(const void *a, const void *b)
+{
+	size_t sa, sb;
 
-	return 0;
+	sa = *(const size_t *)a;
+	sb = *(const size_t *)b;
+	return (sa < sb) ? -1 : (sa > sb);
 }
 
-int
-nbu_open(struct nbu_ctx **ctxp, const char *path)
+/*
+ * Find the items that contain all trigrams of the query. They still have to
+ * be checked, because different trigrams can share a bucket and the trigrams
+ * need not be in the right order.
+ */
+static int
+nbu_search_candidates(struct nbu_ctx *ctx, struct nbu_search_query *q)
 {
-	struct nbu_ctx *ctx;
-	uint64_t pos;
-	int ret;
+	uint32_t *buckets;
+	size_t *items, i, j, k, m, n, nbuckets;
 
-	ret = -1;
+	q->items = NULL;
+	q->nitems = 0;
 
-	if ((ctx = calloc(1, sizeof *ctx)) == NULL) {
-		warn(NULL);
-		goto out;
+	/* A short query can be anywhere */
+	if (q->len < 3) {
+		q->all = 1;
+		return 0;
 	}
 
-	if ((ctx->fp = fopen(path, "r")) == NULL) {
-		warn("fopen: %s", path);
-		goto out;
+	if ((buckets = reallocarray(NULL, q->len, sizeof *buckets)) == NULL) {
+		warn(NULL);
+		return -1;
 	}
 
-	if (nbu_seek(ctx, 20, SEEK_SET) == -1)
-		goto out;
-
-	if (nbu_read_uint64(ctx, &pos) == -1)
-		goto out;
-
-	if (nbu_seek(ctx, pos + 20, SEEK_SET) == -1)
-		goto out;
-
-	if (nbu_read_file_time(ctx, &ctx->backup_time) == -1)
-		goto out;
-
-	if ((ctx->phone_imei = nbu_read_utf16(ctx)) == NULL)
-		goto out;
-
-	if ((ctx->phone_model = nbu_read_utf16(ctx)) == NULL)
-		goto out;
-
-	if ((ctx->phone_name = nbu_read_utf16(ctx)) == NULL)
-		goto out;
+	nbuckets = nbu_search_buckets(buckets, q->text, q->len);
 
-	if ((ctx->phone_firmware = nbu_read_utf16(ctx)) == NULL)
-		goto out;
+	for (i = 0; i < nbuckets; i++) {
+		if (nbu_search_get_bucket(ctx, buckets[i], &items, &n) == -1) {
+			free(q->items);
+			free(buckets);
+			return -1;
+		}
 
-	if ((ctx->phone_language = nbu_read_utf16(ctx)) == NULL)
-		goto out;
+		if (i == 0) {
+			q->items = items;
+			q->nitems = n;
+		} else {
+			/* Both lists are sorted */
+			for (j = k = m = 0; j < q->nitems && k < n;)
+				if (q->items[j] < items[k])
+					j++;
+				else if (q->items[j] > items[k])
+					k++;
+				else {
+					q->items[m++] = q->items[j++];
+					k++;
+				}
+			q->nitems = m;
+			free(items);
+		}
 
-#ifdef NBU_DEBUG
-	nbu_print_phone_info(ctx);
-#endif
+		if (q->nitems == 0)
+			break;
+	}
 
-	if (nbu_seek(ctx, 20, SEEK_CUR) == -1)
-		goto out;
+	free(buckets);
 
-	if (nbu_read_sections(ctx) == -1)
-		goto out;
+	for (i = 0; i < q->nitems; i++)
+		q->items[i] = nbu_search_doc_item(ctx, q->items[i]);
+	qsort(q->items, q->nitems, sizeof *q->items, nbu_compare_size);
+	return 0;
+}
 
-	ret = 0;
+static int
+nbu_search_filter(struct nbu_visitor *v, size_t item)
+{
+	struct nbu_search_query *q;
 
-out:
-	*ctxp = ctx;
-	return ret;
+	q = v->arg;
+	if (q->all)
+		return 1;
+	if (q->nitems == 0)
+		return 0;
+	return bsearch(&item, q->items, q->nitems, sizeof *q->items,
+	    nbu_compare_size) != NULL;
 }
 
-void
-nbu_close(struct nbu_ctx *ctx)
+/* Pass on an item if its text contains the query, ignoring ASCII case */
+static int
+nbu_search_match(const struct nbu_item *item, void *arg)
 {
-	if (ctx == NULL)
-		return;
+	struct nbu_search_query *q;
+	size_t i, j;
 
-	if (ctx->fp != NULL)
-		fclose(ctx->fp);
+	q = arg;
 
-	free(ctx->phone_imei);
-	free(ctx->phone_model);
-	free(ctx->phone_name);
-	free(ctx->phone_firmware);
-	free(ctx->phone_language);
-	nbu_free_folder_list(ctx->bookmarks);
-	nbu_free_folder_list(ctx->messages);
-	nbu_free_folder_list(ctx->mmses);
-	nbu_free_item_list(ctx->calendar);
-	nbu_free_item_list(ctx->contacts);
-	nbu_free_item_list(ctx->memos);
-	free(ctx);
+	for (i = 0; i + q->len <= item->len; i++) {
+		for (j = 0; j < q->len; j++)
+			if (nbu_search_lower(item->data[i + j]) != q->text[j])
+				break;
+		if (j == q->len)
+			return q->func(item, q->arg);
+	}
+
+	return 0;
 }
 
+/*
+ * Call a function for each selected message and memo whose text contains the
+ * query. ASCII case is ignored. The item is passed on as with nbu_visit()
+ * and NBU_VISIT_UTF8. The search index is loaded from the file at path, if it
+ * is usable, and otherwise built and saved there. If path is NULL, the index
+ * is only kept in memory. The items of a damaged section that could be read
+ * are searched as well, but -1 is returned.
+ */
 int
-nbu_export(struct nbu_ctx *ctx, const char *path)
+nbu_search(struct nbu_ctx *ctx, const char *query, const char *path,
+    int (*func)(const struct nbu_item *, void *), void *arg)
 {
-	int dfd, ret;
+	struct nbu_search_query q;
+	struct nbu_visitor v;
+	size_t i;
+	uint64_t t;
+	int ret, sections;
 
-	if (mkdir(path, 0777) == -1 && errno != EEXIST) {
-		warn("mkdir: %s", path);
+	t = nbu_now();
+
+	if (ctx->search == NULL && nbu_search_load(ctx, path) == -1)
 		return -1;
-	}
 
-	if ((dfd = open(path, O_RDONLY | O_DIRECTORY)) == -1) {
-		warn("open: %s", path);
+	memset(&q, 0, sizeof q);
+	q.len = strlen(query);
+	q.func = func;
+	q.arg = arg;
+
+	if ((q.text = malloc(q.len + 1)) == NULL) {
+		warn(NULL);
 		return -1;
 	}
 
-	ret = 0;
-
-	if (nbu_export_calendar(ctx, dfd) == -1)
-		ret = -1;
+	for (i = 0; i < q.len; i++)
+		q.text[i] = nbu_search_lower(query[i]);
 
-	if (nbu_export_contacts(ctx, dfd) == -1)
-		ret = -1;
+	if (nbu_search_candidates(ctx, &q) == -1) {
+		free(q.text);
+		return -1;
+	}
 
-	if (nbu_export_memos(ctx, dfd) == -1)
-		ret = -1;
+	ctx->stats.read_time += nbu_now() - t;
 
-	if (nbu_export_messages(ctx, dfd) == -1)
-		ret = -1;
+	memset(&v, 0, sizeof v);
+	v.ctx = ctx;
+	v.flags = NBU_VISIT_UTF8;
+	v.func = nbu_search_match;
+	v.arg = &q;
+	v.filter = nbu_search_filter;
 
-	if (nbu_export_mms(ctx, dfd) == -1)
-		ret = -1;
+	/* Only messages and memos are indexed */
+	sections = ctx->select_sections;
+	ctx->select_sections &= NBU_EXPORT_MEMOS | NBU_EXPORT_MESSAGES;
+	ret = nbu_run_visitor(&v);
+	ctx->select_sections = sections;
 
-	close(dfd);
+	free(v.buf);
+	free(q.items);
+	free(q.text);
 	return ret;
 }
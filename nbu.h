@@ -17,10 +17,106 @@
 #ifndef NBU_H
 #define NBU_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+#define NBU_EXPORT_CALENDAR	0x01
+#define NBU_EXPORT_CONTACTS	0x02
+#define NBU_EXPORT_MEMOS	0x04
+#define NBU_EXPORT_MESSAGES	0x08
+#define NBU_EXPORT_MMS		0x10
+#define NBU_EXPORT_BOOKMARKS	0x20
+#define NBU_EXPORT_GROUPS	0x40
+#define NBU_EXPORT_ALL		0x7f
+
+/* Table formats for contacts and calendar items */
+#define NBU_TABLE_NONE		0
+#define NBU_TABLE_CSV		1
+#define NBU_TABLE_NDJSON	2
+
+/* Convert UTF-16 items to UTF-8 before passing them on */
+#define NBU_VISIT_UTF8		0x01
+
 struct nbu_ctx;
 
-int nbu_open(struct nbu_ctx **, const char *);
-int nbu_close(struct nbu_ctx *);
+/* Times are in nanoseconds */
+struct nbu_stats {
+	uint64_t	 bytes_read;	/* Parsed from the backup and exported */
+	uint64_t	 bytes_written;
+	uint64_t	 syscalls;
+	uint64_t	 seeks;
+	uint64_t	 files;		/* Files exported */
+	uint64_t	 files_skipped;	/* Files already up to date */
+	uint64_t	 files_linked;	/* Files linked to the store */
+	uint64_t	 bytes_linked;	/* Data not written due to linking */
+
+	/* Items per section */
+	uint64_t	 nbookmarks;
+	uint64_t	 ncalendar;
+	uint64_t	 ncontacts;
+	uint64_t	 ngroups;
+	uint64_t	 nmemos;
+	uint64_t	 nmessages;
+	uint64_t	 nmms;
+
+	uint64_t	 open_time;
+	uint64_t	 read_time;	/* Reading sections */
+	uint64_t	 export_time;
+
+	/* Summed over all jobs; only measured if enabled */
+	uint64_t	 transcode_time;
+	uint64_t	 compress_time;
+	uint64_t	 write_time;
+};
+
+/*
+ * An item passed on by nbu_visit(). The data points into the backup, or, if
+ * it was converted, into a buffer that is reused for the next item.
+ */
+struct nbu_item {
+	int		 section;	/* One of NBU_EXPORT_* */
+	const char	*folder;	/* Folder, or NULL if there are none */
+	size_t		 index;		/* Starts at 1 in each folder or section */
+	const uint8_t	*data;
+	size_t		 len;
+	int		 utf16;		/* The data is UTF-16LE */
+};
+
+/* The state of a section, as reported by nbu_check() */
+struct nbu_section_report {
+	const char	*name;
+	uint64_t	 pos;		/* As stated in the section directory */
+	uint64_t	 len;
+	size_t		 nfolders;	/* Folders and items found */
+	size_t		 nitems;
+	uint32_t	 nitems_stated;	/* As stated in the section header */
+	int		 damaged;
+};
+
+int nbu_open(struct nbu_ctx **, const char *, const char *);
+int nbu_open_fd(struct nbu_ctx **, int, const char *);
+int nbu_clone(struct nbu_ctx **, struct nbu_ctx *);
+void nbu_close(struct nbu_ctx *);
+void nbu_set_jobs(struct nbu_ctx *, int);
+void nbu_select_sections(struct nbu_ctx *, int);
+int nbu_select_folder(struct nbu_ctx *, const char *);
+void nbu_select_items(struct nbu_ctx *, size_t, size_t);
+void nbu_set_timing(struct nbu_ctx *, int);
+void nbu_set_incremental(struct nbu_ctx *, int);
+int nbu_set_store(struct nbu_ctx *, const char *);
+void nbu_set_table_format(struct nbu_ctx *, int);
+void nbu_set_message_columns(struct nbu_ctx *, int);
+void nbu_set_mms_parts(struct nbu_ctx *, int);
+void nbu_set_compression(struct nbu_ctx *, int);
+void nbu_get_stats(struct nbu_ctx *, struct nbu_stats *);
+void nbu_set_debug(int);
 int nbu_export(struct nbu_ctx *, const char *);
+int nbu_export_tar(struct nbu_ctx *, int);
+int nbu_visit(struct nbu_ctx *, int, int (*)(const struct nbu_item *, void *),
+    void *);
+int nbu_check(struct nbu_ctx *,
+    int (*)(const struct nbu_section_report *, void *), void *);
+int nbu_search(struct nbu_ctx *, const char *, const char *,
+    int (*)(const struct nbu_item *, void *), void *);
 
 #endif
@@ -0,0 +1,194 @@
+/*
+ * Copyright (c) 2026 Tim van der Molen <tim@kariliq.nl>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A simple thread pool. Jobs are run in the order in which they were added.
+ * A pool with only one thread does not start any threads at all; it runs
+ * each job as soon as it is added.
+ */
+
+#include <sys/queue.h>
+
+#include <err.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "pool.h"
+
+struct pool_job {
+	int		 (*func)(void *);
+	void		*arg;
+	STAILQ_ENTRY(pool_job) entries;
+};
+
+STAILQ_HEAD(pool_job_list, pool_job);
+
+struct pool {
+	pthread_t	*threads;
+	int		 nthreads;
+	pthread_mutex_t	 mtx;
+	pthread_cond_t	 job_cond;
+	pthread_cond_t	 done_cond;
+	struct pool_job_list jobs;
+	int		 npending;
+	int		 failed;
+	int		 quit;
+};
+
+static void *
+pool_run(void *arg)
+{
+	struct pool *pool;
+	struct pool_job *job;
+	int ret;
+
+	pool = arg;
+	pthread_mutex_lock(&pool->mtx);
+
+	for (;;) {
+		while (STAILQ_EMPTY(&pool->jobs) && !pool->quit)
+			pthread_cond_wait(&pool->job_cond, &pool->mtx);
+
+		if ((job = STAILQ_FIRST(&pool->jobs)) == NULL)
+			break;
+
+		STAILQ_REMOVE_HEAD(&pool->jobs, entries);
+		pthread_mutex_unlock(&pool->mtx);
+
+		ret = job->func(job->arg);
+		free(job);
+
+		pthread_mutex_lock(&pool->mtx);
+		if (ret == -1)
+			pool->failed = 1;
+		if (--pool->npending == 0)
+			pthread_cond_broadcast(&pool->done_cond);
+	}
+
+	pthread_mutex_unlock(&pool->mtx);
+	return NULL;
+}
+
+struct pool *
+pool_new(int nthreads)
+{
+	struct pool *pool;
+	int error;
+
+	if ((pool = calloc(1, sizeof *pool)) == NULL) {
+		warn(NULL);
+		return NULL;
+	}
+
+	STAILQ_INIT(&pool->jobs);
+	pthread_mutex_init(&pool->mtx, NULL);
+	pthread_cond_init(&pool->job_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+
+	if (nthreads <= 1)
+		return pool;
+
+	if ((pool->threads = calloc(nthreads, sizeof *pool->threads)) ==
+	    NULL) {
+		warn(NULL);
+		pool_free(pool);
+		return NULL;
+	}
+
+	for (; pool->nthreads < nthreads; pool->nthreads++) {
+		error = pthread_create(&pool->threads[pool->nthreads], NULL,
+		    pool_run, pool);
+		if (error != 0) {
+			warnc(error, "pthread_create");
+			pool_free(pool);
+			return NULL;
+		}
+	}
+
+	return pool;
+}
+
+void
+pool_free(struct pool *pool)
+{
+	int i;
+
+	if (pool == NULL)
+		return;
+
+	if (pool->threads != NULL) {
+		pthread_mutex_lock(&pool->mtx);
+		pool->quit = 1;
+		pthread_cond_broadcast(&pool->job_cond);
+		pthread_mutex_unlock(&pool->mtx);
+
+		for (i = 0; i < pool->nthreads; i++)
+			pthread_join(pool->threads[i], NULL);
+
+		free(pool->threads);
+	}
+
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->job_cond);
+	pthread_mutex_destroy(&pool->mtx);
+	free(pool);
+}
+
+/*
+ * Add a job to the pool. If the job cannot be queued, it is run immediately
+ * instead.
+ */
+void
+pool_add(struct pool *pool, int (*func)(void *), void *arg)
+{
+	struct pool_job *job;
+
+	if (pool->threads != NULL && (job = malloc(sizeof *job)) != NULL) {
+		job->func = func;
+		job->arg = arg;
+
+		pthread_mutex_lock(&pool->mtx);
+		STAILQ_INSERT_TAIL(&pool->jobs, job, entries);
+		pool->npending++;
+		pthread_cond_signal(&pool->job_cond);
+		pthread_mutex_unlock(&pool->mtx);
+		return;
+	}
+
+	if (func(arg) == -1) {
+		pthread_mutex_lock(&pool->mtx);
+		pool->failed = 1;
+		pthread_mutex_unlock(&pool->mtx);
+	}
+}
+
+/*
+ * Wait until all jobs have been run. Return -1 if any job has failed since
+ * the previous call.
+ */
+int
+pool_wait(struct pool *pool)
+{
+	int failed;
+
+	pthread_mutex_lock(&pool->mtx);
+	while (pool->npending > 0)
+		pthread_cond_wait(&pool->done_cond, &pool->mtx);
+	failed = pool->failed;
+	pool->failed = 0;
+	pthread_mutex_unlock(&pool->mtx);
+	return failed ? -1 : 0;
+}
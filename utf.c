@@ -17,8 +17,18 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define UTF_SSE2
+#elif defined(__aarch64__) && defined(__ARM_NEON) && !defined(__ARM_BIG_ENDIAN)
+#include <arm_neon.h>
+#define UTF_NEON
+#endif
+
 #include "utf.h"
 
+#define UTF_BLOCK_LEN 8
+
 size_t
 utf8_encode(uint8_t *buf, uint32_t cp)
 {
@@ -54,6 +64,57 @@ utf8_encode(uint8_t *buf, uint32_t cp)
 	return 0;
 }
 
+/*
+ * Decode the UTF-8 sequence at the start of the buffer. Return its length, or
+ * 0 if it is invalid, overlong or incomplete.
+ */
+size_t
+utf8_decode(uint32_t *cp, const uint8_t *buf, size_t len)
+{
+	uint32_t c, min;
+	size_t i, n;
+
+	if (len == 0)
+		return 0;
+
+	c = buf[0];
+	if (c <= 0x7f) {
+		*cp = c;
+		return 1;
+	}
+
+	if ((c & 0xe0) == 0xc0) {
+		n = 2;
+		min = 0x80;
+		c &= 0x1f;
+	} else if ((c & 0xf0) == 0xe0) {
+		n = 3;
+		min = 0x800;
+		c &= 0x0f;
+	} else if ((c & 0xf8) == 0xf0) {
+		n = 4;
+		min = 0x10000;
+		c &= 0x07;
+	} else
+		return 0;
+
+	if (len < n)
+		return 0;
+
+	for (i = 1; i < n; i++) {
+		if ((buf[i] & 0xc0) != 0x80)
+			return 0;
+		c = c << 6 | (buf[i] & 0x3f);
+	}
+
+	if (c < min || c > UTF_CODEPOINT_MAX ||
+	    (c >= UTF_HIGH_SURROGATE_MIN && c <= UTF_LOW_SURROGATE_MAX))
+		return 0;
+
+	*cp = c;
+	return n;
+}
+
 int
 utf16_is_surrogate(uint16_t u)
 {
@@ -134,3 +195,160 @@ utf16_convert_string_to_utf8(uint8_t *buf, size_t bufsize,
 
 	return buflen;
 }
+
+#if defined(UTF_SSE2) || defined(UTF_NEON)
+/*
+ * Convert a block of UTF_BLOCK_LEN little-endian code units if they are all
+ * either ASCII or encoded with two UTF-8 bytes. Return the number of bytes
+ * written, or 0 if the block must be converted one code unit at a time.
+ *
+ * The SIMD loads take the code units in memory order, so this is only used
+ * on little-endian hosts.
+ */
+static size_t
+utf16le_convert_block_to_utf8(uint8_t *buf, const uint8_t *utf16)
+{
+#ifdef UTF_SSE2
+	__m128i lead, trail, u, zero;
+	int hi7, hi5;
+
+	u = _mm_loadu_si128((const __m128i *)utf16);
+	zero = _mm_setzero_si128();
+
+	/* Bitmasks of the code units below 0x80 and below 0x800 */
+	hi7 = _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(u,
+	    _mm_set1_epi16((short)0xff80)), zero));
+	hi5 = _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(u,
+	    _mm_set1_epi16((short)0xf800)), zero));
+
+	if (hi7 == 0xffff) {
+		if (_mm_movemask_epi8(_mm_cmpeq_epi16(u, zero)) != 0)
+			return 0;
+		_mm_storel_epi64((__m128i *)buf, _mm_packus_epi16(u, u));
+		return UTF_BLOCK_LEN;
+	}
+
+	if (hi7 == 0 && hi5 == 0xffff) {
+		lead = _mm_or_si128(_mm_srli_epi16(u, 6), _mm_set1_epi16(0xc0));
+		trail = _mm_or_si128(_mm_and_si128(u, _mm_set1_epi16(0x3f)),
+		    _mm_set1_epi16(0x80));
+		_mm_storeu_si128((__m128i *)buf,
+		    _mm_or_si128(lead, _mm_slli_epi16(trail, 8)));
+		return 2 * UTF_BLOCK_LEN;
+	}
+
+	return 0;
+#else
+	uint16x8_t u;
+	uint8x8x2_t out;
+	uint16_t min, max;
+
+	u = vreinterpretq_u16_u8(vld1q_u8(utf16));
+	min = vminvq_u16(u);
+	max = vmaxvq_u16(u);
+
+	if (max < 0x80) {
+		if (min == 0)
+			return 0;
+		vst1_u8(buf, vmovn_u16(u));
+		return UTF_BLOCK_LEN;
+	}
+
+	if (min >= 0x80 && max < 0x800) {
+		out.val[0] = vmovn_u16(vorrq_u16(vshrq_n_u16(u, 6),
+		    vdupq_n_u16(0xc0)));
+		out.val[1] = vmovn_u16(vorrq_u16(vandq_u16(u,
+		    vdupq_n_u16(0x3f)), vdupq_n_u16(0x80)));
+		vst2_u8(buf, out);
+		return 2 * UTF_BLOCK_LEN;
+	}
+
+	return 0;
+#endif
+}
+#endif
+
+static uint16_t
+utf16le_load(const uint8_t *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+/*
+ * Convert at most *lenp little-endian UTF-16 code units to UTF-8, stopping at
+ * a NUL code unit. The code units need not be aligned. The buffer must have
+ * room for 3 * *lenp bytes; the result is not NUL-terminated.
+ *
+ * Return the number of bytes written and set *lenp to the number of code units
+ * converted. The latter is only less than before if a NUL code unit was found.
+ */
+size_t
+utf16le_convert_to_utf8(uint8_t *buf, const uint8_t *utf16, size_t *lenp)
+{
+	size_t buflen, end, i, len, n;
+	uint32_t cp;
+	uint16_t u1, u2;
+
+	buflen = 0;
+	len = *lenp;
+
+	for (i = 0; i < len;) {
+		end = len;
+
+#if defined(UTF_SSE2) || defined(UTF_NEON)
+		if (len - i >= UTF_BLOCK_LEN) {
+			n = utf16le_convert_block_to_utf8(buf + buflen,
+			    utf16 + 2 * i);
+			if (n > 0) {
+				buflen += n;
+				i += UTF_BLOCK_LEN;
+				continue;
+			}
+			/* Convert this block one code unit at a time */
+			end = i + UTF_BLOCK_LEN;
+		}
+#endif
+
+		for (; i < end; i += n) {
+			if ((u1 = utf16le_load(utf16 + 2 * i)) == 0) {
+				*lenp = i;
+				return buflen;
+			}
+
+			u2 = (i + 1 < len) ? utf16le_load(utf16 + 2 * i + 2) : 0;
+			if ((n = utf16_decode(&cp, u1, u2)) == 0)
+				n = 1;
+
+			buflen += utf8_encode(buf + buflen, cp);
+		}
+	}
+
+	return buflen;
+}
+
+/*
+ * Return the number of bytes that utf16le_convert_to_utf8() writes for the
+ * same code units.
+ */
+size_t
+utf16le_utf8_size(const uint8_t *utf16, size_t len)
+{
+	size_t i, n, size;
+	uint32_t cp;
+	uint16_t u1, u2;
+
+	size = 0;
+
+	for (i = 0; i < len; i += n) {
+		if ((u1 = utf16le_load(utf16 + 2 * i)) == 0)
+			break;
+
+		u2 = (i + 1 < len) ? utf16le_load(utf16 + 2 * i + 2) : 0;
+		if ((n = utf16_decode(&cp, u1, u2)) == 0)
+			n = 1;
+
+		size += utf8_encode(NULL, cp);
+	}
+
+	return size;
+}
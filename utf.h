@@ -26,6 +26,7 @@
 #define UTF_CODEPOINT_MAX	0x10ffffU
 
 size_t	utf8_encode(uint8_t *, uint32_t);
+size_t	utf8_decode(uint32_t *, const uint8_t *, size_t);
 
 int	utf16_is_surrogate(uint16_t);
 int	utf16_is_high_surrogate(uint16_t);
@@ -34,5 +35,7 @@ int	utf16_is_low_surrogate(uint16_t);
 uint32_t utf16_decode_surrogate_pair(uint16_t, uint16_t);
 size_t	utf16_decode(uint32_t *, uint16_t, uint16_t);
 size_t	utf16_convert_string_to_utf8(uint8_t *, size_t, const uint16_t *);
+size_t	utf16le_convert_to_utf8(uint8_t *, const uint8_t *, size_t *);
+size_t	utf16le_utf8_size(const uint8_t *, size_t);
 
 #endif